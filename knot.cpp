@@ -14,17 +14,37 @@
 
 #include <errno.h>
 #include <memory.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
 
+#include <algorithm>
+#include <condition_variable>
 #include <deque>
+#include <functional>
 #include <future>
 #include <iostream>
+#include <list>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <random>
 #include <sstream>
 #include <string>
 #include <thread>
+#include <unordered_map>
+
+#if defined(__AVX2__)
+#   include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 2 )
+#   include <emmintrin.h>
+#   define KNOT_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#   include <arm_neon.h>
+#endif
 
 #if defined(_WIN32)
 
@@ -64,6 +84,7 @@
 #   define SHUTDOWN(A)               ::shutdown((A),2)
 #   define SHUTDOWN_R(A)             ::shutdown((A),0)
 #   define SHUTDOWN_W(A)             ::shutdown((A),1)
+#   define POLL(A,B,C)               ::WSAPoll((A),(B),(C))
 
 #   define inet_pton InetPtonA
 
@@ -86,7 +107,7 @@
 
             if( mode == F_SETFL ) // set socket status flags
             {
-                u_long iMode = ( value & O_NONBLOCK ? 0 : 1 );
+                u_long iMode = ( value & O_NONBLOCK ? 1 : 0 );
 
                 bool result = ( ioctlsocket( sockfd, FIONBIO, &iMode ) == NO_ERROR );
 
@@ -105,11 +126,56 @@
 #   include <fcntl.h>
 #   include <sys/types.h>
 #   include <sys/socket.h>
+#   include <sys/uio.h>
+#   include <sys/mman.h>
+#   include <sys/un.h>
 #   include <netdb.h>
 #   include <unistd.h>    //close
 
+#   include <poll.h>
 #   include <arpa/inet.h> //inet_addr, inet_pton
 #   include <netinet/tcp.h> // TCP_NODELAY 
+#   include <netinet/udp.h>
+
+#   if defined(__linux__)
+#       ifndef UDP_SEGMENT
+#           define UDP_SEGMENT 103  // linux 4.18+
+#       endif
+#       ifndef UDP_GRO
+#           define UDP_GRO 104      // linux 5.0+
+#       endif
+#       ifndef SOL_UDP
+#           define SOL_UDP 17
+#       endif
+#       include <linux/errqueue.h>
+#       include <sched.h>
+#       include <signal.h>
+#       include <sys/eventfd.h>
+#       include <sys/inotify.h>
+#       include <sys/sendfile.h>
+#       include <sys/syscall.h>
+#       ifndef MFD_CLOEXEC
+#           define MFD_CLOEXEC 1    // linux 3.17+
+#       endif
+#       ifndef MPOL_LOCAL
+#           define MPOL_LOCAL 4     // linux 3.8+
+#       endif
+#       ifndef SO_ZEROCOPY
+#           define SO_ZEROCOPY 60   // linux 4.14+
+#       endif
+#       ifndef SO_COOKIE
+#           define SO_COOKIE 57     // linux 4.12+
+#       endif
+#       ifndef MSG_ZEROCOPY
+#           define MSG_ZEROCOPY 0x4000000
+#       endif
+#       ifndef SO_EE_ORIGIN_ZEROCOPY
+#           define SO_EE_ORIGIN_ZEROCOPY 5
+#       endif
+#       ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#           define SO_EE_CODE_ZEROCOPY_COPIED 1
+#       endif
+#   endif
 
 #   define INIT()                    do {} while(0)
 //#   define SOCKET(A,B,C)             ::socket((A),(B),(C))
@@ -129,10 +195,10 @@
 #   define SHUTDOWN(A)               ::shutdown((A),SHUT_RDWR)
 #   define SHUTDOWN_R(A)             ::shutdown((A),SHUT_RD)
 #   define SHUTDOWN_W(A)             ::shutdown((A),SHUT_WR)
+#   define POLL(A,B,C)               ::poll((A),(B),(C))
 
 #   define $windows $no
 #   define $welse   $yes
-
 #endif
 
 #define $yes(...) __VA_ARGS__
@@ -150,17 +216,40 @@ namespace knot
 
     namespace
     {
+        // adaptive concurrency limit of a listener, shared with the handler threads it admitted
+        struct admission_t
+        {
+            std::mutex lock;
+            admission config;               // guarded by lock, as the fields below
+            std::string rejection;          // pre-serialized 503
+            double limit, latency, min_latency, min_since, last_decrease;
+
+            std::atomic<unsigned> cap;      // limit, as read by the accept thread
+            std::atomic<unsigned> in_flight;
+            std::atomic<size_t> admitted, shed;
+        };
+
         struct control_t {
             int master_fd;
             std::string port;
+            std::string path;   // unix listeners: "unix:..." address, the socket file is removed on shutdown
+            std::string address; // as matched by adopted sockets, see listener_key()
+            sockopts opts;
             volatile bool ready;
             volatile bool exiting;
             volatile bool finished;
+            volatile bool handed_over; // stop accepting, but serve what was already accepted
             void (*callback)( int master_fd, int child_fd, std::string client_addr_ip, std::string client_addr_port );
+            void (*peer_callback)( int master_fd, int child_fd, const peer &client );
+            std::shared_ptr<admission_t> admission; // null unless admit() was called. atomic_load/atomic_store only
         };
 
         std::map<int,control_t *> listeners;
 
+        struct core_group_t;
+        std::map<int,core_group_t *> core_groups; // thread-per-core listeners
+        void stop_cores( core_group_t *group );
+
         $windows(
         struct initialize_winsock {
             initialize_winsock() {
@@ -175,6 +264,209 @@ namespace knot
         size_t bytes_sent = 0;
         size_t bytes_recv = 0;
         const std::string white_spaces( " \f\n\r\t\v" );
+
+        double now()
+        {
+            return std::chrono::duration<double>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+        }
+
+        bool would_block()
+        {
+            $windows( return WSAGetLastError() == WSAEWOULDBLOCK; )
+            $welse( return errno == EAGAIN || errno == EWOULDBLOCK; )
+        }
+
+        bool in_progress()
+        {
+            $windows( return WSAGetLastError() == WSAEWOULDBLOCK; )
+            $welse( return errno == EINPROGRESS; )
+        }
+
+        // writes whole buffer, looping on partial writes
+        bool send_all( int &sockfd, const char *data, size_t len )
+        {
+            int flags = $windows(0) $welse( MSG_NOSIGNAL );
+
+            while( len > 0 )
+            {
+                int sent = SEND( sockfd, data, len, flags );
+                if( sent < 0 && would_block() )
+                {
+                    // non-blocking socket (eg, shared with a reactor): wait until writable
+                    pollfd p = { sockfd, POLLOUT, 0 };
+                    POLL( &p, 1, -1 );
+                    continue;
+                }
+                if( sent <= 0 )
+                    return false;
+
+                knot::bytes_sent += sent;
+                data += sent;
+                len -= sent;
+            }
+
+            return true;
+        }
+
+        // one gathered write of up to gather_max parts, the first skipping its already sent bytes. -1 on error or would block
+        const size_t gather_max = 64;
+        long send_gather( int sockfd, const span *parts, size_t count, size_t skip )
+        {
+            size_t n = count < gather_max ? count : gather_max;
+#if defined(_WIN32)
+            WSABUF bufs[ gather_max ];
+            for( size_t i = 0; i < n; ++i )
+                bufs[i].buf = (char *)parts[i].ptr + ( i ? 0 : skip ), bufs[i].len = ULONG( parts[i].len - ( i ? 0 : skip ) );
+            DWORD written = 0;
+            return WSASend( sockfd, bufs, DWORD( n ), &written, 0, 0, 0 ) == 0 ? long( written ) : -1;
+#else
+            iovec iov[ gather_max ];
+            for( size_t i = 0; i < n; ++i )
+                iov[i].iov_base = (char *)parts[i].ptr + ( i ? 0 : skip ), iov[i].iov_len = parts[i].len - ( i ? 0 : skip );
+            msghdr msg;
+            memset( &msg, 0, sizeof( msg ) );
+            msg.msg_iov = iov;
+            msg.msg_iovlen = n;
+            return long( ::sendmsg( sockfd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT ) ); // never blocks, so callers can honor timeouts
+#endif
+        }
+
+        bool set_nonblocking( int sockfd, bool enabled )
+        {
+            int flags = fcntl( sockfd, F_GETFL, 0 );
+            return fcntl( sockfd, F_SETFL, enabled ? flags | O_NONBLOCK : flags & ~O_NONBLOCK ) != -1;
+        }
+
+        // loopback udp socket connected to itself. lets other threads interrupt a poll()
+        int make_wakeup()
+        {
+            sockaddr_in addr;
+            socklen_t len = sizeof( addr );
+            memset( &addr, 0, sizeof( addr ) );
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+            int fd = ::socket( AF_INET, SOCK_DGRAM, 0 );
+            if( fd < 0 )
+                return -1;
+
+            if( BIND( fd, (sockaddr *)&addr, sizeof( addr ) ) != 0 ||
+                getsockname( fd, (sockaddr *)&addr, &len ) != 0 ||
+                CONNECT( fd, (sockaddr *)&addr, sizeof( addr ) ) != 0 ||
+                !set_nonblocking( fd, true ) )
+            {
+                CLOSE( fd );
+                return -1;
+            }
+
+            return fd;
+        }
+
+        void wakeup( int fd )
+        {
+            char byte = 0;
+            SEND( fd, &byte, 1, 0 );
+        }
+
+        void drain_wakeup( int fd )
+        {
+            char bytes[ 64 ];
+            while( RECV( fd, bytes, sizeof( bytes ), 0 ) > 0 )
+                ;
+        }
+
+        // "unix:/path" and "unix:@name" addresses
+        bool is_unix( const std::string &address )
+        {
+            return address.compare( 0, 5, "unix:" ) == 0;
+        }
+
+#if !defined(_WIN32)
+        bool unix_address( const std::string &address, sockaddr_un &sun, socklen_t &len )
+        {
+            std::string path = address.substr( 5 );
+            if( path.empty() || path.size() >= sizeof( sun.sun_path ) )
+                return false;
+
+            memset( &sun, 0, sizeof( sun ) );
+            sun.sun_family = AF_UNIX;
+            memcpy( sun.sun_path, path.data(), path.size() );
+            len = socklen_t( offsetof( sockaddr_un, sun_path ) + path.size() + 1 );
+
+            if( path[0] == '@' )
+            {
+#   if defined(__linux__)
+                sun.sun_path[0] = '\0'; // abstract namespace: no file, name is not nul terminated
+                len -= 1;
+#   else
+                return false;
+#   endif
+            }
+            return true;
+        }
+#endif
+
+        // credentials of the process at the other end of a unix socket
+        void peer_credentials( int fd, peer &out )
+        {
+            out.pid = out.uid = out.gid = -1;
+#if defined(__linux__)
+            ucred cred;
+            socklen_t len = sizeof( cred );
+            if( GETSOCKOPT( fd, SOL_SOCKET, SO_PEERCRED, &cred, &len ) == 0 )
+                out.pid = cred.pid, out.uid = cred.uid, out.gid = cred.gid;
+#elif !defined(_WIN32)
+            uid_t uid;
+            gid_t gid;
+            if( getpeereid( fd, &uid, &gid ) == 0 )
+                out.uid = uid, out.gid = gid;
+#endif
+        }
+
+        void to_peer( const sockaddr *sa, peer &out )
+        {
+            memset( &out, 0, sizeof( out ) );
+            out.pid = out.uid = out.gid = -1;
+            if( sa->sa_family == AF_INET )
+            {
+                const sockaddr_in *in = (const sockaddr_in *)sa;
+                out.family = 4;
+                out.port_number = ntohs( in->sin_port );
+                memcpy( out.addr, &in->sin_addr, 4 );
+            }
+            else if( sa->sa_family == AF_INET6 )
+            {
+                const sockaddr_in6 *in6 = (const sockaddr_in6 *)sa;
+                out.family = 6;
+                out.port_number = ntohs( in6->sin6_port );
+                memcpy( out.addr, &in6->sin6_addr, 16 );
+            }
+#if !defined(_WIN32)
+            else if( sa->sa_family == AF_UNIX )
+                out.family = 1;
+#endif
+        }
+
+        // accepts without formatting anything. children keep blocking mode, as the blocking api expects
+        int accept_peer( int master_fd, peer &client )
+        {
+            sockaddr_storage addr;
+            socklen_t len = sizeof( addr );
+#if defined(__linux__) || defined(__FreeBSD__)
+            int child_fd = ::accept4( master_fd, (sockaddr *)&addr, &len, SOCK_CLOEXEC );
+#else
+            int child_fd = ACCEPT( master_fd, (sockaddr *)&addr, &len );
+            if( child_fd >= 0 )
+                set_nonblocking( child_fd, false ); // bsd accept() inherits O_NONBLOCK
+#endif
+            if( child_fd >= 0 )
+            {
+                to_peer( (sockaddr *)&addr, client );
+                if( client.family == 1 )
+                    peer_credentials( child_fd, client );
+            }
+            return child_fd;
+        }
         
 
         // common stuff
@@ -229,22 +521,20 @@ namespace knot
 
         bool valid_method(std::string &method, unsigned valid_mask)
         {
-            if( method == "GET")
-                return valid_mask & RM_GET;
-            else if( method == "POST")
-                return valid_mask & RM_POST;
-            else if( method == "HEAD")
-                return valid_mask & RM_HEAD;
-            else if( method == "PUT")
-                return valid_mask & RM_PUT;
-            else if( method == "DELETE")
-                return valid_mask & RM_DELETE;
-            else if( method == "TRACE")
-                return valid_mask & RM_TRACE;
-            else if( method == "OPTIONS")
-                return valid_mask & RM_OPTIONS;
-            else
-                return 0;
+            return ( method_from( method ) & valid_mask ) != 0;
+        }
+
+        inline char lower( char ch )
+        {
+            return ch >= 'A' && ch <= 'Z' ? ch - 'A' + 'a' : ch;
+        }
+
+        bool equal_nocase( const char *a, const char *b, size_t len )
+        {
+            for( size_t i = 0; i < len; ++i )
+                if( lower( a[i] ) != lower( b[i] ) )
+                    return false;
+            return true;
         }
 
         std::string trim( std::string str, const std::string& trimChars = white_spaces )
@@ -255,20 +545,96 @@ namespace knot
             return str.substr( pos_start, pos_end - pos_start + 1 );
         }
 
-        void extract_headers( std::string input, std::map<std::string, std::string> &headers, int start)
+        span trimmed( span s )
+        {
+            while( s.len && white_spaces.find( s.ptr[0] ) != std::string::npos )
+                ++s.ptr, --s.len;
+            while( s.len && white_spaces.find( s.ptr[s.len - 1] ) != std::string::npos )
+                --s.len;
+            return s;
+        }
+
+        // parses "key: value" lines in [pos, stop) into spans of input
+        void extract_headers( const std::string &input, std::string::size_type pos, std::string::size_type stop, headers &out )
+        {
+            const char *base = input.data();
+
+            while( pos < stop )
+            {
+                std::string::size_type crlf = input.find( CRLF, pos );
+                if( crlf == std::string::npos || crlf > stop )
+                    crlf = stop;
+
+                const char *line = base + pos;
+                const char *colon = (const char *)memchr( line, ':', crlf - pos );
+                if( colon )
+                    out.add( trimmed( span( line, colon - line ) ), trimmed( span( colon + 1, base + crlf - colon - 1 ) ) );
+
+                pos = crlf + 2;
+            }
+        }
+
+        // incremental http request parsing, shared by blocking and async receive_www()
+        struct www_state
+        {
+            std::string::size_type first_crlf = std::string::npos;
+            long long content_length = -1;
+            bool valid = true;
+        };
+
+        // call after appending new bytes: to input until headers are complete, to data afterwards.
+        // returns 0 while more bytes are needed, 1 once the request is complete (state.valid tells if it is well formed)
+        int www_feed( www_state &state, std::string &input, std::string &data, size_t received, std::string &request_method, std::string &raw_location, headers &headers, unsigned valid_method_mask )
         {
-            std::string::size_type colon;
-            std::string::size_type crlf;
+            if( state.content_length > -1 )
+                return (long long)data.size() >= state.content_length;
 
-            if ( ( colon = input.find(':', start) ) != std::string::npos && 
-                 ( ( crlf = input.find(CRLF, start) ) != std::string::npos ) )
+            // Get request type
+            if( request_method.empty() )
             {
-                headers.insert( std::pair<std::string, std::string>( trim( input.substr(start, colon - start) ),
-                                                                     trim( input.substr(colon+1, crlf - colon -1 ) ) )
-                                );
+                // Don't have enough information
+                if( ( state.first_crlf = input.find( CRLF ) ) == std::string::npos )
+                    return 0;
+
+                std::string::size_type space_pos = input.find( ' ' );
+                if( space_pos == std::string::npos || space_pos + 8 > state.first_crlf )
+                    return state.valid = false, 1;
+
+                request_method.assign( input, 0, space_pos );
+
+                // Test valid request type
+                if( !valid_method( request_method, valid_method_mask ) )
+                    return state.valid = false, 1;
+
+                // Test protocol
+                if( input.compare( state.first_crlf - 8, 8, "HTTP/1.1" ) != 0 )
+                    return state.valid = false, 1; // Bad protocol
 
-                extract_headers(input, headers, crlf+2);
+                // get location
+                span location = trimmed( span( input.data() + space_pos, state.first_crlf - 8 - space_pos ) );
+                raw_location.assign( location.ptr, location.len );
             }
+
+            // try to find the first CRLFCRLF which indicates the end of headers and
+            // find out if we have payload, only if "Content-length" header is set.
+            // it's possible to have payload without Content-length, but we won't have
+            // this case.
+            std::string::size_type from = input.size() - received;
+            std::string::size_type crlf_2 = input.find( "\r\n\r\n", from > 3 ? from - 3 : 0 );
+            if( crlf_2 == std::string::npos )
+                return 0;
+
+            extract_headers( input, state.first_crlf + 2, crlf_2, headers );
+
+            const span *length = headers.find( H_CONTENT_LENGTH );
+            if( !length || length->empty() )
+                return 1;
+
+            state.content_length = atoll( length->str().c_str() );
+            data.assign( input, crlf_2 + 4, std::string::npos );
+            input.erase( crlf_2 ); // shrinking in place keeps header spans valid
+
+            return (long long)data.size() >= state.content_length;
         }
     }
     // api
@@ -292,161 +658,885 @@ namespace knot
         })
     }
 
-    bool connect( int &sockfd, const std::string &ip, const std::string &port, double timeout_sec )
+    // socket tuning
+
+    sockopts::sockopts() :
+        nodelay(-1), cork(-1), sndbuf(-1), rcvbuf(-1), defer_accept(-1), fastopen(-1), busy_poll(-1), quickack(-1)
+    {}
+
+    // presets only use what the platform has, so tune() succeeds with them everywhere. none of them corks:
+    // cork is meant to be switched on and off around multi-part writes, see cork()
+    sockopts sockopts::latency()
+    {
+        sockopts o;
+        o.nodelay = 1;
+#if defined(__linux__)
+        o.quickack = 1;
+        o.busy_poll = 50;
+        o.fastopen = 256;
+#endif
+        return o;
+    }
+
+    sockopts sockopts::throughput()
+    {
+        sockopts o;
+        o.nodelay = 1;
+        o.sndbuf = o.rcvbuf = 1 << 20;
+#if defined(__linux__)
+        o.defer_accept = 1;
+        o.fastopen = 256;
+#endif
+        return o;
+    }
+
+    sockopts sockopts::bulk()
+    {
+        sockopts o;
+        o.nodelay = 0;
+        o.sndbuf = o.rcvbuf = 4 << 20;
+#if defined(__linux__)
+        o.defer_accept = 1;
+#endif
+        return o;
+    }
+
+    bool tune( int &sockfd, const sockopts &o, bool listener )
     {
-        struct local
+        if( sockfd < 0 )
+            return false;
+
+        bool ok = true;
+        auto set = [&]( int level, int name, int value ) {
+            if( value >= 0 )
+                ok &= SETSOCKOPT( sockfd, level, name, &value, sizeof( value ) ) == 0;
+        };
+        set( IPPROTO_TCP, TCP_NODELAY, o.nodelay );
+        set( SOL_SOCKET, SO_SNDBUF, o.sndbuf );
+        set( SOL_SOCKET, SO_RCVBUF, o.rcvbuf );
+
+#if defined(__linux__)
+        set( IPPROTO_TCP, TCP_CORK, o.cork );
+        set( IPPROTO_TCP, TCP_QUICKACK, o.quickack );
+        set( SOL_SOCKET, SO_BUSY_POLL, o.busy_poll );
+        if( listener )
         {
-            // [2] from unpv12e/lib/connect_nonb.c
-            static bool connect_nonb( int sockfd, const sockaddr *saptr, socklen_t salen, double timeout_sec )
-            {
-                int             flags, n, error;
-                socklen_t       len;
-                fd_set          rset, wset;
-                struct timeval  tval;
+            set( IPPROTO_TCP, TCP_DEFER_ACCEPT, o.defer_accept );
+            set( IPPROTO_TCP, TCP_FASTOPEN, o.fastopen );
+        }
+        else
+        {
+#   ifdef TCP_FASTOPEN_CONNECT
+            set( IPPROTO_TCP, TCP_FASTOPEN_CONNECT, o.fastopen >= 0 ? int( o.fastopen > 0 ) : -1 );
+#   else
+            ok &= o.fastopen < 0;
+#   endif
+        }
+#else
+        // linux only options
+        ok &= o.cork < 0 && o.quickack < 0 && o.busy_poll < 0 && ( !listener || o.defer_accept < 0 ) && o.fastopen < 0;
+#endif
 
-                flags = fcntl(sockfd, F_GETFL, 0);
-                fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+        return ok;
+    }
 
-                error = 0;
-                if ( (n = CONNECT(sockfd, (struct sockaddr *) saptr, salen)) < 0) {
-/*                  if (errno != EINPROGRESS)
-                        fprintf(stdout, "n: %d, errno: %s\n", n, strerror(errno)); */
-                    if (errno != EINPROGRESS)
-                        return false;
-                }
+    bool cork( int &sockfd, bool enabled )
+    {
+        sockopts o;
+#if defined(__linux__)
+        o.cork = enabled;
+#else
+        // no cork here: closest thing is letting nagle coalesce while corked
+        o.nodelay = !enabled;
+#endif
+        return tune( sockfd, o );
+    }
 
-                /* Do whatever we want while the connect is taking place. */
+    namespace
+    {
+        // getaddrinfo() on a helper thread, so lookups never stall the caller. the result is handed over under
+        // the lock, or freed by the helper if the caller gave up meanwhile
+        struct resolve_t
+        {
+            std::mutex mutex;
+            bool done = false, abandoned = false;
+            addrinfo *addrs = 0;
+            int wake_fd = -1;
 
-                if (n == 0)
-                    goto done;  /* connect completed immediately */
+            static void run( std::shared_ptr<resolve_t> r, std::string host, std::string port )
+            {
+                addrinfo hints, *addrs = 0;
+                memset( &hints, 0, sizeof( hints ) );
+                hints.ai_family = AF_UNSPEC;
+                hints.ai_socktype = SOCK_STREAM;
+                if( getaddrinfo( host.c_str(), port.c_str(), &hints, &addrs ) != 0 )
+                    addrs = 0;
+
+                std::lock_guard<std::mutex> lock( r->mutex );
+                if( r->abandoned )
+                {
+                    if( addrs )
+                        freeaddrinfo( addrs );
+                    return;
+                }
+                r->addrs = addrs;
+                r->done = true;
+                wakeup( r->wake_fd );
+            }
+        };
 
-                    FD_ZERO(&rset);
-                    FD_SET(sockfd, &rset);
-                    wset = rset;
-                    tval = as_timeval( timeout_sec );
+        // RFC8305 (happy eyeballs v2) connection racing
+        struct race_t
+        {
+            static const double attempt_delay;  // seconds between starting addresses
+
+            addrinfo *list = 0;
+            const sockopts *opts = 0;
+            std::vector<addrinfo *> order;  // families interleaved, resolver preference first
+            std::vector<int> attempts;      // one fd per started address, -1 once failed
+            size_t started = 0;
+            double next_start = 0;
+            int winner = -1;
+            int error = 0;                  // last failure, reported when no attempt wins
+            std::shared_ptr<resolve_t> lookup;  // name still being resolved, if any
+
+            bool resolve( const std::string &ip, const std::string &port )
+            {
+                addrinfo hints;
+                memset( &hints, 0, sizeof( hints ) );
+                hints.ai_family = AF_UNSPEC;     // use IPv4 or IPv6, whichever
+                hints.ai_socktype = SOCK_STREAM;
+
+                if( getaddrinfo( ip.c_str(), port.c_str(), &hints, &list ) != 0 )
+                    return list = 0, false;
+                return arrange();
+            }
 
-                    if ( (n = SELECT(sockfd+1, &rset, &wset, NULL,
-                                     timeout_sec > 0 ? &tval : NULL)) == 0) {
-                        CLOSE(sockfd);      /* timeout */
-                        errno = ETIMEDOUT;
-                        return false;
-                    }
+            // numeric addresses resolve right away; names on a helper thread that signals wake_fd
+            void resolve_async( const std::string &ip, const std::string &port, int wake_fd )
+            {
+                addrinfo hints;
+                memset( &hints, 0, sizeof( hints ) );
+                hints.ai_family = AF_UNSPEC;
+                hints.ai_socktype = SOCK_STREAM;
+                hints.ai_flags = AI_NUMERICHOST;
 
-                if (FD_ISSET(sockfd, &rset) || FD_ISSET(sockfd, &wset)) {
-                    len = sizeof(error);
-                    if (GETSOCKOPT(sockfd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
-                        return false;           /* Solaris pending error */
-                } else
-                    return false; //err_quit("select error: sockfd not set");
+                if( getaddrinfo( ip.c_str(), port.c_str(), &hints, &list ) == 0 )
+                {
+                    arrange();
+                    return;
+                }
 
-            done:
-                fcntl(sockfd, F_SETFL, flags);  /* restore file status flags */
+                list = 0;
+                lookup = std::make_shared<resolve_t>();
+                lookup->wake_fd = wake_fd;
+                try {
+                    std::thread( &resolve_t::run, lookup, ip, port ).detach();
+                }
+                catch(...) {
+                    lookup->done = true; // fails as unresolvable
+                }
+            }
 
-                if (error) {
-                    CLOSE(sockfd);      /* just in case */
-                    errno = error;
+            // true once the lookup, if any, has finished
+            bool resolved()
+            {
+                if( !lookup )
+                    return true;
+                std::lock_guard<std::mutex> lock( lookup->mutex );
+                if( !lookup->done )
                     return false;
+                list = lookup->addrs;
+                lookup->addrs = 0;
+                lookup.reset();
+                if( list )
+                    arrange();
+                return true;
+            }
+
+            bool arrange()
+            {
+                std::vector<addrinfo *> first, second;
+                for( addrinfo *ai = list; ai; ai = ai->ai_next )
+                    ( ai->ai_family == list->ai_family ? first : second ).push_back( ai );
+                for( size_t i = 0; i < first.size() || i < second.size(); ++i )
+                {
+                    if( i < first.size() )
+                        order.push_back( first[i] );
+                    if( i < second.size() )
+                        order.push_back( second[i] );
                 }
                 return true;
             }
-        };
 
-        // connect to www.example.com port 80 (http)
-        addrinfo hints, *servinfo;
+            bool pending() const
+            {
+                for( int fd : attempts )
+                    if( fd >= 0 )
+                        return true;
+                return false;
+            }
 
-        // first, load up address structs with getaddrinfo():
-        memset( &hints, 0, sizeof( hints ) );
-        hints.ai_family = AF_UNSPEC;     // use IPv4 or IPv6, whichever
-        hints.ai_socktype = SOCK_STREAM;
-        hints.ai_flags = AI_PASSIVE;     // fill in my IP for me
+            bool done() const
+            {
+                return winner >= 0 || ( !lookup && started == order.size() && !pending() );
+            }
 
-        if( getaddrinfo( ip.c_str(), port.c_str(), &hints, &servinfo ) != 0 )
-            return sockfd = -1, false;
+            // starts the next address. failures right away move on to the following one
+            void start_next( double t )
+            {
+                while( winner < 0 && started < order.size() )
+                {
+                    addrinfo *ai = order[ started++ ];
+                    int fd = ::socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol );
+                    if( fd < 0 )
+                        continue;
 
-        // make a socket
-        sockfd = socket( servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol );
+                    // options asked for explicitly must apply, or the address counts as failed
+                    if( opts && !tune( fd, *opts ) )
+                    {
+                        error = ENOPROTOOPT;
+                        CLOSE( fd );
+                        continue;
+                    }
 
-        // connect
-        bool result = local::connect_nonb( sockfd, servinfo->ai_addr, servinfo->ai_addrlen, timeout_sec );
-        freeaddrinfo( servinfo );
+                    set_nonblocking( fd, true );
+                    if( CONNECT( fd, ai->ai_addr, ai->ai_addrlen ) == 0 )
+                    {
+                        attempts.push_back( fd );
+                        return win( fd );
+                    }
+                    if( in_progress() )
+                    {
+                        attempts.push_back( fd );
+                        break;
+                    }
+                    error = errno;
+                    CLOSE( fd );
+                }
+                next_start = t + attempt_delay;
+            }
 
-        return result;
-    }
+            void win( int fd )
+            {
+                winner = fd;
+                for( int &other : attempts )
+                    if( other >= 0 && other != fd )
+                        CLOSE( other ), other = -1;
+                set_nonblocking( fd, false );
+            }
 
-    bool is_connected( int &sockfd, double timeout_sec )
-    {
-        if( sockfd < 0 )
-            return false;
+            void release()
+            {
+                if( lookup )
+                {
+                    std::lock_guard<std::mutex> lock( lookup->mutex );
+                    lookup->abandoned = true;
+                    if( lookup->addrs )
+                        freeaddrinfo( lookup->addrs ), lookup->addrs = 0;
+                }
+                lookup.reset();
+                for( int &fd : attempts )
+                    if( fd >= 0 && fd != winner )
+                        CLOSE( fd ), fd = -1;
+                if( list )
+                    freeaddrinfo( list ), list = 0;
+            }
+        };
 
-        char buff;
-        return ::recv(sockfd, &buff, 1, MSG_PEEK) != 0;
-    }
+        const double race_t::attempt_delay = 0.25;
 
-    bool get_interface_address( int &sockfd, std::string &ip, std::string &port )
-    {
-       ip = port = std::string();
+        // runs all races on a single readiness wait. wake_fd is signaled by lookups still running
+        void race( std::vector<race_t> &races, double timeout_sec, int wake_fd = -1 )
+        {
+            double t = now(), deadline = timeout_sec > 0 ? t + timeout_sec : 0;
 
-       if( sockfd < 0 )
-         return false;
+            for( auto &r : races )
+                if( !r.lookup )
+                    r.start_next( t );
 
-       struct sockaddr_in addr;
-       socklen_t size = sizeof( sockaddr );
+            for( ;; )
+            {
+                t = now();
 
-       getsockname( sockfd, (struct sockaddr *)&addr, &size );
+                std::vector<pollfd> fds;
+                std::vector<race_t *> owners;
+                double wait = deadline ? deadline - t : 3600;
+                bool running = false, resolving = false;
 
-       ip = inet_ntoa( addr.sin_addr );
+                for( auto &r : races )
+                {
+                    if( r.lookup && !r.resolved() )
+                    {
+                        running = resolving = true;
+                        continue;
+                    }
+                    if( r.done() )
+                        continue;
 
-       std::stringstream ss;
-       ss << addr.sin_port;
-       ss >> port;
+                    // next address is due, or nothing left in flight
+                    if( r.started < r.order.size() && ( t >= r.next_start || !r.pending() ) )
+                        r.start_next( t );
+                    if( r.done() )
+                        continue;
 
-       return true;
-    }
+                    running = true;
+                    if( r.started < r.order.size() && r.next_start - t < wait )
+                        wait = r.next_start - t;
 
-    bool send( int &sockfd, const std::string &output, double timeout_sec )
-    {
-        if( sockfd < 0 )
-            return false;
+                    for( int fd : r.attempts )
+                        if( fd >= 0 )
+                        {
+                            pollfd p = { fd, POLLOUT, 0 };
+                            fds.push_back( p );
+                            owners.push_back( &r );
+                        }
+                }
 
-        std::string out = output;
+                if( !running || ( deadline && t >= deadline ) )
+                    break;
 
-        int bytes_sent;
-        int flags = $windows(0) $welse( MSG_NOSIGNAL );
-        do
-        {
-            /*
-            if( timeout_sec > 0.0 )
-                if( select( sockfd, timeout_sec ) != TCP_OK )
-                    return false; // error or timeout
-            */
+                if( resolving && wake_fd >= 0 )
+                {
+                    pollfd p = { wake_fd, POLLIN, 0 };
+                    fds.push_back( p );
+                    owners.push_back( 0 );
+                }
 
-            // todo timeout_sec -= dt.s()
-            bytes_sent = SEND( sockfd, out.c_str(), out.size(), flags );
+                if( POLL( fds.empty() ? NULL : &fds[0], fds.size(), int( ( wait > 0 ? wait : 0 ) * 1000 + 0.999 ) ) < 0 )
+                    continue;
 
-            /*
-            if error = EWOULDBLOCK {
-                wait4data( sockfd, false, true, timeout );
-                if( sock_fd < 0 )
-                    return false; // error
-                continue;
+                for( size_t i = 0; i < fds.size(); ++i )
+                {
+                    if( !owners[i] )
+                    {
+                        if( fds[i].revents )
+                            drain_wakeup( wake_fd );
+                        continue;
+                    }
+
+                    race_t &r = *owners[i];
+                    if( !fds[i].revents || r.winner >= 0 )
+                        continue;
+
+                    // [2] pending connection errors are reported thru SO_ERROR
+                    int error = 0;
+                    socklen_t len = sizeof( error );
+                    bool ok = GETSOCKOPT( fds[i].fd, SOL_SOCKET, SO_ERROR, &error, &len ) == 0 && error == 0;
+
+                    for( int &fd : r.attempts )
+                        if( fd == fds[i].fd )
+                        {
+                            if( ok )
+                                r.win( fd );
+                            else
+                                r.error = error ? error : ECONNREFUSED, CLOSE( fd ), fd = -1;
+                        }
+                }
             }
-            */
 
-            if( bytes_sent == 0 )
-                return false;   // error! (?)
+            for( auto &r : races )
+            {
+                if( !r.done() )
+                    r.error = ETIMEDOUT;   // still in flight at the deadline
+                r.release();
+            }
+        }
+    }
+
+    namespace
+    {
+        bool connect_unix( int &sockfd, const std::string &address, const sockopts &opts, double timeout_sec )
+        {
+            sockfd = -1;
+#if defined(_WIN32)
+            return "error: unix sockets not supported", false;
+#else
+            sockaddr_un sun;
+            socklen_t len;
+            if( !unix_address( address, sun, len ) )
+                return "error: invalid unix socket address", false;
+
+            int fd = ::socket( AF_UNIX, SOCK_STREAM, 0 );
+            if( fd < 0 )
+                return false;
+
+            tune( fd, opts ); // best effort: tcp options do not apply
+            set_nonblocking( fd, true );
+
+            // a full backlog fails with EAGAIN on linux (no readiness to wait for) and EINPROGRESS elsewhere
+            double deadline = timeout_sec > 0 ? now() + timeout_sec : 0;
+            while( CONNECT( fd, (sockaddr *)&sun, len ) != 0 )
+            {
+                bool full = errno == EAGAIN, pending = in_progress();
+                if( ( !full && !pending ) || ( deadline && now() >= deadline ) )
+                {
+                    CLOSE( fd );
+                    return false;
+                }
+                if( pending )
+                {
+                    pollfd p = { fd, POLLOUT, 0 };
+                    int error = 0;
+                    socklen_t elen = sizeof( error );
+                    bool ok = POLL( &p, 1, deadline ? int( ( deadline - now() ) * 1000 ) + 1 : -1 ) > 0 &&
+                        GETSOCKOPT( fd, SOL_SOCKET, SO_ERROR, &error, &elen ) == 0 && error == 0;
+                    if( !ok )
+                    {
+                        CLOSE( fd );
+                        return false;
+                    }
+                    break;
+                }
+                std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+            }
+
+            set_nonblocking( fd, false );
+            sockfd = fd;
+            return true;
+#endif
+        }
+    }
+
+    bool connect( int &sockfd, const std::string &ip, const std::string &port, double timeout_sec )
+    {
+        return connect( sockfd, ip, port, sockopts(), timeout_sec );
+    }
+
+    bool connect( int &sockfd, const std::string &ip, const std::string &port, const sockopts &opts, double timeout_sec )
+    {
+        if( is_unix( ip ) )
+            return connect_unix( sockfd, ip, opts, timeout_sec );
+
+        std::vector<race_t> races( 1 );
+        races[0].opts = &opts;
+
+        if( !races[0].resolve( ip, port ) )
+            return sockfd = -1, false;
+
+        race( races, timeout_sec );
+
+        sockfd = races[0].winner;
+        if( sockfd < 0 )
+            errno = races[0].error ? races[0].error : ETIMEDOUT;
+
+        return sockfd >= 0;
+    }
+
+    size_t connect( std::vector<int> &sockfds, const std::vector< std::pair<std::string, std::string> > &endpoints, double timeout_sec )
+    {
+        std::vector<race_t> races( endpoints.size() );
+
+        // names resolve in parallel and count against the timeout: each endpoint starts as soon as its lookup lands
+        int wake_fd = make_wakeup();
+        for( size_t i = 0; i < endpoints.size(); ++i )
+        {
+            if( wake_fd >= 0 )
+                races[i].resolve_async( endpoints[i].first, endpoints[i].second, wake_fd );
+            else
+                races[i].resolve( endpoints[i].first, endpoints[i].second );
+        }
+
+        race( races, timeout_sec, wake_fd );
+        if( wake_fd >= 0 )
+            CLOSE( wake_fd );
+
+        size_t connected = 0;
+        sockfds.resize( endpoints.size() );
+        for( size_t i = 0; i < endpoints.size(); ++i )
+            if( ( sockfds[i] = races[i].winner ) >= 0 )
+                ++connected;
+
+        return connected;
+    }
+
+    bool is_connected( int &sockfd, double timeout_sec )
+    {
+        if( sockfd < 0 )
+            return false;
+
+        char buff;
+        return ::recv(sockfd, &buff, 1, MSG_PEEK) != 0;
+    }
+
+    bool get_interface_address( int &sockfd, std::string &ip, std::string &port )
+    {
+       ip = port = std::string();
+
+       if( sockfd < 0 )
+         return false;
+
+       struct sockaddr_in addr;
+       socklen_t size = sizeof( sockaddr );
+
+       getsockname( sockfd, (struct sockaddr *)&addr, &size );
+
+       ip = inet_ntoa( addr.sin_addr );
+
+       std::stringstream ss;
+       ss << addr.sin_port;
+       ss >> port;
+
+       return true;
+    }
+
+    bool send( int &sockfd, const std::string &output, double timeout_sec )
+    {
+        if( sockfd < 0 )
+            return false;
+
+        double deadline = timeout_sec > 0 ? now() + timeout_sec : 0;
+        int flags = $windows(0) $welse( MSG_NOSIGNAL | MSG_DONTWAIT );
+
+        for( size_t offset = 0; offset < output.size(); )
+        {
+            int bytes_sent = SEND( sockfd, output.data() + offset, output.size() - offset, flags );
+
+            if( bytes_sent < 0 && would_block() )
+            {
+                // wait until writable, within what is left of the timeout
+                double left = deadline > 0 ? deadline - now() : -1;
+                if( deadline > 0 && left <= 0 )
+                    return false;
+                pollfd p = { sockfd, POLLOUT, 0 };
+                if( POLL( &p, 1, left > 0 ? int( left * 1000 + 0.999 ) : -1 ) <= 0 )
+                    return false;
+                continue;
+            }
 
-            if( bytes_sent < 0 )
+            if( bytes_sent <= 0 )
                 return false;   // error
 
             knot::bytes_sent += bytes_sent;
+            offset += bytes_sent;
+        }
+
+        return true;
+    }
+
+    bool sendv( int &sockfd, const span *parts, size_t count, double timeout_sec )
+    {
+        if( sockfd < 0 )
+            return false;
+
+        double deadline = timeout_sec > 0 ? now() + timeout_sec : 0;
+        size_t skip = 0; // bytes of parts[0] already sent
+
+        while( count > 0 )
+        {
+            if( skip == parts->len )
+            {
+                ++parts, --count, skip = 0;
+                continue;
+            }
+
+            long sent = send_gather( sockfd, parts, count, skip );
+            if( sent < 0 && would_block() )
+            {
+                double left = deadline > 0 ? deadline - now() : -1;
+                if( deadline > 0 && left <= 0 )
+                    return false;
+                pollfd p = { sockfd, POLLOUT, 0 };
+                if( POLL( &p, 1, left > 0 ? int( left * 1000 + 0.999 ) : -1 ) <= 0 )
+                    return false;
+                continue;
+            }
+            if( sent <= 0 )
+                return false;
 
-            out = out.substr( bytes_sent );
+            knot::bytes_sent += sent;
+
+            for( size_t left = sent; left > 0; )
+            {
+                size_t avail = parts->len - skip;
+                if( left < avail )
+                {
+                    skip += left;
+                    break;
+                }
+                left -= avail;
+                ++parts, --count, skip = 0;
+            }
+        }
+
+        return true;
+    }
+
+    // buffered writer
+
+    namespace
+    {
+        struct writer_impl
+        {
+            enum { chunk_size = 16 << 10, spare_max = 4 };
+
+            int fd;
+            size_t low, high;
+            std::deque<std::string> chunks;     // all full but the last; first one sent up to head
+            std::vector<std::string> spare;     // emptied chunks, capacity kept
+            size_t head, bytes;
+            bool above, error;
+
+            void append( const char *data, size_t len )
+            {
+                while( len > 0 )
+                {
+                    if( chunks.empty() || chunks.back().size() == chunk_size )
+                    {
+                        chunks.push_back( std::string() );
+                        if( !spare.empty() )
+                            chunks.back().swap( spare.back() ), spare.pop_back();
+                        chunks.back().reserve( chunk_size );
+                    }
+                    std::string &tail = chunks.back();
+                    size_t n = chunk_size - tail.size() < len ? chunk_size - tail.size() : len;
+                    tail.append( data, n );
+                    data += n, len -= n, bytes += n;
+                }
+            }
+
+            void release_front()
+            {
+                if( spare.size() < spare_max )
+                    spare.push_back( std::string() ), spare.back().swap( chunks.front() ), spare.back().clear();
+                chunks.pop_front();
+                head = 0;
+            }
+        };
+    }
+
+    writer::writer( int sockfd, size_t low_watermark, size_t high_watermark )
+    {
+        writer_impl *impl = new writer_impl;
+        impl->low = low_watermark;
+        impl->high = high_watermark > low_watermark ? high_watermark : low_watermark + 1;
+        self = impl;
+        reset( sockfd );
+    }
+
+    writer::~writer()
+    {
+        delete (writer_impl *)self;
+    }
+
+    void writer::reset( int sockfd )
+    {
+        writer_impl &w = *(writer_impl *)self;
+        while( !w.chunks.empty() )
+            w.release_front();
+        w.fd = sockfd;
+        w.head = w.bytes = 0;
+        w.above = false;
+        w.error = sockfd < 0;
+        if( sockfd >= 0 )
+            set_nonblocking( sockfd, true );
+    }
+
+    bool writer::write( const span &data )
+    {
+        writer_impl &w = *(writer_impl *)self;
+        if( w.error )
+            return false;
+
+        const char *ptr = data.ptr;
+        size_t len = data.len;
+
+        // nothing queued: try the socket first, so the common case never copies
+        if( !w.bytes && len > 0 )
+        {
+            long sent = send_gather( w.fd, &data, 1, 0 );
+            if( sent < 0 && !would_block() )
+                return w.error = true, false;
+            if( sent > 0 )
+                knot::bytes_sent += sent, ptr += sent, len -= sent;
+        }
+
+        w.append( ptr, len );
+
+        if( !w.above && w.bytes >= w.high )
+        {
+            w.above = true;
+            if( on_high )
+                on_high();
+        }
+        return true;
+    }
+
+    bool writer::flush()
+    {
+        writer_impl &w = *(writer_impl *)self;
+        if( w.error )
+            return false;
+
+        while( w.bytes > 0 )
+        {
+            span parts[ gather_max ];
+            size_t n = 0;
+            for( auto it = w.chunks.begin(); it != w.chunks.end() && n < gather_max; ++it )
+                parts[ n++ ] = span( *it );
+
+            long sent = send_gather( w.fd, parts, n, w.head );
+            if( sent < 0 && would_block() )
+                break;
+            if( sent <= 0 )
+                return w.error = true, false;
+
+            knot::bytes_sent += sent;
+            w.bytes -= sent;
+            for( size_t left = sent; left > 0; )
+            {
+                size_t avail = w.chunks.front().size() - w.head;
+                if( left < avail )
+                {
+                    w.head += left;
+                    break;
+                }
+                left -= avail;
+                w.release_front();
+            }
+        }
+
+        if( w.above && w.bytes <= w.low )
+        {
+            w.above = false;
+            if( on_low )
+                on_low();
+        }
+        return true;
+    }
+
+    bool writer::drain( double timeout_secs )
+    {
+        writer_impl &w = *(writer_impl *)self;
+        double deadline = timeout_secs > 0 ? now() + timeout_secs : 0;
+
+        while( flush() && w.bytes > 0 )
+        {
+            double left = deadline > 0 ? deadline - now() : -1;
+            if( deadline > 0 && left <= 0 )
+                return false;
+            pollfd p = { w.fd, POLLOUT, 0 };
+            if( POLL( &p, 1, left > 0 ? int( left * 1000 + 0.999 ) : -1 ) < 0 )
+                return false;
+        }
+        return !w.error;
+    }
+
+    int writer::fd() const
+    {
+        return ((writer_impl *)self)->fd;
+    }
+
+    size_t writer::queued() const
+    {
+        return ((writer_impl *)self)->bytes;
+    }
+
+    bool writer::paused() const
+    {
+        return ((writer_impl *)self)->above;
+    }
+
+    bool writer::failed() const
+    {
+        return ((writer_impl *)self)->error;
+    }
+
+    bool send_fds( int &sockfd, const std::string &output, const std::vector<int> &fds, double timeout_sec )
+    {
+        if( sockfd < 0 || output.empty() )
+            return false;
+#if defined(_WIN32)
+        return "error: unix sockets not supported", false;
+#else
+        enum { max_fds = 253 }; // SCM_MAX_FD
+        if( fds.size() > max_fds )
+            return "error: too many descriptors", false;
+
+        std::vector<char> control( CMSG_SPACE( sizeof( int ) * max_fds ) );
+        iovec iov = { (void *)output.data(), output.size() };
+        msghdr msg;
+        memset( &msg, 0, sizeof( msg ) );
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if( !fds.empty() )
+        {
+            msg.msg_control = &control[0];
+            msg.msg_controllen = CMSG_SPACE( sizeof( int ) * fds.size() );
+            cmsghdr *cm = CMSG_FIRSTHDR( &msg );
+            cm->cmsg_level = SOL_SOCKET;
+            cm->cmsg_type = SCM_RIGHTS;
+            cm->cmsg_len = CMSG_LEN( sizeof( int ) * fds.size() );
+            memcpy( CMSG_DATA( cm ), &fds[0], sizeof( int ) * fds.size() );
+        }
+
+        ssize_t sent;
+        while( ( sent = ::sendmsg( sockfd, &msg, MSG_NOSIGNAL ) ) < 0 && would_block() )
+        {
+            pollfd p = { sockfd, POLLOUT, 0 };
+            if( POLL( &p, 1, timeout_sec > 0 ? int( timeout_sec * 1000 ) : -1 ) <= 0 )
+                return false;
+        }
+        if( sent <= 0 )
+            return false;
+
+        knot::bytes_sent += sent;
+
+        // descriptors travel with the first byte. the rest is plain data
+        span rest( output.data() + sent, output.size() - sent );
+        return rest.len == 0 || sendv( sockfd, &rest, 1, timeout_sec );
+#endif
+    }
+
+    bool receive_fds( int &sockfd, std::string &input, std::vector<int> &fds, double timeout_sec )
+    {
+        if( sockfd < 0 )
+            return false;
+#if defined(_WIN32)
+        return "error: unix sockets not supported", false;
+#else
+        enum { max_fds = 253 };
+        std::vector<char> control( CMSG_SPACE( sizeof( int ) * max_fds ) );
+        input.resize( 64 * 1024 );
+
+        iovec iov = { &input[0], input.size() };
+        msghdr msg;
+        memset( &msg, 0, sizeof( msg ) );
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = &control[0];
+        msg.msg_controllen = control.size();
+
+        int flags = 0;
+#   if defined(MSG_CMSG_CLOEXEC)
+        flags |= MSG_CMSG_CLOEXEC;
+#   endif
+
+        ssize_t received;
+        while( ( received = ::recvmsg( sockfd, &msg, flags ) ) < 0 && would_block() )
+        {
+            pollfd p = { sockfd, POLLIN, 0 };
+            if( POLL( &p, 1, timeout_sec > 0 ? int( timeout_sec * 1000 ) : -1 ) <= 0 )
+                return input.clear(), false;
         }
-        while( out.size() > 0 );
 
-        //SHUTDOWN_W( sockfd );
+        input.resize( received > 0 ? received : 0 );
+        if( received <= 0 )
+            return false;
+
+        knot::bytes_recv += received;
+
+        for( cmsghdr *cm = CMSG_FIRSTHDR( &msg ); cm; cm = CMSG_NXTHDR( &msg, cm ) )
+            if( cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS )
+            {
+                size_t n = ( cm->cmsg_len - CMSG_LEN( 0 ) ) / sizeof( int );
+                const int *in = (const int *)CMSG_DATA( cm );
+                for( size_t i = 0; i < n; ++i )
+                    fds.push_back( in[i] );
+            }
 
         return true;
+#endif
     }
 
     bool close_r( int &sockfd ) {
@@ -511,272 +1601,5729 @@ namespace knot
     {
         std::string data;
         std::string request;
-        std::map<std::string, std::string> headers;
+        knot::headers headers;
         std::string location;
 
         return receive_www( sockfd, request, location, input, data, headers, timeout_sec, valid_method_mask );
     }
 
-    // very simple implementation of RFC2616 (http://tools.ietf.org/html/rfc2616)
     bool receive_www( int &sockfd, std::string &request_method, std::string &raw_location, std::string &input, std::string &data, std::map<std::string, std::string> &headers, double timeout_sec, unsigned valid_method_mask )
+    {
+        knot::headers table;
+
+        bool ok = receive_www( sockfd, request_method, raw_location, input, data, table, timeout_sec, valid_method_mask );
+
+        for( size_t i = 0; i < table.size(); ++i )
+            headers.insert( std::pair<std::string, std::string>( table[i].key.str(), table[i].value.str() ) );
+
+        return ok;
+    }
+
+    bool receive_www( int &sockfd, knot::request &req, double timeout_sec, unsigned valid_method_mask )
+    {
+        return receive_www( sockfd, req.method, req.location, req.input, req.data, req.headers, timeout_sec, valid_method_mask );
+    }
+
+    bool receive_www_head( int &sockfd, knot::request &req, double timeout_sec, unsigned valid_method_mask )
     {
         if( sockfd < 0 )
             return false;
 
-        input = std::string();
-        data = std::string();
-        request_method = std::string();
-
-        bool receiving = true;
-        int content_length = -1;
-        int payload_received = 0;
-        std::string::size_type first_crlf;
+        req.clear();
+        www_state state;
 
-        while( receiving )
+        for( ;; )
         {
             if( timeout_sec > 0.0 )
                 if( select( sockfd, timeout_sec ) != TCP_OK )
                     return false;    // error or timeout
 
-            // todo timeout_sec -= dt.s()
-            std::string buffer( 4096, '\0' );
-            int bytes_received = RECV( sockfd, &buffer[0], buffer.size(), 0 );
+            char buffer[ 4096 ];
+            int bytes_received = RECV( sockfd, buffer, sizeof( buffer ), 0 );
+
+            if( bytes_received <= 0 )
+                return false;        // error, or closed before the headers were complete
+
+            knot::bytes_recv += bytes_received;
+            req.input.append( buffer, bytes_received );
+
+            // headers are done once the content length is known, or when there is none
+            if( www_feed( state, req.input, req.data, bytes_received, req.method, req.location, req.headers, valid_method_mask ) != 0 || state.content_length > -1 )
+                return state.valid;
+        }
+    }
+
+    bool receive_body( int &sockfd, const knot::request &req, const std::function<bool( const span &chunk )> &sink, double timeout_sec )
+    {
+        if( sockfd < 0 )
+            return false;
+
+        const span *length = req.headers.find( H_CONTENT_LENGTH );
+        long long left = length ? atoll( length->str().c_str() ) : 0;
+        if( left < 0 )
+            return false;
+
+        size_t head = size_t( left ) < req.data.size() ? size_t( left ) : req.data.size();
+        if( head && !sink( span( req.data.data(), head ) ) )
+            return false;
+        left -= head;
+
+        char buffer[ 16 * 1024 ];
+        while( left > 0 )
+        {
+            if( timeout_sec > 0.0 )
+                if( select( sockfd, timeout_sec ) != TCP_OK )
+                    return false;    // error or timeout
+
+            int bytes_received = RECV( sockfd, buffer, left < (long long)sizeof( buffer ) ? size_t( left ) : sizeof( buffer ), 0 );
+            if( bytes_received <= 0 )
+                return false;        // error, or closed before the whole body arrived
+
+            knot::bytes_recv += bytes_received;
+            left -= bytes_received;
+
+            if( !sink( span( buffer, bytes_received ) ) )
+                return false;
+        }
+
+        return true;
+    }
+
+    // very simple implementation of RFC2616 (http://tools.ietf.org/html/rfc2616)
+    bool receive_www( int &sockfd, std::string &request_method, std::string &raw_location, std::string &input, std::string &data, knot::headers &headers, double timeout_sec, unsigned valid_method_mask )
+    {
+        if( sockfd < 0 )
+            return false;
+
+        // clear() keeps capacity: a request reused across a connection does not allocate again once warm
+        input.clear();
+        data.clear();
+        request_method.clear();
+        raw_location.clear();
+        headers.clear();
+
+        www_state state;
+
+        for( ;; )
+        {
+            if( timeout_sec > 0.0 )
+                if( select( sockfd, timeout_sec ) != TCP_OK )
+                    return false;    // error or timeout
+
+            // todo timeout_sec -= dt.s()
+            char buffer[ 4096 ];
+            int bytes_received = RECV( sockfd, buffer, sizeof( buffer ), 0 );
+
+            if( bytes_received < 0 )
+                return false;        // error or timeout
+
+            knot::bytes_recv += bytes_received;
+
+            if( bytes_received == 0 )
+                return /*sockfd = -1,*/ true;   // ok! remote side closed connection
+
+            ( state.content_length > -1 ? data : input ).append( buffer, bytes_received );
+
+            if( www_feed( state, input, data, bytes_received, request_method, raw_location, headers, valid_method_mask ) != 0 )
+                return state.valid;
+        }
+
+        return true;
+    }
+
+    namespace
+    {
+        // reads exactly len bytes, fails if peer closes before
+        bool recv_all( int &sockfd, char *data, size_t len, double timeout_sec )
+        {
+            while( len > 0 )
+            {
+                if( timeout_sec > 0.0 )
+                    if( select( sockfd, timeout_sec ) != TCP_OK )
+                        return false;    // error or timeout
+
+                int bytes_received = RECV( sockfd, data, len, 0 );
+                if( bytes_received <= 0 )
+                    return false;        // error or remote side closed connection
+
+                knot::bytes_recv += bytes_received;
+                data += bytes_received;
+                len -= bytes_received;
+            }
+
+            return true;
+        }
+
+        size_t put_prefix( char *out, size_t len, frame_prefix prefix )
+        {
+            if( prefix == FRAME_U32 )
+            {
+                out[0] = char( len >> 24 );
+                out[1] = char( len >> 16 );
+                out[2] = char( len >> 8 );
+                out[3] = char( len );
+                return 4;
+            }
+
+            size_t n = 0;
+            do {
+                out[n++] = char( ( len & 0x7f ) | ( len > 0x7f ? 0x80 : 0 ) );
+                len >>= 7;
+            } while( len );
+            return n;
+        }
+
+        bool frame_fits( size_t len, frame_prefix prefix )
+        {
+            return prefix != FRAME_U32 || (unsigned long long)len <= 0xffffffffull;
+        }
+    }
+
+    frame_reader::frame_reader( frame_prefix prefix, size_t max_size ) : prefix(prefix), max_size(max_size), offset(0)
+    {}
+
+    void frame_reader::feed( const char *data, size_t len )
+    {
+        // compact consumed bytes before growing
+        if( offset && offset * 2 >= buffer.size() )
+            buffer.erase( 0, offset ), offset = 0;
+
+        buffer.append( data, len );
+    }
+
+    int frame_reader::next( std::string &msg )
+    {
+        const unsigned char *p = (const unsigned char *)buffer.data() + offset;
+        size_t avail = buffer.size() - offset, head = 0;
+        unsigned long long len = 0;
+
+        if( prefix == FRAME_U32 )
+        {
+            if( avail < 4 )
+                return 0;
+            len = ( (unsigned long long)p[0] << 24 ) | ( p[1] << 16 ) | ( p[2] << 8 ) | p[3];
+            head = 4;
+        }
+        else
+        {
+            for( ;; )
+            {
+                if( head == avail )
+                    return 0;
+                if( head == 10 )
+                    return -1;
+                len |= (unsigned long long)( p[head] & 0x7f ) << ( 7 * head );
+                if( !( p[head++] & 0x80 ) )
+                    break;
+            }
+        }
+
+        if( len > max_size )
+            return -1;
+        if( avail - head < len )
+            return 0;
+
+        msg.assign( (const char *)p + head, (size_t)len );
+        offset += head + (size_t)len;
+
+        if( offset == buffer.size() )
+            buffer.clear(), offset = 0;
+
+        return 1;
+    }
+
+    bool send_msg( int &sockfd, const std::string &msg, double timeout_sec, frame_prefix prefix )
+    {
+        if( sockfd < 0 || !frame_fits( msg.size(), prefix ) )
+            return false;
+
+        // prefix and payload gathered in a single write
+        char head[10];
+        span parts[2] = { span( head, put_prefix( head, msg.size(), prefix ) ), span( msg ) };
+        return sendv( sockfd, parts, 2, timeout_sec );
+    }
+
+    bool send_msgs( int &sockfd, const std::vector<std::string> &msgs, double timeout_sec, frame_prefix prefix )
+    {
+        if( sockfd < 0 )
+            return false;
+
+        size_t total = 0;
+        for( auto &msg : msgs )
+        {
+            if( !frame_fits( msg.size(), prefix ) )
+                return false;
+            total += 10 + msg.size();
+        }
+
+        std::string batch( total, '\0' );
+        char *out = &batch[0];
+        for( auto &msg : msgs )
+        {
+            out += put_prefix( out, msg.size(), prefix );
+            memcpy( out, msg.data(), msg.size() );
+            out += msg.size();
+        }
+
+        span all( batch.data(), out - batch.data() );
+        return sendv( sockfd, &all, 1, timeout_sec );
+    }
+
+    bool recv_msg( int &sockfd, std::string &msg, frame_reader &reader, double timeout_sec )
+    {
+        if( sockfd < 0 )
+            return false;
+
+        for( ;; )
+        {
+            int ready = reader.next( msg );
+            if( ready != 0 )
+                return ready > 0;
+
+            if( timeout_sec > 0.0 )
+                if( select( sockfd, timeout_sec ) != TCP_OK )
+                    return false;    // error or timeout
+
+            char buffer[ 16 * 1024 ];
+            int bytes_received = RECV( sockfd, buffer, sizeof( buffer ), 0 );
+            if( bytes_received <= 0 )
+                return false;        // error or remote side closed connection
+
+            knot::bytes_recv += bytes_received;
+            reader.feed( buffer, bytes_received );
+        }
+    }
+
+    bool recv_msg( int &sockfd, std::string &msg, double timeout_sec, frame_prefix prefix, size_t max_size )
+    {
+        if( sockfd < 0 )
+            return false;
+
+        unsigned long long len = 0;
+
+        if( prefix == FRAME_U32 )
+        {
+            unsigned char head[4];
+            if( !recv_all( sockfd, (char *)head, 4, timeout_sec ) )
+                return false;
+            len = ( (unsigned long long)head[0] << 24 ) | ( head[1] << 16 ) | ( head[2] << 8 ) | head[3];
+        }
+        else
+        {
+            for( int shift = 0;; shift += 7 )
+            {
+                unsigned char byte;
+                if( shift > 63 || !recv_all( sockfd, (char *)&byte, 1, timeout_sec ) )
+                    return false;
+                len |= (unsigned long long)( byte & 0x7f ) << shift;
+                if( !( byte & 0x80 ) )
+                    break;
+            }
+        }
+
+        if( len > max_size )
+            return false;
+
+        msg.resize( (size_t)len );
+        return len == 0 || recv_all( sockfd, &msg[0], (size_t)len, timeout_sec );
+    }
+
+    // shared memory channels
+
+    namespace
+    {
+        const char shm_hello[] = "KNOT-SHM/1";
+        enum { shm_magic = 0x6b6e6d31, shm_spins = 4096 };
+        const uint32_t shm_wrap = 0xffffffffu;  // rest of the ring is padding
+
+        struct shm_header
+        {
+            uint32_t magic;
+            uint32_t capacity;      // bytes of each ring, power of two
+            char pad[ 56 ];
+        };
+
+        // single producer, single consumer. records are a 8 byte length header plus payload, 8 byte aligned
+        struct shm_ring
+        {
+            std::atomic<uint64_t> head;             // bytes published by the writer
+            char pad0[ 64 - sizeof( std::atomic<uint64_t> ) ];
+            std::atomic<uint64_t> tail;             // bytes released by the reader
+            char pad1[ 64 - sizeof( std::atomic<uint64_t> ) ];
+            std::atomic<uint32_t> reader_parked;    // reader sleeps on data_efd: writer must signal it
+            std::atomic<uint32_t> writer_parked;    // writer sleeps on room_efd: reader must signal it
+            char pad2[ 64 - 2 * sizeof( std::atomic<uint32_t> ) ];
+        };
+
+        struct shm_side
+        {
+            shm_ring *ring;
+            char *data;
+            int data_efd, room_efd;
+        };
+
+        struct shm_impl
+        {
+            void *base;
+            size_t bytes;
+            uint64_t capacity;
+            int sockfd;             // handshake socket, not owned. readable means the peer is gone
+            bool peer_gone;
+            std::vector<int> efds;
+            shm_side tx, rx;
+            std::mutex send_lock, receive_lock;
+
+            shm_impl() : base(0), bytes(0), capacity(0), sockfd(-1), peer_gone(false) {}
+        };
+
+        size_t shm_record( size_t len )
+        {
+            return 8 + ( ( len + 7 ) & ~size_t( 7 ) );
+        }
+
+        void shm_signal( int efd )
+        {
+            $welse(
+            uint64_t one = 1;
+            if( ::write( efd, &one, sizeof( one ) ) < 0 ) {}
+            )
+        }
+
+        // spins a little, then parks on efd. returns false on timeout or when the peer is gone
+        template<typename READY>
+        bool shm_wait( shm_impl *impl, std::atomic<uint32_t> &parked, int efd, double deadline, READY ready )
+        {
+            static const int spins = std::thread::hardware_concurrency() > 1 ? shm_spins : 0; // no point spinning on one cpu
+            for( int spin = 0; spin < spins; ++spin )
+                if( ready() )
+                    return true;
+
+            for( ;; )
+            {
+                parked.store( 1 );
+                std::atomic_thread_fence( std::memory_order_seq_cst );
+                if( ready() )
+                    return parked.store( 0 ), true;
+                if( impl->peer_gone )
+                    return parked.store( 0 ), false;
+
+                double left = deadline ? deadline - now() : 3600;
+                if( left <= 0 )
+                    return parked.store( 0 ), false;
+
+                pollfd p[2] = { { efd, POLLIN, 0 }, { impl->sockfd, POLLIN, 0 } };
+                int n = POLL( p, 2, int( left * 1000 ) + 1 );
+                parked.store( 0 );
+
+                if( n > 0 && p[0].revents )
+                {
+                    $welse(
+                    uint64_t count;
+                    if( ::read( efd, &count, sizeof( count ) ) < 0 ) {}
+                    )
+                }
+                if( n > 0 && p[1].revents )
+                    impl->peer_gone = true;     // caller drains what is left before giving up
+                if( ready() )
+                    return true;
+            }
+        }
+
+#if defined(__linux__)
+        void shm_attach( shm_impl *impl, bool client )
+        {
+            char *base = (char *)impl->base;
+            size_t ring_bytes = sizeof( shm_ring ) + size_t( impl->capacity );
+            shm_ring *first = (shm_ring *)( base + sizeof( shm_header ) );
+            shm_ring *second = (shm_ring *)( base + sizeof( shm_header ) + ring_bytes );
+
+            shm_side a = { first, (char *)( first + 1 ), impl->efds[0], impl->efds[1] };
+            shm_side b = { second, (char *)( second + 1 ), impl->efds[2], impl->efds[3] };
+            impl->tx = client ? a : b;
+            impl->rx = client ? b : a;
+        }
+
+        size_t shm_size( uint64_t capacity )
+        {
+            return sizeof( shm_header ) + 2 * ( sizeof( shm_ring ) + size_t( capacity ) );
+        }
+#endif
+
+        void shm_release( shm_impl *impl )
+        {
+#if defined(__linux__)
+            if( impl->base )
+                munmap( impl->base, impl->bytes );
+            for( int fd : impl->efds )
+                CLOSE( fd );
+#endif
+            impl->base = 0;
+            impl->efds.clear();
+            impl->sockfd = -1;
+        }
+    }
+
+    shm_channel::shm_channel() : self( new shm_impl )
+    {}
+
+    shm_channel::~shm_channel()
+    {
+        close();
+        delete (shm_impl *)self;
+    }
+
+    void shm_channel::close()
+    {
+        shm_impl *impl = (shm_impl *)self;
+        std::lock_guard<std::mutex> s( impl->send_lock ), r( impl->receive_lock );
+        shm_release( impl );
+        impl->peer_gone = false;
+    }
+
+    bool shm_channel::is_open() const
+    {
+        shm_impl *impl = (shm_impl *)self;
+        return impl->base != 0 && !impl->peer_gone;
+    }
+
+    size_t shm_channel::max_message() const
+    {
+        shm_impl *impl = (shm_impl *)self;
+        return impl->capacity ? size_t( impl->capacity / 2 ) - 8 : 0;
+    }
+
+    bool shm_channel::send( const std::string &msg, double timeout_sec )
+    {
+        return send( msg.data(), msg.size(), timeout_sec );
+    }
+
+    bool shm_channel::send( const char *data, size_t len, double timeout_sec )
+    {
+        shm_impl *impl = (shm_impl *)self;
+        std::lock_guard<std::mutex> lock( impl->send_lock );
+
+        if( !impl->base || impl->peer_gone || len > max_message() )
+            return false;
+
+        shm_ring *ring = impl->tx.ring;
+        uint64_t cap = impl->capacity;
+        uint64_t head = ring->head.load( std::memory_order_relaxed );
+        size_t pos = size_t( head & ( cap - 1 ) ), rec = shm_record( len );
+        size_t skip = rec > cap - pos ? size_t( cap - pos ) : 0; // records never wrap: pad to the end instead
+
+        auto room = [&]() {
+            return cap - ( head - ring->tail.load( std::memory_order_acquire ) ) >= skip + rec;
+        };
+        if( !room() && !shm_wait( impl, ring->writer_parked, impl->tx.room_efd, timeout_sec > 0 ? now() + timeout_sec : 0, room ) )
+            return false;
+
+        char *out = impl->tx.data;
+        if( skip )
+        {
+            *(uint32_t *)( out + pos ) = shm_wrap;
+            pos = 0;
+        }
+        *(uint32_t *)( out + pos ) = uint32_t( len );
+        memcpy( out + pos + 8, data, len );
+
+        ring->head.store( head + skip + rec, std::memory_order_release );
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        if( ring->reader_parked.load() )
+            shm_signal( impl->tx.data_efd );
+
+        knot::bytes_sent += len;
+        return true;
+    }
+
+    bool shm_channel::receive( std::string &msg, double timeout_sec )
+    {
+        shm_impl *impl = (shm_impl *)self;
+        std::lock_guard<std::mutex> lock( impl->receive_lock );
+
+        if( !impl->base )
+            return false;
+
+        shm_ring *ring = impl->rx.ring;
+        uint64_t cap = impl->capacity;
+        uint64_t tail = ring->tail.load( std::memory_order_relaxed );
+
+        auto ready = [&]() {
+            return ring->head.load( std::memory_order_acquire ) != tail;
+        };
+        if( !ready() && !shm_wait( impl, ring->reader_parked, impl->rx.data_efd, timeout_sec > 0 ? now() + timeout_sec : 0, ready ) )
+            return false;
+
+        const char *in = impl->rx.data;
+        size_t pos = size_t( tail & ( cap - 1 ) );
+        uint32_t len = *(const uint32_t *)( in + pos );
+        if( len == shm_wrap )
+        {
+            tail += cap - pos;
+            pos = 0;
+            len = *(const uint32_t *)in;
+        }
+        if( len > cap / 2 )
+            return impl->peer_gone = true, false; // corrupt
+
+        msg.assign( in + pos + 8, len );
+
+        ring->tail.store( tail + shm_record( len ), std::memory_order_release );
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        if( ring->writer_parked.load() )
+            shm_signal( impl->rx.room_efd );
+
+        knot::bytes_recv += len;
+        return true;
+    }
+
+    bool shm_connect( int &sockfd, shm_channel &channel, size_t ring_bytes, double timeout_sec )
+    {
+        channel.close();
+        if( sockfd < 0 )
+            return false;
+#if !defined(__linux__)
+        return "error: shared memory channels not supported", false;
+#else
+        uint64_t capacity = 4096;
+        while( capacity < ring_bytes && capacity < ( 1u << 30 ) )
+            capacity <<= 1;
+
+        shm_impl *impl = (shm_impl *)channel.self;
+        int memfd = int( syscall( SYS_memfd_create, "knot-shm", MFD_CLOEXEC ) );
+        if( memfd < 0 )
+            return "error: memfd_create failed", false;
+
+        impl->capacity = capacity;
+        impl->bytes = shm_size( capacity );
+        void *base = ftruncate( memfd, off_t( impl->bytes ) ) == 0 ? mmap( 0, impl->bytes, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0 ) : MAP_FAILED;
+        impl->base = base == MAP_FAILED ? 0 : base;
+
+        for( int i = 0; i < 4 && impl->base; ++i )
+        {
+            int efd = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+            if( efd < 0 )
+                break;
+            impl->efds.push_back( efd );
+        }
+
+        bool ok = impl->base && impl->efds.size() == 4;
+        if( ok )
+        {
+            shm_header *header = new (impl->base) shm_header;
+            header->magic = shm_magic;
+            header->capacity = uint32_t( capacity );
+            shm_attach( impl, true );
+            new (impl->tx.ring) shm_ring;
+            new (impl->rx.ring) shm_ring;
+
+            std::vector<int> fds( 1, memfd );
+            fds.insert( fds.end(), impl->efds.begin(), impl->efds.end() );
+
+            char reply[2];
+            ok = send_fds( sockfd, std::string( shm_hello, sizeof( shm_hello ) - 1 ), fds, timeout_sec ) &&
+                recv_all( sockfd, reply, 2, timeout_sec ) && reply[0] == 'O' && reply[1] == 'K';
+        }
+
+        CLOSE( memfd ); // the mapping keeps it alive
+        if( !ok )
+            return shm_release( impl ), false;
+
+        impl->sockfd = sockfd;
+        return true;
+#endif
+    }
+
+    bool shm_accept( int &sockfd, shm_channel &channel, double timeout_sec )
+    {
+        channel.close();
+        if( sockfd < 0 )
+            return false;
+#if !defined(__linux__)
+        return "error: shared memory channels not supported", false;
+#else
+        std::string hello;
+        std::vector<int> fds;
+        if( !receive_fds( sockfd, hello, fds, timeout_sec ) )
+            return false;
+
+        shm_impl *impl = (shm_impl *)channel.self;
+        struct stat st;
+        bool ok = hello == shm_hello && fds.size() == 5 && fstat( fds[0], &st ) == 0 && size_t( st.st_size ) > sizeof( shm_header );
+        if( ok )
+        {
+            impl->bytes = size_t( st.st_size );
+            void *base = mmap( 0, impl->bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0 );
+            impl->base = base == MAP_FAILED ? 0 : base;
+            impl->efds.assign( fds.begin() + 1, fds.end() );
+            fds.resize( 1 );
+
+            const shm_header *header = (const shm_header *)impl->base;
+            ok = impl->base && header->magic == shm_magic && header->capacity >= 4096 &&
+                !( header->capacity & ( header->capacity - 1 ) ) && shm_size( header->capacity ) == impl->bytes;
+            if( ok )
+            {
+                impl->capacity = header->capacity;
+                shm_attach( impl, false );
+                ok = send_all( sockfd, "OK", 2 );
+            }
+        }
+
+        for( int fd : fds )
+            CLOSE( fd );
+        if( !ok )
+            return shm_release( impl ), false;
+
+        impl->sockfd = sockfd;
+        return true;
+#endif
+    }
+
+    // udp
+
+    namespace
+    {
+        bool resolve_udp( const std::string &ip, const std::string &port, datagram &out )
+        {
+            addrinfo hints, *res;
+            memset( &hints, 0, sizeof( hints ) );
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_DGRAM;
+
+            if( getaddrinfo( ip.c_str(), port.c_str(), &hints, &res ) != 0 )
+                return false;
+
+            bool ok = res->ai_addrlen <= sizeof( out.addr );
+            if( ok )
+                memcpy( out.addr, res->ai_addr, out.addrlen = (unsigned)res->ai_addrlen );
+
+            freeaddrinfo( res );
+            return ok;
+        }
+
+        bool numeric_address( const unsigned char *addr, unsigned addrlen, std::string *ip, std::string *port )
+        {
+            char host[ NI_MAXHOST ], serv[ NI_MAXSERV ];
+            if( getnameinfo( (const sockaddr *)addr, addrlen, host, sizeof( host ), serv, sizeof( serv ), NI_NUMERICHOST | NI_NUMERICSERV ) != 0 )
+                return false;
+            if( ip )
+                *ip = host;
+            if( port )
+                *port = serv;
+            return true;
+        }
+#if defined(__linux__)
+        struct batch_native
+        {
+            enum { control_size = 64 };
+            std::vector<mmsghdr> msgs;
+            std::vector<iovec> iovs;
+            std::vector<char> control;
+        };
+#endif
+    }
+
+    std::string datagram::ip() const
+    {
+        std::string ip;
+        numeric_address( addr, addrlen, &ip, 0 );
+        return ip;
+    }
+
+    std::string datagram::port() const
+    {
+        std::string port;
+        numeric_address( addr, addrlen, 0, &port );
+        return port;
+    }
+
+    datagram_batch::datagram_batch( size_t capacity, size_t datagram_size ) :
+        datagram_size( datagram_size ), count( 0 ), storage( capacity * datagram_size ), items( capacity ), native( 0 )
+    {
+        for( size_t i = 0; i < capacity; ++i )
+        {
+            items[i].data = &storage[ i * datagram_size ];
+            items[i].size = items[i].segment = 0;
+            items[i].truncated = false;
+            items[i].addrlen = 0;
+        }
+#if defined(__linux__)
+        batch_native *n = new batch_native;
+        n->msgs.resize( capacity );
+        n->iovs.resize( capacity );
+        n->control.resize( capacity * batch_native::control_size );
+        native = n;
+#endif
+    }
+
+    datagram_batch::~datagram_batch()
+    {
+#if defined(__linux__)
+        delete (batch_native *)native;
+#endif
+    }
+
+    bool datagram_batch::push( const char *data, size_t len, const datagram &dest, size_t segment )
+    {
+        if( count == items.size() || len > datagram_size )
+            return false;
+
+        datagram &d = items[ count++ ];
+        memcpy( d.data, data, len );
+        memcpy( d.addr, dest.addr, d.addrlen = dest.addrlen );
+        d.size = len;
+        d.segment = segment;
+        d.truncated = false;
+        return true;
+    }
+
+    bool datagram_batch::push( const char *data, size_t len, const std::string &ip, const std::string &port, size_t segment )
+    {
+        datagram dest;
+        return resolve_udp( ip, port, dest ) && push( data, len, dest, segment );
+    }
+
+    bool bind_udp( int &sockfd, const std::string &_bindip, const std::string &port )
+    {
+        std::string bindip = ( _bindip.empty() ? std::string("0.0.0.0") : _bindip );
+
+        addrinfo hints, *res;
+        memset( &hints, 0, sizeof( hints ) );
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_flags = AI_PASSIVE;
+
+        if( getaddrinfo( bindip.c_str(), port.c_str(), &hints, &res ) != 0 )
+            return sockfd = -1, false;
+
+        sockfd = ::socket( res->ai_family, res->ai_socktype, res->ai_protocol );
+
+        bool ok = sockfd >= 0;
+        if( ok )
+        {
+            $welse({
+                int yes = 1;
+                SETSOCKOPT( sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int) );
+            })
+
+            if( BIND( sockfd, res->ai_addr, res->ai_addrlen ) == -1 )
+            {
+                CLOSE( sockfd );
+                sockfd = -1;
+                ok = false;
+            }
+        }
+
+        freeaddrinfo( res );
+        return ok;
+    }
+
+    bool send_to( int &sockfd, const std::string &ip, const std::string &port, const std::string &output )
+    {
+        datagram dest;
+        if( sockfd < 0 || !resolve_udp( ip, port, dest ) )
+            return false;
+
+        int sent = ::sendto( sockfd, (const char *)output.data(), output.size(), 0, (const sockaddr *)dest.addr, dest.addrlen );
+        if( sent < 0 )
+            return false;
+
+        knot::bytes_sent += sent;
+        return (size_t)sent == output.size();
+    }
+
+    bool recv_from( int &sockfd, std::string &input, std::string &ip, std::string &port, double timeout_sec )
+    {
+        if( sockfd < 0 )
+            return false;
+
+        if( timeout_sec > 0.0 )
+            if( select( sockfd, timeout_sec ) != TCP_OK )
+                return false;    // error or timeout
+
+        datagram from;
+        socklen_t fromlen = sizeof( from.addr );
+
+        input.resize( 64 * 1024 );
+        int bytes_received = ::recvfrom( sockfd, &input[0], input.size(), 0, (sockaddr *)from.addr, &fromlen );
+        if( bytes_received < 0 )
+            return input.clear(), false;
+
+        knot::bytes_recv += bytes_received;
+        input.resize( bytes_received );
+
+        return numeric_address( from.addr, fromlen, &ip, &port );
+    }
+
+    int send_batch( int &sockfd, const datagram_batch &batch )
+    {
+        if( sockfd < 0 )
+            return -1;
+
+        size_t sent = 0;
+#if defined(__linux__)
+        batch_native &n = *(batch_native *)batch.native;
+
+        for( size_t i = 0; i < batch.count; ++i )
+        {
+            const datagram &d = batch.items[i];
+            msghdr &h = n.msgs[i].msg_hdr;
+
+            memset( &h, 0, sizeof( h ) );
+            n.iovs[i].iov_base = d.data;
+            n.iovs[i].iov_len = d.size;
+            h.msg_iov = &n.iovs[i];
+            h.msg_iovlen = 1;
+            h.msg_name = (void *)d.addr;
+            h.msg_namelen = d.addrlen;
+
+            if( d.segment )
+            {
+                // gso: kernel splits payload into segment-sized datagrams
+                h.msg_control = &n.control[ i * batch_native::control_size ];
+                h.msg_controllen = CMSG_SPACE( sizeof( uint16_t ) );
+                cmsghdr *cm = CMSG_FIRSTHDR( &h );
+                cm->cmsg_level = SOL_UDP;
+                cm->cmsg_type = UDP_SEGMENT;
+                cm->cmsg_len = CMSG_LEN( sizeof( uint16_t ) );
+                uint16_t segment = (uint16_t)d.segment;
+                memcpy( CMSG_DATA( cm ), &segment, sizeof( segment ) );
+            }
+        }
+
+        while( sent < batch.count )
+        {
+            int r = ::sendmmsg( sockfd, &n.msgs[ sent ], batch.count - sent, MSG_NOSIGNAL );
+            if( r <= 0 )
+                return sent ? (int)sent : -1;
+
+            for( int i = 0; i < r; ++i )
+                knot::bytes_sent += n.msgs[ sent + i ].msg_len;
+            sent += r;
+        }
+
+        return (int)sent;
+#else
+        for( ; sent < batch.count; ++sent )
+        {
+            const datagram &d = batch.items[ sent ];
+            int r = ::sendto( sockfd, (const char *)d.data, d.size, 0, (const sockaddr *)d.addr, d.addrlen );
+            if( r < 0 )
+                return sent ? (int)sent : -1;
+            knot::bytes_sent += r;
+        }
+
+        return (int)sent;
+#endif
+    }
+
+    int recv_batch( int &sockfd, datagram_batch &batch, double timeout_sec )
+    {
+        batch.count = 0;
+
+        if( sockfd < 0 )
+            return -1;
+
+        if( timeout_sec > 0.0 )
+        {
+            int ready = select( sockfd, timeout_sec );
+            if( ready != TCP_OK )
+                return ready == TCP_TIMEOUT ? 0 : -1;
+        }
+#if defined(__linux__)
+        batch_native &n = *(batch_native *)batch.native;
+
+        for( size_t i = 0; i < batch.items.size(); ++i )
+        {
+            msghdr &h = n.msgs[i].msg_hdr;
+
+            memset( &h, 0, sizeof( h ) );
+            n.iovs[i].iov_base = batch.items[i].data;
+            n.iovs[i].iov_len = batch.datagram_size;
+            h.msg_iov = &n.iovs[i];
+            h.msg_iovlen = 1;
+            h.msg_name = batch.items[i].addr;
+            h.msg_namelen = sizeof( batch.items[i].addr );
+            h.msg_control = &n.control[ i * batch_native::control_size ];
+            h.msg_controllen = batch_native::control_size;
+        }
+
+        // block for the first datagram only, then drain whatever is queued
+        int r = ::recvmmsg( sockfd, &n.msgs[0], batch.items.size(), MSG_WAITFORONE, NULL );
+        if( r < 0 )
+            return would_block() ? 0 : -1;
+
+        for( int i = 0; i < r; ++i )
+        {
+            datagram &d = batch.items[i];
+            msghdr &h = n.msgs[i].msg_hdr;
+
+            d.size = n.msgs[i].msg_len;
+            d.addrlen = h.msg_namelen;
+            d.segment = 0;
+            d.truncated = ( h.msg_flags & MSG_TRUNC ) != 0;
+
+            for( cmsghdr *cm = CMSG_FIRSTHDR( &h ); cm; cm = CMSG_NXTHDR( &h, cm ) )
+                if( cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO )
+                {
+                    int segment;
+                    memcpy( &segment, CMSG_DATA( cm ), sizeof( segment ) );
+                    d.segment = segment;
+                }
+
+            knot::bytes_recv += d.size;
+        }
+
+        return (int)( batch.count = r );
+#else
+        while( batch.count < batch.items.size() )
+        {
+            datagram &d = batch.items[ batch.count ];
+            socklen_t fromlen = sizeof( d.addr );
+
+            int r = ::recvfrom( sockfd, d.data, batch.datagram_size, 0, (sockaddr *)d.addr, &fromlen );
+            bool truncated = false;
+            $windows(
+            if( r < 0 && WSAGetLastError() == WSAEMSGSIZE )
+                r = int( batch.datagram_size ), truncated = true;
+            )
+            if( r < 0 )
+                break;
+
+            d.size = r;
+            d.addrlen = fromlen;
+            d.segment = 0;
+            d.truncated = truncated;
+            knot::bytes_recv += r;
+            batch.count++;
+
+            if( select( sockfd, 0.0 ) != TCP_OK )
+                break;
+        }
+
+        return batch.count ? (int)batch.count : would_block() ? 0 : -1;
+#endif
+    }
+
+    bool enable_gro( int &sockfd, bool enabled )
+    {
+#if defined(__linux__)
+        int on = enabled;
+        return sockfd >= 0 && SETSOCKOPT( sockfd, SOL_UDP, UDP_GRO, &on, sizeof( on ) ) == 0;
+#else
+        return false;
+#endif
+    }
+
+    // websockets
+
+    namespace
+    {
+        // sha1 (FIPS 180-1), only used for the websocket handshake
+        void sha1( const std::string &input, unsigned char digest[20] )
+        {
+            uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+            std::string msg = input;
+            uint64_t bits = (uint64_t)input.size() * 8;
+            msg += char( 0x80 );
+            while( msg.size() % 64 != 56 )
+                msg += char( 0 );
+            for( int i = 7; i >= 0; --i )
+                msg += char( bits >> ( i * 8 ) );
+
+            auto rol = []( uint32_t v, int n ) -> uint32_t { return ( v << n ) | ( v >> ( 32 - n ) ); };
+
+            for( size_t chunk = 0; chunk < msg.size(); chunk += 64 )
+            {
+                uint32_t w[80];
+                for( int i = 0; i < 16; ++i )
+                {
+                    const unsigned char *p = (const unsigned char *)&msg[ chunk + i * 4 ];
+                    w[i] = ( p[0] << 24 ) | ( p[1] << 16 ) | ( p[2] << 8 ) | p[3];
+                }
+                for( int i = 16; i < 80; ++i )
+                    w[i] = rol( w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1 );
+
+                uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+                for( int i = 0; i < 80; ++i )
+                {
+                    uint32_t f, k;
+                    if( i < 20 )      f = ( b & c ) | ( ~b & d ),           k = 0x5A827999;
+                    else if( i < 40 ) f = b ^ c ^ d,                        k = 0x6ED9EBA1;
+                    else if( i < 60 ) f = ( b & c ) | ( b & d ) | ( c & d ), k = 0x8F1BBCDC;
+                    else              f = b ^ c ^ d,                        k = 0xCA62C1D6;
+
+                    uint32_t t = rol( a, 5 ) + f + e + k + w[i];
+                    e = d, d = c, c = rol( b, 30 ), b = a, a = t;
+                }
+
+                h[0] += a, h[1] += b, h[2] += c, h[3] += d, h[4] += e;
+            }
+
+            for( int i = 0; i < 20; ++i )
+                digest[i] = (unsigned char)( h[ i / 4 ] >> ( 24 - ( i % 4 ) * 8 ) );
+        }
+
+        std::string base64( const unsigned char *data, size_t len )
+        {
+            static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+            std::string out;
+            for( size_t i = 0; i < len; i += 3 )
+            {
+                unsigned v = data[i] << 16 | ( i + 1 < len ? data[i+1] << 8 : 0 ) | ( i + 2 < len ? data[i+2] : 0 );
+                out += table[ ( v >> 18 ) & 63 ];
+                out += table[ ( v >> 12 ) & 63 ];
+                out += i + 1 < len ? table[ ( v >> 6 ) & 63 ] : '=';
+                out += i + 2 < len ? table[ v & 63 ] : '=';
+            }
+            return out;
+        }
+
+        // frames from several threads must not interleave on the same socket. one mutex per descriptor, never shared
+        std::mutex &ws_lock( int sockfd )
+        {
+            static std::mutex guard;
+            static std::map< int, std::unique_ptr<std::mutex> > locks;
+            std::lock_guard<std::mutex> lock( guard );
+            std::unique_ptr<std::mutex> &m = locks[ sockfd ];
+            if( !m )
+                m.reset( new std::mutex );
+            return *m;
+        }
+
+        // sockets served by the shared websocket thread. they are non-blocking: frames sent to them are queued
+        // per connection and flushed when the socket is writable, so a peer that stops reading only stalls itself
+        struct ws_hub_t
+        {
+            struct conn {
+                ws_parser parser;
+                void (*callback)( int sockfd, const std::string &message, int opcode );
+                std::mutex mutex;       // guards the fields below
+                writer out;
+                bool closing = false;   // close frame queued: flush it, then close
+                bool overflow = false;  // peer is not reading: drop it
+                double closing_since = 0;
+
+                explicit conn( int fd ) : out( fd, 64 << 10, 16 << 20 ) {}
+            };
+            typedef std::shared_ptr<conn> conn_ptr;
+
+            std::mutex mutex;
+            std::map<int, conn_ptr> conns;
+            int wake_fd = -1;
+            bool running = false;
+
+            conn_ptr find( int fd )
+            {
+                std::lock_guard<std::mutex> lock( mutex );
+                auto found = conns.find( fd );
+                return found == conns.end() ? conn_ptr() : found->second;
+            }
+
+            void finish( int fd, const conn_ptr &c )
+            {
+                c->callback( fd, std::string(), WS_CLOSE );
+                {
+                    std::lock_guard<std::mutex> lock( mutex );
+                    conns.erase( fd );
+                }
+                {
+                    // senders still holding c must not write to a descriptor that may be reused
+                    std::lock_guard<std::mutex> lock( c->mutex );
+                    c->closing = true;
+                    c->out.reset( -1 );
+                }
+                disconnect( fd );
+            }
+
+            static void job( ws_hub_t *hub )
+            {
+                std::vector<pollfd> fds;
+                std::vector< std::pair<int, conn_ptr> > all, done;
+                std::string message;
+                int opcode;
+
+                for( ;; )
+                {
+                    {
+                        std::lock_guard<std::mutex> lock( hub->mutex );
+                        all.assign( hub->conns.begin(), hub->conns.end() );
+                    }
+
+                    // closed ones go first: flushed, timed out, or over their queue limit
+                    fds.clear();
+                    done.clear();
+                    pollfd wake = { hub->wake_fd, POLLIN, 0 };
+                    fds.push_back( wake );
+                    bool lingering = false;
+                    for( auto &it : all )
+                    {
+                        conn &c = *it.second;
+                        std::lock_guard<std::mutex> lock( c.mutex );
+                        if( c.overflow || c.out.failed() || ( c.closing && ( !c.out.wants_write() || now() - c.closing_since > 5 ) ) )
+                        {
+                            done.push_back( it );
+                            continue;
+                        }
+                        pollfd p = { it.first, short( ( c.closing ? 0 : POLLIN ) | ( c.out.wants_write() ? POLLOUT : 0 ) ), 0 };
+                        fds.push_back( p );
+                        lingering = lingering || c.closing;
+                    }
+                    for( auto &it : done )
+                        hub->finish( it.first, it.second );
+
+                    if( POLL( &fds[0], fds.size(), lingering ? 250 : -1 ) < 0 )
+                        continue;
+
+                    if( fds[0].revents )
+                        drain_wakeup( hub->wake_fd );
+
+                    for( size_t i = 1; i < fds.size(); ++i )
+                    {
+                        if( !fds[i].revents )
+                            continue;
+
+                        int fd = fds[i].fd;
+                        conn_ptr c = hub->find( fd );
+                        if( !c )
+                            continue;
+
+                        bool alive = true;
+                        if( fds[i].revents & POLLOUT )
+                        {
+                            std::lock_guard<std::mutex> lock( c->mutex );
+                            alive = c->out.flush();
+                        }
+
+                        if( alive && ( fds[i].events & POLLIN ) && ( fds[i].revents & ( POLLIN | POLLERR | POLLHUP ) ) )
+                        {
+                            char buffer[ 64 * 1024 ];
+                            int bytes_received = RECV( fd, buffer, sizeof( buffer ), 0 );
+                            alive = bytes_received > 0 || ( bytes_received < 0 && would_block() );
+
+                            if( bytes_received > 0 )
+                            {
+                                knot::bytes_recv += bytes_received;
+                                c->parser.feed( buffer, bytes_received );
+
+                                // replies only queue, and so do sends the callback makes
+                                int ready;
+                                while( ( ready = c->parser.next( message, opcode ) ) != 0 )
+                                {
+                                    if( ready < 0 )
+                                    {
+                                        ws_close( fd, c->parser.close_code );
+                                        break;
+                                    }
+                                    if( opcode == WS_PING )
+                                        ws_send( fd, message, WS_PONG );
+                                    else if( opcode == WS_CLOSE )
+                                    {
+                                        ws_send( fd, message, WS_CLOSE );
+                                        break;
+                                    }
+                                    else if( opcode != WS_PONG )
+                                        c->callback( fd, message, opcode );
+                                }
+                            }
+                        }
+
+                        if( !alive )
+                            hub->finish( fd, c );
+                    }
+                }
+            }
+        } ws_hub;
+    }
+
+    void ws_mask( char *data, size_t len, const unsigned char key[4] )
+    {
+        uint32_t k32;
+        memcpy( &k32, key, 4 );
+
+        size_t i = 0;
+
+#if defined(__AVX2__)
+        __m256i k256 = _mm256_set1_epi32( (int)k32 );
+        for( ; i + 32 <= len; i += 32 )
+        {
+            __m256i v = _mm256_loadu_si256( (const __m256i *)( data + i ) );
+            _mm256_storeu_si256( (__m256i *)( data + i ), _mm256_xor_si256( v, k256 ) );
+        }
+#endif
+#if defined(__AVX2__) || defined(KNOT_SSE2)
+        __m128i k128 = _mm_set1_epi32( (int)k32 );
+        for( ; i + 16 <= len; i += 16 )
+        {
+            __m128i v = _mm_loadu_si128( (const __m128i *)( data + i ) );
+            _mm_storeu_si128( (__m128i *)( data + i ), _mm_xor_si128( v, k128 ) );
+        }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+        uint8x16_t k128 = vreinterpretq_u8_u32( vdupq_n_u32( k32 ) );
+        for( ; i + 16 <= len; i += 16 )
+            vst1q_u8( (uint8_t *)( data + i ), veorq_u8( vld1q_u8( (const uint8_t *)( data + i ) ), k128 ) );
+#endif
+
+        // i stays a multiple of 4, so the key phase is preserved
+        uint64_t k64 = k32 | ( (uint64_t)k32 << 32 );
+        for( ; i + 8 <= len; i += 8 )
+        {
+            uint64_t v;
+            memcpy( &v, data + i, 8 );
+            v ^= k64;
+            memcpy( data + i, &v, 8 );
+        }
+
+        for( ; i < len; ++i )
+            data[i] ^= key[ i & 3 ];
+    }
+
+    ws_parser::ws_parser( size_t max_size, bool server ) : offset(0), partial_opcode(0), max_size(max_size), server(server), close_code(0)
+    {}
+
+    void ws_parser::feed( const char *data, size_t len )
+    {
+        if( offset && offset * 2 >= buffer.size() )
+            buffer.erase( 0, offset ), offset = 0;
+
+        buffer.append( data, len );
+    }
+
+    int ws_parser::next( std::string &message, int &opcode )
+    {
+        for( ;; )
+        {
+            unsigned char *p = (unsigned char *)&buffer[0] + offset;
+            size_t avail = buffer.size() - offset;
+
+            if( avail < 2 )
+                return 0;
+
+            bool fin = p[0] & 0x80, masked = p[1] & 0x80;
+            int op = p[0] & 0x0f;
+            size_t head = 2 + ( masked ? 4 : 0 );
+            uint64_t len = p[1] & 0x7f;
+
+            if( len == 126 )
+            {
+                if( avail < 4 )
+                    return 0;
+                len = ( p[2] << 8 ) | p[3];
+                head += 2;
+            }
+            else if( len == 127 )
+            {
+                if( avail < 10 )
+                    return 0;
+                len = 0;
+                for( int i = 0; i < 8; ++i )
+                    len = ( len << 8 ) | p[ 2 + i ];
+                head += 8;
+            }
+
+            // no extensions are negotiated, so rsv bits must be clear. clients mask every frame, servers none
+            bool control = op & 0x8;
+            close_code = 1002;
+            if( ( p[0] & 0x70 ) || masked != server || ( op > WS_BINARY && op < WS_CLOSE ) || op > WS_PONG )
+                return -1;
+            if( control && ( !fin || len > 125 ) )
+                return -1;
+            if( len > max_size || ( !control && partial.size() + len > max_size ) )
+                return close_code = 1009, -1;
+            close_code = 0;
+            if( avail < head + len )
+                return 0;
+
+            char *payload = (char *)p + head;
+            if( masked )
+                ws_mask( payload, (size_t)len, p + head - 4 );
+
+            offset += head + (size_t)len;
+            if( offset == buffer.size() )
+                offset = 0; // buffer is cleared below, once payload has been copied out
+
+            if( control )
+            {
+                message.assign( payload, (size_t)len );
+                opcode = op;
+            }
+            else if( op == WS_CONTINUATION )
+            {
+                if( !partial_opcode )
+                    return -1;
+                partial.append( payload, (size_t)len );
+                if( fin )
+                {
+                    message.swap( partial );
+                    partial.clear();
+                    opcode = partial_opcode;
+                    partial_opcode = 0;
+                }
+            }
+            else
+            {
+                if( partial_opcode )
+                    return -1;
+                if( fin )
+                {
+                    message.assign( payload, (size_t)len );
+                    opcode = op;
+                }
+                else
+                {
+                    partial.assign( payload, (size_t)len );
+                    partial_opcode = op;
+                }
+            }
+
+            if( !offset )
+                buffer.clear();
+
+            if( control || fin )
+                return 1;
+        }
+    }
+
+    bool ws_upgrade( int &sockfd, const knot::headers &headers )
+    {
+        const span *upgrade = headers.find( H_UPGRADE ), *key = headers.find( H_SEC_WEBSOCKET_KEY );
+        const span *version = headers.find( H_SEC_WEBSOCKET_VERSION ), *connection = headers.find( H_CONNECTION );
+
+        if( sockfd < 0 || !upgrade || !key || upgrade->len != 9 || !equal_nocase( upgrade->ptr, "websocket", 9 ) )
+            return false;
+        if( key->len != 24 || !version || *version != "13" || !connection )
+            return false;
+
+        // Connection is a token list, eg: "keep-alive, Upgrade"
+        bool upgrading = false;
+        for( size_t i = 0; !upgrading && i + 7 <= connection->len; ++i )
+            upgrading = equal_nocase( connection->ptr + i, "upgrade", 7 );
+        if( !upgrading )
+            return false;
+
+        unsigned char digest[20];
+        sha1( key->str() + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11", digest );
+
+        std::string response =
+            "HTTP/1.1 101 Switching Protocols" CRLF
+            "Upgrade: websocket" CRLF
+            "Connection: Upgrade" CRLF
+            "Sec-WebSocket-Accept: " + base64( digest, 20 ) + CRLF CRLF;
+
+        return send_all( sockfd, response.data(), response.size() );
+    }
+
+    bool ws_send( int &sockfd, const std::string &message, int opcode, bool masked )
+    {
+        if( sockfd < 0 )
+            return false;
+
+        size_t len = message.size();
+        unsigned char head[14];
+        size_t n = 0;
+
+        head[n++] = (unsigned char)( 0x80 | ( opcode & 0x0f ) );
+        if( len < 126 )
+            head[n++] = (unsigned char)( ( masked ? 0x80 : 0 ) | len );
+        else if( len <= 0xffff )
+        {
+            head[n++] = (unsigned char)( ( masked ? 0x80 : 0 ) | 126 );
+            head[n++] = (unsigned char)( len >> 8 );
+            head[n++] = (unsigned char)( len );
+        }
+        else
+        {
+            head[n++] = (unsigned char)( ( masked ? 0x80 : 0 ) | 127 );
+            for( int i = 7; i >= 0; --i )
+                head[n++] = (unsigned char)( (uint64_t)len >> ( i * 8 ) );
+        }
+
+        // big unmasked payloads are sent (or queued) after the head, not copied behind it
+        bool whole = masked || len <= 64 * 1024;
+        std::string frame( (const char *)head, n );
+        if( masked )
+        {
+            // per-thread generator, seeded from the system entropy source
+            static thread_local std::mt19937 keys( std::random_device{}() );
+            uint32_t k32 = keys();
+            unsigned char key[4];
+            memcpy( key, &k32, 4 );
+            frame.append( (const char *)key, 4 );
+            frame += message;
+            ws_mask( &frame[ n + 4 ], len, key );
+        }
+        else if( whole )
+            frame += message;
+
+        // attached sockets: queued, the hub flushes them
+        ws_hub_t::conn_ptr c = ws_hub.find( sockfd );
+        if( c )
+        {
+            std::lock_guard<std::mutex> lock( c->mutex );
+            if( c->closing || c->overflow )
+                return false;
+            bool ok = c->out.write( span( frame ) ) && ( whole || c->out.write( span( message ) ) );
+            if( c->out.paused() )
+                c->overflow = true, ok = false;
+            if( opcode == WS_CLOSE )
+                c->closing = true, c->closing_since = now();
+            if( c->out.wants_write() || !ok || c->closing )
+                wakeup( ws_hub.wake_fd );
+            return ok;
+        }
+
+        std::lock_guard<std::mutex> lock( ws_lock( sockfd ) );
+        return send_all( sockfd, frame.data(), frame.size() ) && ( whole || send_all( sockfd, message.data(), len ) );
+    }
+
+    bool ws_receive( int &sockfd, std::string &message, int &opcode, ws_parser &parser, double timeout_sec )
+    {
+        if( sockfd < 0 )
+            return false;
+
+        for( ;; )
+        {
+            int ready;
+            while( ( ready = parser.next( message, opcode ) ) > 0 )
+            {
+                if( opcode == WS_PING )
+                    ws_send( sockfd, message, WS_PONG );
+                else if( opcode != WS_PONG )
+                    return true;
+            }
+
+            if( ready < 0 )
+                return ws_close( sockfd, parser.close_code ), false;  // protocol error
+
+            if( timeout_sec > 0.0 )
+                if( select( sockfd, timeout_sec ) != TCP_OK )
+                    return false;    // error or timeout
+
+            char buffer[ 16 * 1024 ];
+            int bytes_received = RECV( sockfd, buffer, sizeof( buffer ), 0 );
+            if( bytes_received <= 0 )
+                return false;        // error or remote side closed connection
+
+            knot::bytes_recv += bytes_received;
+            parser.feed( buffer, bytes_received );
+        }
+    }
+
+    bool ws_close( int &sockfd, unsigned short code )
+    {
+        char payload[2] = { char( code >> 8 ), char( code ) };
+        return ws_send( sockfd, std::string( payload, 2 ), WS_CLOSE );
+    }
+
+    bool ws_attach( int sockfd, void (*callback)( int sockfd, const std::string &message, int opcode ) )
+    {
+        if( sockfd < 0 || !callback )
+            return false;
+
+        std::lock_guard<std::mutex> lock( ws_hub.mutex );
+
+        if( !ws_hub.running )
+        {
+            if( ( ws_hub.wake_fd = make_wakeup() ) < 0 )
+                return false;
+            std::thread( &ws_hub_t::job, &ws_hub ).detach();
+            ws_hub.running = true;
+        }
+
+        ws_hub_t::conn_ptr c = std::make_shared<ws_hub_t::conn>( sockfd );  // makes sockfd non-blocking
+        c->callback = callback;
+        ws_hub.conns[ sockfd ] = c;
+
+        wakeup( ws_hub.wake_fd );
+        return true;
+    }
+
+    // zero-copy sends
+
+    namespace
+    {
+        std::atomic<size_t> zerocopy_threshold( 64 * 1024 );
+
+        // buffers lent to the kernel, per socket
+        struct zerocopy_t
+        {
+            struct lent {
+                std::string buffer;
+                uint32_t first, last;   // notification ids covering this buffer
+                uint32_t pending;
+            };
+
+            std::mutex mutex;           // sends and reaps on this socket
+            uint64_t cookie = 0;        // identity of the socket, 0 if unknown
+            bool enabled = false;
+            bool copied = false;        // kernel fell back to copying (eg, loopback): stop trying
+            uint32_t next_id = 0;
+            std::deque<lent *> queue;
+
+            ~zerocopy_t()
+            {
+                for( auto *l : queue )
+                    delete l;
+            }
+        };
+
+        typedef std::shared_ptr<zerocopy_t> zerocopy_ptr;
+
+        std::mutex zerocopy_mutex;      // the map only, never held while blocking
+        std::map<int, zerocopy_ptr> zerocopy_sockets;
+        std::atomic<int> zerocopy_count( 0 );
+
+        uint64_t zerocopy_cookie( int sockfd )
+        {
+            uint64_t cookie = 0;
+#if defined(__linux__)
+            socklen_t len = sizeof( cookie );
+            if( GETSOCKOPT( sockfd, SOL_SOCKET, SO_COOKIE, &cookie, &len ) != 0 )
+                cookie = 0;
+#endif
+            return cookie;
+        }
+
+        // state left behind by a socket closed with plain close(): the fd now names another socket
+        bool zerocopy_stale( int sockfd, const zerocopy_t &zc )
+        {
+#if defined(__linux__)
+            if( zc.cookie )
+                return zerocopy_cookie( sockfd ) != zc.cookie;
+            if( zc.enabled )
+            {
+                int on = 0;
+                socklen_t len = sizeof( on );
+                return GETSOCKOPT( sockfd, SOL_SOCKET, SO_ZEROCOPY, &on, &len ) != 0 || !on;
+            }
+#endif
+            return false;
+        }
+
+        // caller holds zerocopy_mutex. stale entries are dropped, never inherited
+        zerocopy_ptr *zerocopy_slot( int sockfd )
+        {
+            auto found = zerocopy_sockets.find( sockfd );
+            if( found == zerocopy_sockets.end() )
+                return 0;
+            if( zerocopy_stale( sockfd, *found->second ) )
+            {
+                zerocopy_sockets.erase( found );
+                --zerocopy_count;
+                return 0;
+            }
+            return &found->second;
+        }
+
+        zerocopy_ptr zerocopy_find( int sockfd )
+        {
+            std::lock_guard<std::mutex> lock( zerocopy_mutex );
+            zerocopy_ptr *slot = zerocopy_slot( sockfd );
+            return slot ? *slot : zerocopy_ptr();
+        }
+
+#if defined(__linux__)
+        // reads completion notifications from the error queue. returns buffers still in flight. caller holds zc.mutex
+        size_t zerocopy_reap( int sockfd, zerocopy_t &zc, double timeout_sec )
+        {
+            double deadline = now() + timeout_sec;
+
+            while( !zc.queue.empty() )
+            {
+                char control[ 128 ];
+                msghdr msg;
+                memset( &msg, 0, sizeof( msg ) );
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof( control );
+
+                if( ::recvmsg( sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT ) < 0 )
+                {
+                    double left = deadline - now();
+                    if( errno != EAGAIN || left <= 0 )
+                        break;
+
+                    pollfd p = { sockfd, 0, 0 };    // POLLERR is always reported
+                    POLL( &p, 1, int( left * 1000 + 0.999 ) );
+                    continue;
+                }
+
+                for( cmsghdr *cm = CMSG_FIRSTHDR( &msg ); cm; cm = CMSG_NXTHDR( &msg, cm ) )
+                {
+                    sock_extended_err err;
+                    memcpy( &err, CMSG_DATA( cm ), sizeof( err ) );
+                    if( err.ee_origin != SO_EE_ORIGIN_ZEROCOPY )
+                        continue;
+
+                    if( err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED )
+                        zc.copied = true;
+
+                    // [ee_info, ee_data] range of completed ids
+                    for( auto *l : zc.queue )
+                    {
+                        uint32_t lo = err.ee_info > l->first ? err.ee_info : l->first;
+                        uint32_t hi = err.ee_data < l->last ? err.ee_data : l->last;
+                        if( lo <= hi )
+                            l->pending -= hi - lo + 1;
+                    }
+                }
+
+                while( !zc.queue.empty() && !zc.queue.front()->pending )
+                    delete zc.queue.front(), zc.queue.pop_front();
+            }
+
+            return zc.queue.size();
+        }
+
+        // sockets disconnected while the kernel still had buffers: kept open, write side shut, until every
+        // completion is in. the kernel finishes sending (or gives up on the peer) on its own schedule
+        struct zerocopy_reaper_t
+        {
+            std::mutex mutex;
+            std::vector< std::pair<int, zerocopy_ptr> > sockets;
+            bool running = false;
+
+            void add( int sockfd, const zerocopy_ptr &zc )
+            {
+                std::lock_guard<std::mutex> lock( mutex );
+                sockets.push_back( std::make_pair( sockfd, zc ) );
+                if( !running )
+                {
+                    running = true;
+                    std::thread( &zerocopy_reaper_t::run, this ).detach();
+                }
+            }
+
+            void run()
+            {
+                for( ;; )
+                {
+                    std::vector< std::pair<int, zerocopy_ptr> > batch;
+                    {
+                        std::lock_guard<std::mutex> lock( mutex );
+                        if( sockets.empty() )
+                            return (void)( running = false );
+                        batch = sockets;
+                    }
+
+                    std::vector<pollfd> fds;
+                    for( auto &it : batch )
+                    {
+                        pollfd p = { it.first, 0, 0 };  // POLLERR is always reported
+                        fds.push_back( p );
+                    }
+                    POLL( &fds[0], fds.size(), 250 );
+
+                    std::vector<int> done;
+                    for( auto &it : batch )
+                    {
+                        std::lock_guard<std::mutex> lock( it.second->mutex );
+                        if( !zerocopy_reap( it.first, *it.second, 0 ) )
+                            done.push_back( it.first );
+                    }
+
+                    std::lock_guard<std::mutex> lock( mutex );
+                    for( int fd : done )
+                    {
+                        for( size_t i = 0; i < sockets.size(); ++i )
+                            if( sockets[i].first == fd )
+                            {
+                                sockets.erase( sockets.begin() + i );
+                                break;
+                            }
+                        CLOSE( fd );
+                    }
+                }
+            }
+        } zerocopy_reaper;
+#endif
+
+        // forgets the socket. true if its buffers are still in flight: the reaper closes it later
+        bool zerocopy_release( int sockfd )
+        {
+            if( !zerocopy_count )
+                return false;
+
+            zerocopy_ptr zc;
+            {
+                std::lock_guard<std::mutex> lock( zerocopy_mutex );
+                zerocopy_ptr *slot = zerocopy_slot( sockfd );
+                if( !slot )
+                    return false;
+                zc = *slot;
+                zerocopy_sockets.erase( sockfd );
+                --zerocopy_count;
+            }
+
+#if defined(__linux__)
+            // closing now would let the kernel send pages the allocator already reused
+            std::lock_guard<std::mutex> lock( zc->mutex );
+            if( zerocopy_reap( sockfd, *zc, 0 ) )
+            {
+                SHUTDOWN_W( sockfd );
+                zerocopy_reaper.add( sockfd, zc );
+                return true;
+            }
+#endif
+            return false;
+        }
+    }
+
+    void set_zerocopy_threshold( size_t bytes )
+    {
+        zerocopy_threshold = bytes;
+    }
+
+    bool send_zerocopy( int &sockfd, std::string &&output, double timeout_sec )
+    {
+        if( sockfd < 0 )
+            return false;
+
+#if defined(__linux__)
+        size_t threshold = zerocopy_threshold;
+        if( threshold && output.size() >= threshold )
+        {
+            zerocopy_ptr zc;
+            {
+                std::lock_guard<std::mutex> lock( zerocopy_mutex );
+                zerocopy_ptr *slot = zerocopy_slot( sockfd );
+                if( !slot )
+                {
+                    zc = std::make_shared<zerocopy_t>();
+                    int one = 1;
+                    zc->cookie = zerocopy_cookie( sockfd );
+                    zc->enabled = SETSOCKOPT( sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof( one ) ) == 0;
+                    zerocopy_sockets[ sockfd ] = zc;
+                    ++zerocopy_count;
+                }
+                else
+                    zc = *slot;
+            }
+
+            // only this socket waits on its own lock while blocked below
+            std::lock_guard<std::mutex> lock( zc->mutex );
+            zerocopy_reap( sockfd, *zc, 0 );
+
+            if( zc->enabled && !zc->copied )
+            {
+                double deadline = timeout_sec > 0 ? now() + timeout_sec : 0;
+
+                zerocopy_t::lent *l = new zerocopy_t::lent;
+                l->buffer.swap( output );
+                l->first = zc->next_id;
+                l->pending = 0;
+
+                const char *data = l->buffer.data();
+                size_t len = l->buffer.size();
+
+                while( len > 0 )
+                {
+                    int sent = SEND( sockfd, data, len, MSG_ZEROCOPY | MSG_NOSIGNAL | MSG_DONTWAIT );
+                    if( sent < 0 )
+                    {
+                        double left = deadline > 0 ? deadline - now() : 1;
+                        if( left <= 0 )
+                            break;
+                        if( errno == ENOBUFS )
+                            zerocopy_reap( sockfd, *zc, left < 0.01 ? left : 0.01 ); // too much memory pinned: wait for completions
+                        else if( would_block() )
+                        {
+                            pollfd p = { sockfd, POLLOUT, 0 };
+                            if( POLL( &p, 1, deadline > 0 ? int( left * 1000 + 0.999 ) : -1 ) <= 0 )
+                                break;
+                        }
+                        else
+                            break;
+                        continue;
+                    }
+
+                    // every successful call gets its own notification id
+                    ++zc->next_id;
+                    ++l->pending;
+                    knot::bytes_sent += sent;
+                    data += sent;
+                    len -= sent;
+                }
+
+                l->last = zc->next_id - 1;
+                if( l->pending )
+                    zc->queue.push_back( l );
+                else
+                    delete l;
+
+                return len == 0;
+            }
+        }
+#endif
+
+        return send_all( sockfd, output.data(), output.size() );
+    }
+
+    size_t reap_zerocopy( int &sockfd, double timeout_sec )
+    {
+        zerocopy_ptr zc = sockfd < 0 ? zerocopy_ptr() : zerocopy_find( sockfd );
+        if( !zc )
+            return 0;
+#if defined(__linux__)
+        std::lock_guard<std::mutex> lock( zc->mutex );
+        return zerocopy_reap( sockfd, *zc, timeout_sec );
+#else
+        return 0;
+#endif
+    }
+
+    bool disconnect( int &sockfd, double timeout_sec )
+    {
+        if( sockfd < 0 )
+            return true;
+
+        if( zerocopy_release( sockfd ) )
+            return sockfd = -1, true;   // the zero-copy reaper closes it once the kernel is done with its buffers
+
+        bool success = ( CLOSE( sockfd ) == 0 );
+        sockfd = -1;
+
+        return success;
+    }
+
+    namespace
+    {
+        // listening sockets received from a previous process by adopt(), by listener_key()
+        std::mutex inherited_mutex;
+        std::multimap<std::string, int> inherited;
+
+        std::string listener_key( const std::string &bindip, unsigned port )
+        {
+            if( is_unix( bindip ) )
+                return bindip;
+            return ( bindip.empty() ? std::string("0.0.0.0") : bindip ) + ':' + std::to_string( port );
+        }
+
+        int take_inherited( const std::string &key )
+        {
+            std::lock_guard<std::mutex> lock( inherited_mutex );
+            auto found = inherited.find( key );
+            if( found == inherited.end() )
+                return -1;
+            int fd = found->second;
+            inherited.erase( found );
+            return fd;
+        }
+
+        // bound and listening unix socket, -1 on error. a stale socket file left by a dead server is replaced
+        int open_unix_listener( const std::string &bindip, const sockopts &opts, unsigned backlog_queue )
+        {
+#if defined(_WIN32)
+            return "error: unix sockets not supported", -1;
+#else
+            sockaddr_un sun;
+            socklen_t len;
+            if( !unix_address( bindip, sun, len ) )
+                return "error: invalid unix socket address", -1;
+
+            int fd = ::socket( AF_UNIX, SOCK_STREAM, 0 );
+            if( fd == -1 )
+                return "error: cannot create socket", -1;
+
+            if( BIND( fd, (sockaddr *)&sun, len ) == -1 )
+            {
+                struct stat st;
+                bool stale = false;
+                if( errno == EADDRINUSE && sun.sun_path[0] && stat( sun.sun_path, &st ) == 0 && S_ISSOCK( st.st_mode ) )
+                {
+                    int probe = ::socket( AF_UNIX, SOCK_STREAM, 0 );
+                    stale = probe != -1 && CONNECT( probe, (sockaddr *)&sun, len ) == -1 && errno == ECONNREFUSED;
+                    if( probe != -1 )
+                        CLOSE( probe );
+                }
+                if( !stale || unlink( sun.sun_path ) != 0 || BIND( fd, (sockaddr *)&sun, len ) == -1 )
+                {
+                    CLOSE( fd );
+                    return "error: bind failed", -1;
+                }
+            }
+
+            tune( fd, opts, true ); // best effort: tcp options do not apply
+
+            if( LISTEN( fd, backlog_queue ) == -1 )
+            {
+                CLOSE( fd );
+                return "error: listen failed", -1;
+            }
+
+            return fd;
+#endif
+        }
+
+        // bound and listening ipv4 socket, -1 on error
+        int open_listener( const std::string &_bindip, unsigned port, const sockopts &opts, unsigned backlog_queue, bool reuseport )
+        {
+            int adopted = take_inherited( listener_key( _bindip, port ) );
+            if( adopted >= 0 )
+                return adopted; // already bound and listening, with its backlog of pending connections
+
+            if( is_unix( _bindip ) )
+                return reuseport ? ( "error: SO_REUSEPORT not supported on unix sockets", -1 ) : open_unix_listener( _bindip, opts, backlog_queue );
+
+            std::string bindip = ( _bindip.empty() ? std::string("0.0.0.0") : _bindip );
+
+            struct sockaddr_in stSockAddr;
+            int fd = ::socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+            if( fd == -1 )
+                return "error: cannot create socket", -1;
+
+            memset(&stSockAddr, 0, sizeof(stSockAddr));
+
+            inet_pton(AF_INET, bindip.c_str(), &(stSockAddr.sin_addr));
+
+            stSockAddr.sin_family = AF_INET;
+            stSockAddr.sin_port = htons( port );
+            //stSockAddr.sin_addr.s_addr = INADDR_ANY;
+
+            $welse({
+                int yes = 1;
+                if ( SETSOCKOPT( fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int) ) == -1 )
+                {}
+            })
+
+#if defined(SO_REUSEPORT)
+            if( reuseport )
+            {
+                int yes = 1;
+                if( SETSOCKOPT( fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int) ) == -1 )
+                {
+                    CLOSE( fd );
+                    return "error: SO_REUSEPORT failed", -1;
+                }
+            }
+#endif
+
+            if( BIND( fd, (struct sockaddr *)&stSockAddr, sizeof(stSockAddr) ) == -1 )
+            {
+                CLOSE(fd);
+                return "error: bind failed", -1;
+            }
+
+            tune( fd, opts, true ); // best effort: unsupported options are ignored
+
+            if( LISTEN( fd, backlog_queue ) == -1 )
+            {
+                CLOSE( fd );
+                return "error: listen failed", -1;
+            }
+
+            return fd;
+        }
+    }
+
+    // admission control
+
+    admission::admission() :
+        min_limit(4), max_limit(4096), initial_limit(256), tolerance(2), window(0.1), backoff(0.9), retry_after(1), http(true)
+    {}
+
+    namespace
+    {
+        // accept thread only
+        bool admission_enter( admission_t &adm )
+        {
+            if( adm.in_flight.load() >= adm.cap.load( std::memory_order_relaxed ) )
+                return adm.shed++, false;
+            adm.in_flight++;
+            adm.admitted++;
+            return true;
+        }
+
+        // shed sockets, write side shut: closing with unread input would reset the connection before the client
+        // reads the 503. each is drained until the client closes or a second passes, away from the accept loop
+        struct shed_linger_t
+        {
+            std::mutex mutex;
+            std::vector< std::pair<int, double> > sockets;  // fd, deadline
+            bool running = false;
+
+            void add( int fd )
+            {
+                {
+                    std::lock_guard<std::mutex> lock( mutex );
+                    if( sockets.size() < 1024 )
+                    {
+                        sockets.push_back( std::make_pair( fd, now() + 1 ) );
+                        if( !running )
+                        {
+                            running = true;
+                            std::thread( &shed_linger_t::run, this ).detach();
+                        }
+                        return;
+                    }
+                }
+                CLOSE( fd );    // too many lingering already
+            }
+
+            void run()
+            {
+                char buffer[ 4096 ];
+                for( ;; )
+                {
+                    std::vector< std::pair<int, double> > batch;
+                    {
+                        std::lock_guard<std::mutex> lock( mutex );
+                        if( sockets.empty() )
+                            return (void)( running = false );
+                        batch = sockets;
+                    }
+
+                    std::vector<pollfd> fds;
+                    for( auto &it : batch )
+                    {
+                        pollfd p = { it.first, POLLIN, 0 };
+                        fds.push_back( p );
+                    }
+                    POLL( &fds[0], fds.size(), 50 );
+
+                    double t = now();
+                    std::vector<int> done;
+                    for( size_t i = 0; i < batch.size(); ++i )
+                    {
+                        bool finished = batch[i].second <= t || ( fds[i].revents & ( POLLERR | POLLHUP | POLLNVAL ) );
+                        if( !finished && ( fds[i].revents & POLLIN ) )
+                            finished = RECV( batch[i].first, buffer, sizeof( buffer ), 0 ) <= 0;  // eof: the client is done
+                        if( finished )
+                            done.push_back( batch[i].first );
+                    }
+
+                    std::lock_guard<std::mutex> lock( mutex );
+                    for( int fd : done )
+                    {
+                        for( size_t i = 0; i < sockets.size(); ++i )
+                            if( sockets[i].first == fd )
+                            {
+                                sockets.erase( sockets.begin() + i );
+                                break;
+                            }
+                        CLOSE( fd );
+                    }
+                }
+            }
+        } shed_linger;
+
+        void admission_shed( admission_t &adm, int child_fd )
+        {
+            std::unique_lock<std::mutex> lock( adm.lock );
+            if( !adm.config.http )
+            {
+                lock.unlock();
+                CLOSE( child_fd );
+                return;
+            }
+
+            SEND( child_fd, adm.rejection.data(), adm.rejection.size(), $windows(0) $welse( MSG_NOSIGNAL | MSG_DONTWAIT ) );
+            lock.unlock();
+
+            SHUTDOWN_W( child_fd );
+            shed_linger.add( child_fd );
+        }
+
+        // gradient on handler latency: min_latency * tolerance / latency. while it stays >= 1 and the cap is
+        // being reached the limit grows additively; below 1 it shrinks by the gradient, at least by backoff and
+        // at most by half, once per window. the minimum is re-probed every 100 windows, so it follows slow drift
+        void admission_finished( admission_t &adm, double latency )
+        {
+            std::lock_guard<std::mutex> lock( adm.lock );
+            const admission &c = adm.config;
+            double t = now();
+
+            adm.latency = adm.latency > 0 ? adm.latency * 0.8 + latency * 0.2 : latency;
+            if( t - adm.min_since >= 100 * c.window )
+                adm.min_latency = adm.latency, adm.min_since = t;
+            else if( adm.min_latency <= 0 || latency < adm.min_latency )
+                adm.min_latency = latency;
+
+            double gradient = adm.latency > 0 ? adm.min_latency * c.tolerance / adm.latency : 1;
+            if( gradient < 1 )
+            {
+                if( t - adm.last_decrease >= c.window )
+                {
+                    adm.limit = std::max( double( c.min_limit ), adm.limit * std::max( 0.5, std::min( c.backoff, gradient ) ) );
+                    adm.last_decrease = t;
+                }
+            }
+            else if( adm.in_flight.load() * 2 >= adm.limit )
+                adm.limit = std::min( double( c.max_limit ), adm.limit + 1 / adm.limit ); // about +1 per limit admitted
+
+            adm.cap.store( unsigned( adm.limit ), std::memory_order_relaxed );
+        }
+
+        void admission_configure( admission_t &adm, const admission &config )
+        {
+            adm.config = config;
+            adm.config.min_limit = std::max( 1u, config.min_limit );
+            adm.config.max_limit = std::max( adm.config.min_limit, config.max_limit );
+            adm.limit = std::min( double( adm.config.max_limit ), std::max( double( adm.config.min_limit ), adm.limit ) );
+            adm.cap.store( unsigned( adm.limit ) );
+
+            adm.rejection = std::string( status_line( 503 ) ) +
+                "Retry-After: " + std::to_string( config.retry_after ) + CRLF
+                "Content-Length: 0" CRLF
+                "Connection: close" CRLF CRLF;
+        }
+    }
+
+    bool admit( int &sockfd, const admission &config )
+    {
+        auto found = listeners.find( sockfd );
+        if( found == listeners.end() )
+            return "error: not a listen() socket", false;
+
+        control_t *control = found->second;
+        std::shared_ptr<admission_t> adm = std::atomic_load( &control->admission );
+        if( adm )
+        {
+            std::lock_guard<std::mutex> lock( adm->lock );
+            admission_configure( *adm, config );
+            return true;
+        }
+
+        adm = std::make_shared<admission_t>();
+        adm->limit = config.initial_limit;
+        adm->latency = adm->min_latency = adm->last_decrease = 0;
+        adm->min_since = now();
+        adm->in_flight = 0;
+        adm->admitted = adm->shed = 0;
+        admission_configure( *adm, config );
+        std::atomic_store( &control->admission, adm );
+        return true;
+    }
+
+    bool get_admission_stats( int sockfd, admission_stats &stats )
+    {
+        auto found = listeners.find( sockfd );
+        std::shared_ptr<admission_t> adm = found == listeners.end() ? std::shared_ptr<admission_t>() : std::atomic_load( &found->second->admission );
+        if( !adm )
+            return false;
+
+        std::lock_guard<std::mutex> lock( adm->lock );
+        stats.limit = adm->cap.load();
+        stats.in_flight = adm->in_flight.load();
+        stats.admitted = adm->admitted.load();
+        stats.shed = adm->shed.load();
+        stats.latency = adm->latency;
+        stats.min_latency = adm->min_latency;
+        return true;
+    }
+
+    namespace
+    {
+        typedef void (*string_callback)( int master_fd, int child_fd, std::string client_addr_ip, std::string client_addr_port );
+        typedef void (*peer_callback)( int master_fd, int child_fd, const peer &client );
+
+        bool start_listener( int &fd, const std::string &_bindip, const std::string &_port, string_callback callback, peer_callback callback2, const sockopts &opts, unsigned backlog_queue )
+        {
+            unsigned port = 0;
+            if( !is_unix( _bindip ) )
+            {
+                if( !(std::stringstream( _port ) >> port) )
+                    return "error: invalid port number", false;
+                if( !port )
+                    return "error: invalid port number", false;
+            }
+
+            fd = open_listener( _bindip, port, opts, backlog_queue, false );
+            if( fd == -1 )
+                return "error: cannot bind or listen", false;
+
+            set_nonblocking( fd, true ); // the worker drains every pending connection per wakeup
+
+            struct worker
+            {
+                static void job( control_t *control )
+                {
+                    control->ready = true;
+
+                    try {
+
+                        while( !control->exiting )
+                        {
+                            // wake up on new connections (or now and then, to notice shutdowns)
+                            pollfd p = { control->master_fd, POLLIN, 0 };
+                            if( POLL( &p, 1, 250 ) <= 0 )
+                                continue;
+
+                            for( ;; )
+                            {
+                                if( control->handed_over )
+                                    break;
+
+                                peer client;
+                                int child_fd = accept_peer( control->master_fd, client );
+
+                                if( control->exiting && !control->handed_over )
+                                {
+                                    if( child_fd >= 0 )
+                                        CLOSE( child_fd );
+                                    break;
+                                }
+
+                                if( child_fd < 0 )
+                                {
+                                    if( !would_block() )
+                                        std::this_thread::sleep_for( std::chrono::milliseconds( 10 ) ); // eg, out of fds: back off
+                                    break;
+                                }
+
+                                std::shared_ptr<admission_t> adm = std::atomic_load( &control->admission );
+                                if( adm )
+                                {
+                                    if( !admission_enter( *adm ) )
+                                    {
+                                        admission_shed( *adm, child_fd );
+                                        continue;
+                                    }
+
+                                    tune( child_fd, control->opts );
+
+                                    if( settings::threaded )
+                                        std::thread( &worker::admitted, control->master_fd, control->callback, control->peer_callback, adm, child_fd, client ).detach();
+                                    else
+                                        admitted( control->master_fd, control->callback, control->peer_callback, adm, child_fd, client );
+                                    continue;
+                                }
+
+                                tune( child_fd, control->opts );
+
+                                if( control->peer_callback )
+                                {
+                                    if( settings::threaded )
+                                        std::thread( control->peer_callback, control->master_fd, child_fd, client ).detach();
+                                    else
+                                        (*control->peer_callback)( control->master_fd, child_fd, client );
+                                    continue;
+                                }
+
+                                std::string client_addr_ip = client.ip(), client_addr_port = client.port();
+
+                                if( settings::threaded )
+                                    std::thread( control->callback, control->master_fd, child_fd, std::move( client_addr_ip ), std::move( client_addr_port ) ).detach();
+                                else
+                                    (*control->callback)( control->master_fd, child_fd, client_addr_ip, client_addr_port );
+
+                                /* this should be done inside callback!
+
+                                if( SHUTDOWN( child_fd ) == -1 )
+                                {
+                                    CLOSE( child_fd );
+                                    "error: cannot shutdown socket";
+                                    return;
+                                }
+
+                                CLOSE( child_fd );
+
+                                */
+                            }
+                        }
+                    }
+                    catch(...) {
+
+                    }
+
+                    control->finished = true;
+                }
+
+                static void admitted( int master_fd, string_callback callback, peer_callback callback2, std::shared_ptr<admission_t> adm, int child_fd, peer client )
+                {
+                    double started = now();
+
+                    if( callback2 )
+                        (*callback2)( master_fd, child_fd, client );
+                    else
+                        (*callback)( master_fd, child_fd, client.ip(), client.port() );
+
+                    admission_finished( *adm, now() - started );
+                    adm->in_flight--;
+                }
+            };
+
+            // 2013.04.30.17:49 @r-lyeh says: My Ubuntu Linux setup passes this C++11
+            // block *only* when -lpthread is specified at linking stage. Go figure {
+            try {
+                control_t *c = new control_t();
+                c->ready = false;
+                c->exiting = false;
+                c->finished = false;
+                c->handed_over = false;
+                c->master_fd = fd;
+                c->callback = callback;
+                c->peer_callback = callback2;
+                c->port = _port;
+                c->path = is_unix( _bindip ) ? _bindip : std::string();
+                c->address = listener_key( _bindip, port );
+                c->opts = opts;
+                c->opts.fastopen = c->opts.defer_accept = -1; // listener-only options
+
+                std::thread( &worker::job, c ).detach();
+
+                while( !c->ready )
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+                listeners[ fd ] = c;
+                return true;
+            }
+            catch(...) {
+            }
+            // }
+            CLOSE( fd );
+            return "cannot launch listening thread. forgot -lpthread?", false;
+        }
+    }
+
+    bool listen( int &fd, const std::string &bindip, const std::string &port, void (*callback)( int master_fd, int child_fd, std::string client_addr_ip, std::string client_addr_port ), unsigned backlog_queue )
+    {
+        return start_listener( fd, bindip, port, callback, 0, sockopts(), backlog_queue );
+    }
+
+    bool listen( int &fd, const std::string &bindip, const std::string &port, void (*callback)( int master_fd, int child_fd, std::string client_addr_ip, std::string client_addr_port ), const sockopts &opts, unsigned backlog_queue )
+    {
+        return start_listener( fd, bindip, port, callback, 0, opts, backlog_queue );
+    }
+
+    bool listen( int &fd, const std::string &bindip, const std::string &port, void (*callback)( int master_fd, int child_fd, const peer &client ), const sockopts &opts, unsigned backlog_queue )
+    {
+        return start_listener( fd, bindip, port, 0, callback, opts, backlog_queue );
+    }
+
+    bool shutdown( int &sockfd ) {
+        if( sockfd < 0 )
+            return "invalid socket", false;
+
+        auto group = core_groups.find( sockfd );
+        if( group != core_groups.end() ) {
+            stop_cores( group->second );
+            core_groups.erase( group );
+            sockfd = -1;
+            return true;
+        }
+
+        if( listeners.find(sockfd) == listeners.end() )
+            return "invalid socket", false;
+
+        auto *listener = listeners[ sockfd ];
+        listener->exiting = true;
+        while( !listener->finished ) {
+            CLOSE( sockfd );
+            int dummy_fd; // dummy request
+            if( listener->path.empty() ) {
+                knot::connect( dummy_fd, "localhost", listener->port, 0.25 );
+                knot::connect( dummy_fd, "127.0.0.1", listener->port, 0.25 );
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        $welse(
+        if( !listener->path.empty() && listener->path[5] != '@' )
+            unlink( listener->path.c_str() + 5 );
+        )
+
+        delete listener;
+        listeners.erase( listeners.find( sockfd ) );
+
+        sockfd = -1;
+        return true;
+    }
+
+    bool shutdown() {
+        bool ok = true;
+        while( listeners.size() ) {
+            int master_fd = listeners.begin()->second->master_fd;
+            ok &= knot::shutdown(master_fd);
+        }
+        while( core_groups.size() ) {
+            int master_fd = core_groups.begin()->first;
+            ok &= knot::shutdown(master_fd);
+        }
+        close_unadopted();
+        return ok;
+    }
+
+    // http responses
+
+    namespace
+    {
+        const struct status_t {
+            int code;
+            const char *line;
+        } statuses[] = {
+            { 100, "HTTP/1.1 100 Continue" CRLF },
+            { 101, "HTTP/1.1 101 Switching Protocols" CRLF },
+            { 200, "HTTP/1.1 200 OK" CRLF },
+            { 201, "HTTP/1.1 201 Created" CRLF },
+            { 202, "HTTP/1.1 202 Accepted" CRLF },
+            { 204, "HTTP/1.1 204 No Content" CRLF },
+            { 206, "HTTP/1.1 206 Partial Content" CRLF },
+            { 301, "HTTP/1.1 301 Moved Permanently" CRLF },
+            { 302, "HTTP/1.1 302 Found" CRLF },
+            { 303, "HTTP/1.1 303 See Other" CRLF },
+            { 304, "HTTP/1.1 304 Not Modified" CRLF },
+            { 307, "HTTP/1.1 307 Temporary Redirect" CRLF },
+            { 308, "HTTP/1.1 308 Permanent Redirect" CRLF },
+            { 400, "HTTP/1.1 400 Bad Request" CRLF },
+            { 401, "HTTP/1.1 401 Unauthorized" CRLF },
+            { 403, "HTTP/1.1 403 Forbidden" CRLF },
+            { 404, "HTTP/1.1 404 Not Found" CRLF },
+            { 405, "HTTP/1.1 405 Method Not Allowed" CRLF },
+            { 408, "HTTP/1.1 408 Request Timeout" CRLF },
+            { 409, "HTTP/1.1 409 Conflict" CRLF },
+            { 410, "HTTP/1.1 410 Gone" CRLF },
+            { 411, "HTTP/1.1 411 Length Required" CRLF },
+            { 413, "HTTP/1.1 413 Content Too Large" CRLF },
+            { 414, "HTTP/1.1 414 URI Too Long" CRLF },
+            { 415, "HTTP/1.1 415 Unsupported Media Type" CRLF },
+            { 416, "HTTP/1.1 416 Range Not Satisfiable" CRLF },
+            { 417, "HTTP/1.1 417 Expectation Failed" CRLF },
+            { 426, "HTTP/1.1 426 Upgrade Required" CRLF },
+            { 429, "HTTP/1.1 429 Too Many Requests" CRLF },
+            { 431, "HTTP/1.1 431 Request Header Fields Too Large" CRLF },
+            { 500, "HTTP/1.1 500 Internal Server Error" CRLF },
+            { 501, "HTTP/1.1 501 Not Implemented" CRLF },
+            { 502, "HTTP/1.1 502 Bad Gateway" CRLF },
+            { 503, "HTTP/1.1 503 Service Unavailable" CRLF },
+            { 504, "HTTP/1.1 504 Gateway Timeout" CRLF }
+        };
+
+        std::string format_date( time_t t )
+        {
+            tm parts;
+            $windows( gmtime_s( &parts, &t ); )
+            $welse( gmtime_r( &t, &parts ); )
+            char text[ 64 ];
+            strftime( text, sizeof( text ), "%a, %d %b %Y %H:%M:%S GMT", &parts );
+            return text;
+        }
+
+        // Date header values, double buffered: the ticker rewrites the idle slot, then flips
+        struct date_ticker
+        {
+            char slots[2][32];
+            std::atomic<int> current;
+
+            date_ticker() : current(0)
+            {
+                update( 0, time( 0 ) );
+                std::thread( &date_ticker::run, this ).detach();
+            }
+
+            void update( int slot, time_t t )
+            {
+                std::string date = format_date( t );
+                memcpy( slots[ slot ], date.c_str(), date.size() + 1 );
+            }
+
+            void run()
+            {
+                for( ;; )
+                {
+                    // wake up right after each second starts. format the target second: coarse clocks may lag behind
+                    auto next = std::chrono::time_point_cast<std::chrono::seconds>( std::chrono::system_clock::now() ) + std::chrono::seconds( 1 );
+                    std::this_thread::sleep_until( next );
+                    update( 1 - current, std::chrono::system_clock::to_time_t( next ) );
+                    current = 1 - current;
+                }
+            }
+        };
+    }
+
+    const char *status_line( int status )
+    {
+        static const struct table_t {
+            const char *lines[ 600 ];
+            table_t() {
+                memset( lines, 0, sizeof( lines ) );
+                for( auto &s : statuses )
+                    lines[ s.code ] = s.line;
+            }
+        } table;
+
+        return status >= 0 && status < 600 ? table.lines[ status ] : 0;
+    }
+
+    span http_date()
+    {
+        static date_ticker *ticker = new date_ticker; // never freed: the ticker thread outlives static destructors
+        const char *date = ticker->slots[ ticker->current ];
+        return span( date, 29 );
+    }
+
+    response &response::start( int status )
+    {
+        head.clear();
+        content = span();
+        ended = false;
+
+        const char *line = status_line( status );
+        if( line )
+            head += line;
+        else
+        {
+            char text[ 32 ];
+            head.append( text, sprintf( text, "HTTP/1.1 %03d " CRLF, status % 1000 ) ); // reason phrase is optional
+        }
+
+        span date = http_date();
+        head.append( "Date: ", 6 ).append( date.ptr, date.len ).append( CRLF, 2 );
+        return *this;
+    }
+
+    response &response::header( const char *key, const span &value )
+    {
+        head.append( key ).append( ": ", 2 ).append( value.ptr, value.len ).append( CRLF, 2 );
+        return *this;
+    }
+
+    response &response::header( header_id id, const span &value )
+    {
+        return header( headers::name( id ), value );
+    }
+
+    response &response::body( const span &data )
+    {
+        char digits[ 24 ];
+        content = data;
+        head.append( "Content-Length: ", 16 ).append( digits, sprintf( digits, "%llu", (unsigned long long)data.len ) ).append( CRLF, 2 );
+        return *this;
+    }
+
+    response &response::end()
+    {
+        if( !ended )
+            head.append( CRLF, 2 ), ended = true;
+        return *this;
+    }
+
+    bool response::send( int &sockfd, double timeout_sec )
+    {
+        end();
+        span parts[] = { span( head ), content };
+        return sendv( sockfd, parts, content.len ? 2 : 1, timeout_sec );
+    }
+
+    // forms
+
+    namespace
+    {
+        // percent and plus decoding
+        std::string form_decode( const span &text )
+        {
+            auto from_hex = []( char ch ) -> int {
+                return ch >= '0' && ch <= '9' ? ch - '0' : ( ch | 0x20 ) >= 'a' && ( ch | 0x20 ) <= 'f' ? ( ch | 0x20 ) - 'a' + 10 : -1;
+            };
+
+            std::string out;
+            out.reserve( text.len );
+            for( size_t i = 0; i < text.len; ++i )
+            {
+                char ch = text.ptr[i];
+                if( ch == '+' )
+                    ch = ' ';
+                else if( ch == '%' && i + 2 < text.len && from_hex( text.ptr[i+1] ) >= 0 && from_hex( text.ptr[i+2] ) >= 0 )
+                    ch = char( from_hex( text.ptr[i+1] ) << 4 | from_hex( text.ptr[i+2] ) ), i += 2;
+                out += ch;
+            }
+            return out;
+        }
+
+        bool form_plain( const span &text )
+        {
+            return !memchr( text.ptr, '%', text.len ) && !memchr( text.ptr, '+', text.len );
+        }
+
+        // value of a "; key=value" or "; key=\"value\"" parameter in a header value. empty span if absent
+        span header_param( const span &value, const char *key )
+        {
+            size_t klen = strlen( key );
+            const char *p = value.ptr, *end = value.ptr + value.len;
+
+            while( p < end )
+            {
+                const char *semi = (const char *)memchr( p, ';', end - p );
+                if( !semi )
+                    break;
+                span param = trimmed( span( semi + 1, end - semi - 1 ) );
+                p = semi + 1;
+
+                if( param.len <= klen || param.ptr[klen] != '=' || !equal_nocase( param.ptr, key, klen ) )
+                    continue;
+
+                const char *v = param.ptr + klen + 1, *vend = end;
+                if( v < vend && *v == '"' )
+                {
+                    const char *close = (const char *)memchr( v + 1, '"', vend - v - 1 );
+                    return close ? span( v + 1, close - v - 1 ) : span();
+                }
+                const char *stop = (const char *)memchr( v, ';', vend - v );
+                return trimmed( span( v, ( stop ? stop : vend ) - v ) );
+            }
+            return span();
+        }
+
+        // first occurrence of needle in [data, data + len), len if none
+        size_t find_bytes( const char *data, size_t len, const std::string &needle )
+        {
+            const char *p = data, *end = data + len;
+            while( size_t( end - p ) >= needle.size() )
+            {
+                p = (const char *)memchr( p, needle[0], end - p - needle.size() + 1 );
+                if( !p )
+                    break;
+                if( !memcmp( p, needle.data(), needle.size() ) )
+                    return p - data;
+                ++p;
+            }
+            return len;
+        }
+    }
+
+    std::string form_field::key() const
+    {
+        return form_decode( name );
+    }
+
+    std::string form_field::text() const
+    {
+        return form_decode( value );
+    }
+
+    size_t form::parse( const span &body )
+    {
+        size_t before = fields.size();
+        const char *p = body.ptr, *end = body.ptr + body.len;
+
+        while( p < end )
+        {
+            const char *amp = (const char *)memchr( p, '&', end - p );
+            const char *stop = amp ? amp : end;
+            if( stop > p )
+            {
+                const char *eq = (const char *)memchr( p, '=', stop - p );
+                form_field f;
+                f.name = span( p, ( eq ? eq : stop ) - p );
+                f.value = eq ? span( eq + 1, stop - eq - 1 ) : span();
+                fields.push_back( f );
+            }
+            p = stop + 1;
+        }
+
+        return fields.size() - before;
+    }
+
+    const form_field *form::find( const span &name ) const
+    {
+        for( const form_field &f : fields )
+        {
+            if( form_plain( f.name ) )
+            {
+                if( f.name.len == name.len && !memcmp( f.name.ptr, name.ptr, name.len ) )
+                    return &f;
+            }
+            else if( f.key() == name.str() )
+                return &f;
+        }
+        return 0;
+    }
+
+    std::string form::get( const span &name, const std::string &fallback ) const
+    {
+        const form_field *f = find( name );
+        return f ? f->text() : fallback;
+    }
+
+    std::string multipart_boundary( const span &content_type )
+    {
+        static const char type[] = "multipart/form-data";
+        span t = trimmed( content_type );
+        if( t.len < sizeof( type ) - 1 || !equal_nocase( t.ptr, type, sizeof( type ) - 1 ) )
+            return std::string();
+
+        span boundary = header_param( t, "boundary" );
+        return boundary.len <= 70 ? boundary.str() : std::string(); // rfc2046 limit
+    }
+
+    multipart_parser::multipart_parser( const std::string &boundary, size_t max_head ) :
+        state( boundary.empty() ? FAILED : PREAMBLE ), delimiter( CRLF "--" + boundary ), carry( CRLF ), max_head( max_head )
+    {} // the leading CRLF lets a body that starts with the first boundary match like any other delimiter
+
+    int multipart_parser::feed( const span &chunk )
+    {
+        if( state == DONE || state == FAILED )
+            return state == DONE ? 1 : -1;
+
+        if( carry.empty() )
+        {
+            size_t used = run( chunk.ptr, chunk.len );
+            if( state != FAILED && state != DONE )
+                carry.assign( chunk.ptr + used, chunk.len - used );
+        }
+        else
+        {
+            // a delimiter or head split across chunks: join with what was left over
+            carry.append( chunk.ptr, chunk.len );
+            size_t used = run( carry.data(), carry.size() );
+            carry.erase( 0, used );
+        }
+
+        if( state == DONE )
+            carry.clear();
+        return state == DONE ? 1 : state == FAILED ? -1 : 0;
+    }
+
+    // consumes as much as possible. leftovers are a possible partial delimiter or an incomplete head
+    size_t multipart_parser::run( const char *data, size_t len )
+    {
+        size_t pos = 0;
+
+        while( pos < len && state != DONE && state != FAILED )
+        {
+            const char *p = data + pos;
+            size_t n = len - pos;
+
+            if( state == PREAMBLE || state == CONTENT )
+            {
+                size_t at = find_bytes( p, n, delimiter );
+                size_t safe = at < n ? at : ( n >= delimiter.size() ? n - delimiter.size() + 1 : 0 );
+
+                if( state == CONTENT && safe && on_data && !on_data( part, span( p, safe ) ) )
+                    return state = FAILED, len;
+
+                if( at == n )
+                    return pos + safe;
+
+                if( state == CONTENT && on_part_end && !on_part_end( part ) )
+                    return state = FAILED, len;
+
+                pos += at + delimiter.size();
+                state = DELIMITED;
+            }
+            else if( state == DELIMITED )
+            {
+                // "--" closes the body, otherwise optional padding and CRLF open a part
+                if( n < 2 )
+                    return pos;
+                if( p[0] == '-' && p[1] == '-' )
+                {
+                    state = DONE;
+                    return len;
+                }
+                size_t i = 0;
+                while( i < n && ( p[i] == ' ' || p[i] == '\t' ) )
+                    ++i;
+                if( n - i < 2 )
+                    return i > 64 ? ( state = FAILED, len ) : pos;
+                if( p[i] != '\r' || p[i+1] != '\n' )
+                    return state = FAILED, len;
+                pos += i + 2;
+                state = HEAD;
+            }
+            else // HEAD
+            {
+                size_t end = n >= 2 && p[0] == '\r' && p[1] == '\n' ? 0 : find_bytes( p, n, "\r\n\r\n" );
+                if( end == n )
+                    return n > max_head ? ( state = FAILED, len ) : pos;
+
+                part = multipart_part();
+                part.head.assign( p, end );
+
+                knot::headers fields;
+                extract_headers( part.head, 0, part.head.size(), fields );
+                const span *disposition = fields.find( "Content-Disposition" );
+                const span *type = fields.find( H_CONTENT_TYPE );
+                if( disposition )
+                {
+                    part.name = header_param( *disposition, "name" ).str();
+                    part.filename = header_param( *disposition, "filename" ).str();
+                }
+                if( type )
+                    part.content_type = type->str();
+
+                pos += end + ( end ? 4 : 2 );
+                state = CONTENT;
+
+                if( on_part && !on_part( part ) )
+                    return state = FAILED, len;
+            }
+        }
+
+        return pos;
+    }
+
+    // response cache
+
+    namespace
+    {
+        struct cache_entry
+        {
+            std::string key, head, body, etag;
+            double expires;
+            size_t cost() const { return key.size() + head.size() + body.size() + etag.size() + sizeof( cache_entry ); }
+        };
+
+        typedef std::shared_ptr<cache_entry> cache_ptr;
+
+        struct cache_shard
+        {
+            std::mutex mutex;
+            std::list<cache_ptr> lru;   // most recently used first
+            std::unordered_map<std::string, std::list<cache_ptr>::iterator> index;
+            size_t bytes = 0;
+
+            void erase( std::list<cache_ptr>::iterator it )
+            {
+                bytes -= (*it)->cost();
+                index.erase( (*it)->key );
+                lru.erase( it );
+            }
+        };
+
+        struct cache_impl
+        {
+            size_t max_bytes;           // per shard
+            double ttl;
+            std::vector< std::unique_ptr<cache_shard> > shards;
+            std::vector<header_id> vary;
+            std::atomic<size_t> hits, misses;
+
+            // location picks the shard, so erase( location ) only visits one
+            cache_shard &shard( const std::string &location )
+            {
+                return *shards[ std::hash<std::string>()( location ) % shards.size() ];
+            }
+
+            std::string key( const request &req ) const
+            {
+                std::string key = req.location;
+                for( auto id : vary )
+                    key += '\n', key += req.headers.get( id );
+                return key;
+            }
+        };
+
+        std::string lowered( const span &value )
+        {
+            std::string text = value.str();
+            for( auto &ch : text )
+                ch = lower( ch );
+            return text;
+        }
+
+        bool has_token( const span *value, const char *token )
+        {
+            return value && lowered( *value ).find( token ) != std::string::npos;
+        }
+
+        // requests that must reach the handler. cookies usually mean per-user content, unless they are part of the key
+        bool bypass( const cache_impl &impl, const request &req )
+        {
+            if( req.headers.find( H_COOKIE ) && std::find( impl.vary.begin(), impl.vary.end(), H_COOKIE ) == impl.vary.end() )
+                return true;
+            return req.headers.find( H_AUTHORIZATION ) || has_token( req.headers.find( H_CACHE_CONTROL ), "no-cache" ) || has_token( req.headers.find( H_CACHE_CONTROL ), "no-store" );
+        }
+
+        bool etag_matches( const span *if_none_match, const std::string &etag )
+        {
+            if( !if_none_match )
+                return false;
+            std::string value = if_none_match->str();
+            return trim( value ) == "*" || value.find( etag ) != std::string::npos;
+        }
+
+        cache_ptr cache_store( cache_impl &impl, const request &req, const std::string &response )
+        {
+            if( req.method != "GET" || bypass( impl, req ) )
+                return cache_ptr();
+
+            // status line must be a 200
+            std::string::size_type first_crlf = response.find( CRLF ), head_end = response.find( CRLF CRLF );
+            if( response.compare( 0, 5, "HTTP/" ) != 0 || head_end == std::string::npos )
+                return cache_ptr();
+            std::string::size_type code = response.find( ' ' );
+            if( code == std::string::npos || code > first_crlf || response.compare( code + 1, 3, "200" ) != 0 )
+                return cache_ptr();
+
+            headers h;
+            extract_headers( response, first_crlf + 2, head_end, h );
+
+            // a session cookie must never be replayed to other clients
+            if( h.find( H_SET_COOKIE ) )
+                return cache_ptr();
+
+            double ttl = impl.ttl;
+            const span *control = h.find( H_CACHE_CONTROL );
+            if( has_token( control, "no-store" ) || has_token( control, "no-cache" ) || has_token( control, "private" ) )
+                return cache_ptr();
+            if( has_token( control, "max-age=" ) )
+            {
+                std::string value = lowered( *control );
+                ttl = atof( value.c_str() + value.find( "max-age=" ) + 8 );
+            }
+            if( ttl <= 0 )
+                return cache_ptr();
+
+            cache_ptr e = std::make_shared<cache_entry>();
+            e->key = impl.key( req );
+            e->body = response.substr( head_end + 4 );
+            e->expires = now() + ttl;
+
+            const span *etag = h.find( H_ETAG );
+            if( etag )
+            {
+                e->etag = etag->str();
+                e->head = response.substr( 0, head_end + 4 );
+            }
+            else
+            {
+                // fnv-1a of the body
+                unsigned long long hash = 14695981039346656037ull;
+                for( unsigned char ch : e->body )
+                    hash = ( hash ^ ch ) * 1099511628211ull;
+                char text[ 24 ];
+                sprintf( text, "\"%016llx\"", hash );
+                e->etag = text;
+                e->head = response.substr( 0, head_end + 2 ) + "ETag: " + e->etag + CRLF CRLF;
+            }
+
+            if( e->cost() > impl.max_bytes )
+                return cache_ptr();
+
+            cache_shard &shard = impl.shard( req.location );
+            std::lock_guard<std::mutex> lock( shard.mutex );
+
+            auto found = shard.index.find( e->key );
+            if( found != shard.index.end() )
+                shard.erase( found->second );
+
+            shard.lru.push_front( e );
+            shard.index[ e->key ] = shard.lru.begin();
+            shard.bytes += e->cost();
+
+            while( shard.bytes > impl.max_bytes )
+                shard.erase( --shard.lru.end() );
+
+            return e;
+        }
+
+        // fresh entry for req, if any
+        cache_ptr cache_lookup( cache_impl &impl, const request &req )
+        {
+            cache_ptr e;
+            if( ( req.method != "GET" && req.method != "HEAD" ) || bypass( impl, req ) )
+                return e;
+
+            cache_shard &shard = impl.shard( req.location );
+            std::lock_guard<std::mutex> lock( shard.mutex );
+
+            auto found = shard.index.find( impl.key( req ) );
+            if( found != shard.index.end() )
+            {
+                if( (*found->second)->expires > now() )
+                    shard.lru.splice( shard.lru.begin(), shard.lru, found->second ), e = *found->second;
+                else
+                    shard.erase( found->second );
+            }
+
+            return e;
+        }
+
+        bool cache_send( int &sockfd, const request &req, const cache_entry &e )
+        {
+            if( etag_matches( req.headers.find( H_IF_NONE_MATCH ), e.etag ) )
+            {
+                std::string not_modified = "HTTP/1.1 304 Not Modified" CRLF "ETag: " + e.etag + CRLF CRLF;
+                return send_all( sockfd, not_modified.data(), not_modified.size() );
+            }
+
+            span parts[] = { span( e.head ), span( e.body ) };
+            return sendv( sockfd, parts, req.method == "HEAD" ? 1 : 2 );
+        }
+    }
+
+    response_cache::response_cache( size_t max_bytes, double ttl_secs, unsigned shards )
+    {
+        cache_impl *impl = new cache_impl;
+        shards = shards ? shards : 1;
+        impl->max_bytes = max_bytes / shards;
+        impl->ttl = ttl_secs;
+        impl->hits = impl->misses = 0;
+        impl->vary.push_back( H_HOST );     // virtual hosts share locations
+        for( unsigned i = 0; i < shards; ++i )
+            impl->shards.push_back( std::unique_ptr<cache_shard>( new cache_shard ) );
+        self = impl;
+    }
+
+    response_cache::~response_cache()
+    {
+        delete (cache_impl *)self;
+    }
+
+    void response_cache::vary( header_id id )
+    {
+        std::vector<header_id> &vary = ((cache_impl *)self)->vary;
+        if( std::find( vary.begin(), vary.end(), id ) == vary.end() )
+            vary.push_back( id );
+    }
+
+    bool response_cache::serve( int &sockfd, const request &req )
+    {
+        cache_impl &impl = *(cache_impl *)self;
+        cache_ptr e = cache_lookup( impl, req );
+        if( !e )
+            return ++impl.misses, false;
+
+        ++impl.hits;
+        return cache_send( sockfd, req, *e );
+    }
+
+    bool response_cache::store( const request &req, const std::string &response )
+    {
+        return !!cache_store( *(cache_impl *)self, req, response );
+    }
+
+    bool response_cache::respond( int &sockfd, const request &req, const std::function<std::string( const request & )> &handler )
+    {
+        cache_impl &impl = *(cache_impl *)self;
+        cache_ptr e = cache_lookup( impl, req );
+        if( e )
+            return ++impl.hits, cache_send( sockfd, req, *e );
+        ++impl.misses;
+
+        std::string response = handler( req );
+        e = cache_store( impl, req, response );
+        return e ? cache_send( sockfd, req, *e ) : send_all( sockfd, response.data(), response.size() );
+    }
+
+    void response_cache::erase( const std::string &location )
+    {
+        cache_impl &impl = *(cache_impl *)self;
+        cache_shard &shard = impl.shard( location );
+        std::lock_guard<std::mutex> lock( shard.mutex );
+
+        for( auto it = shard.lru.begin(); it != shard.lru.end(); )
+        {
+            const std::string &key = (*it)->key;
+            bool same = key.compare( 0, location.size(), location ) == 0 && ( key.size() == location.size() || key[ location.size() ] == '\n' );
+            if( same )
+                shard.erase( it++ );
+            else
+                ++it;
+        }
+    }
+
+    void response_cache::clear()
+    {
+        for( auto &shard : ((cache_impl *)self)->shards )
+        {
+            std::lock_guard<std::mutex> lock( shard->mutex );
+            shard->lru.clear();
+            shard->index.clear();
+            shard->bytes = 0;
+        }
+    }
+
+    size_t response_cache::bytes() const
+    {
+        size_t total = 0;
+        for( auto &shard : ((cache_impl *)self)->shards )
+        {
+            std::lock_guard<std::mutex> lock( shard->mutex );
+            total += shard->bytes;
+        }
+        return total;
+    }
+
+    size_t response_cache::hits() const
+    {
+        return ((cache_impl *)self)->hits;
+    }
+
+    size_t response_cache::misses() const
+    {
+        return ((cache_impl *)self)->misses;
+    }
+
+    // static files
+
+    namespace
+    {
+        const struct mime_t {
+            const char *ext, *type;
+        } mime_types[] = {
+            { "html", "text/html; charset=utf-8" },
+            { "htm", "text/html; charset=utf-8" },
+            { "css", "text/css; charset=utf-8" },
+            { "js", "text/javascript; charset=utf-8" },
+            { "mjs", "text/javascript; charset=utf-8" },
+            { "json", "application/json" },
+            { "txt", "text/plain; charset=utf-8" },
+            { "xml", "application/xml" },
+            { "svg", "image/svg+xml" },
+            { "png", "image/png" },
+            { "jpg", "image/jpeg" },
+            { "jpeg", "image/jpeg" },
+            { "gif", "image/gif" },
+            { "webp", "image/webp" },
+            { "ico", "image/x-icon" },
+            { "wasm", "application/wasm" },
+            { "pdf", "application/pdf" },
+            { "woff", "font/woff" },
+            { "woff2", "font/woff2" },
+            { "mp3", "audio/mpeg" },
+            { "mp4", "video/mp4" },
+            { "webm", "video/webm" },
+            { "zip", "application/zip" },
+            { "gz", "application/gzip" }
+        };
+
+        const char *mime_type( const std::string &path )
+        {
+            std::string::size_type dot = path.find_last_of( "./" );
+            if( dot != std::string::npos && path[ dot ] == '.' )
+            {
+                std::string ext = lowered( span( path.data() + dot + 1, path.size() - dot - 1 ) );
+                for( auto &mime : mime_types )
+                    if( ext == mime.ext )
+                        return mime.type;
+            }
+            return "application/octet-stream";
+        }
+
+        struct file_entry
+        {
+            std::string path;
+            int fd = -1;
+            const char *data = 0;   // whole file, when small enough to keep a copy
+            size_t size = 0;
+            time_t mtime = 0;
+            std::string etag, last_modified;
+            std::string headers;    // every header but Content-Length and Content-Range
+            int wd = -1;            // inotify watch
+            std::vector<char> buffer;
+
+            ~file_entry()
+            {
+                $welse(
+                    if( fd >= 0 )
+                        ::close( fd );
+                )
+            }
+        };
+
+        typedef std::shared_ptr<file_entry> file_ptr;
+
+        // bodies up to this size are copied at load and sent from memory; larger ones are streamed from the fd.
+        // never mapped: a file truncated while mapped raises SIGBUS in whoever touches the missing pages
+        const size_t small_file = 64 * 1024;
+
+        file_ptr open_file( const std::string &path )
+        {
+            struct stat st;
+            if( ::stat( path.c_str(), &st ) != 0 || ( st.st_mode & S_IFMT ) != S_IFREG )
+                return file_ptr();
+
+            file_ptr f = std::make_shared<file_entry>();
+            f->path = path;
+            f->size = size_t( st.st_size );
+            f->mtime = st.st_mtime;
+
+#if defined(_WIN32)
+            // no mmap: keep a copy of the contents instead
+            FILE *fp = fopen( path.c_str(), "rb" );
+            if( !fp )
+                return file_ptr();
+            f->buffer.resize( f->size );
+            size_t got = f->size ? fread( &f->buffer[0], 1, f->size, fp ) : 0;
+            fclose( fp );
+            if( got != f->size )
+                return file_ptr();
+            f->data = f->size ? &f->buffer[0] : 0;
+#else
+            f->fd = ::open( path.c_str(), O_RDONLY );
+            if( f->fd < 0 )
+                return file_ptr();
+            if( f->size <= small_file )
+            {
+                f->buffer.resize( f->size );
+                size_t got = 0;
+                for( ssize_t n; got < f->size; got += n )
+                    if( ( n = ::pread( f->fd, &f->buffer[ got ], f->size - got, off_t( got ) ) ) <= 0 )
+                        return file_ptr();
+                f->data = f->size ? &f->buffer[0] : 0;
+            }
+#endif
+
+            char etag[ 48 ];
+            sprintf( etag, "\"%llx-%llx\"", (unsigned long long)f->size, (unsigned long long)f->mtime );
+            f->etag = etag;
+            f->last_modified = format_date( f->mtime );
+            f->headers = std::string() +
+                "Content-Type: " + mime_type( path ) + CRLF
+                "Last-Modified: " + f->last_modified + CRLF
+                "ETag: " + f->etag + CRLF
+                "Accept-Ranges: bytes" CRLF;
+            return f;
+        }
+
+        // request location into a path under root. empty if malformed or escaping root
+        std::string resolve_path( const std::string &root, const std::string &location )
+        {
+            std::string path = location.substr( 0, location.find_first_of( "?#" ) ), escaped;
+            for( char ch : path )
+                escaped += ( ch == '+' ? std::string( "%2B" ) : std::string( 1, ch ) ); // '+' is literal in paths
+            path = decode( escaped );
+
+            if( path.empty() || path[0] != '/' || path.find( '\0' ) != std::string::npos )
+                return std::string();
+
+            for( std::string::size_type pos = 0; ( pos = path.find( "..", pos ) ) != std::string::npos; pos += 2 )
+            {
+                bool starts = pos == 0 || path[ pos - 1 ] == '/' || path[ pos - 1 ] == '\\';
+                bool ends = pos + 2 == path.size() || path[ pos + 2 ] == '/' || path[ pos + 2 ] == '\\';
+                if( starts && ends )
+                    return std::string();
+            }
+
+            if( path.back() == '/' )
+                path += "index.html";
+
+            return root + path;
+        }
+
+        // single "bytes=" range. 1 = range set, 0 = serve whole file, -1 = unsatisfiable
+        int parse_range( const span &value, size_t size, size_t &offset, size_t &length )
+        {
+            std::string text = lowered( trimmed( value ) );
+            if( text.compare( 0, 6, "bytes=" ) != 0 || text.find( ',' ) != std::string::npos )
+                return 0;
+
+            std::string::size_type dash = text.find( '-', 6 );
+            if( dash == std::string::npos )
+                return 0;
+
+            std::string first = text.substr( 6, dash - 6 ), last = text.substr( dash + 1 );
+            if( first.find_first_not_of( "0123456789" ) != std::string::npos || last.find_first_not_of( "0123456789" ) != std::string::npos )
+                return 0;
+
+            if( first.empty() )
+            {
+                // suffix: last n bytes
+                unsigned long long n = last.empty() ? 0 : strtoull( last.c_str(), 0, 10 );
+                if( !n || !size )
+                    return -1;
+                length = size_t( n < size ? n : size );
+                offset = size - length;
+                return 1;
+            }
+
+            unsigned long long from = strtoull( first.c_str(), 0, 10 );
+            unsigned long long to = last.empty() ? size - 1 : strtoull( last.c_str(), 0, 10 );
+            if( from >= size )
+                return -1;
+            if( to < from )
+                return 0;
+            if( to >= size )
+                to = size - 1;
+
+            offset = size_t( from );
+            length = size_t( to - from + 1 );
+            return 1;
+        }
+
+        bool send_text( int &sockfd, const std::string &text )
+        {
+            return send_all( sockfd, text.data(), text.size() );
+        }
+
+        bool send_file( int &sockfd, const std::string &head, const file_entry &f, size_t offset, size_t length, double timeout_sec )
+        {
+            if( f.data || !length )
+            {
+                span parts[] = { span( head ), span( f.data + offset, length ) };
+                return sendv( sockfd, parts, length ? 2 : 1, timeout_sec );
+            }
+
+            double deadline = now() + timeout_sec;
+            if( !send( sockfd, head, timeout_sec ) )
+                return false;
+
+#if defined(__linux__)
+            // large bodies go straight from the page cache. sendfile() has no MSG_DONTWAIT, so the socket is
+            // made non-blocking meanwhile or a stalled reader would hold it in the kernel past the deadline
+            bool was_blocking = !( fcntl( sockfd, F_GETFL, 0 ) & O_NONBLOCK );
+            if( was_blocking )
+                set_nonblocking( sockfd, true );
+
+            off_t off = off_t( offset );
+            while( length > 0 )
+            {
+                ssize_t sent = ::sendfile( sockfd, f.fd, &off, length );
+                if( sent < 0 && would_block() )
+                {
+                    double left = deadline - now();
+                    pollfd p = { sockfd, POLLOUT, 0 };
+                    if( left > 0 && POLL( &p, 1, int( left * 1000 ) + 1 ) > 0 )
+                        continue;
+                }
+                if( sent <= 0 )
+                    break;      // error, timeout, or file truncated meanwhile
+                knot::bytes_sent += sent;
+                length -= sent;
+            }
+
+            if( was_blocking )
+                set_nonblocking( sockfd, false );
+            return length == 0;
+#else
+            char chunk[ 16 * 1024 ];
+            while( length > 0 )
+            {
+                ssize_t got = ::pread( f.fd, chunk, length < sizeof( chunk ) ? length : sizeof( chunk ), off_t( offset ) );
+                double left = deadline - now();
+                if( got <= 0 || left <= 0 )
+                    return false;
+                span part( chunk, size_t( got ) );
+                if( !sendv( sockfd, &part, 1, left ) )
+                    return false;
+                offset += got, length -= got;
+            }
+            return true;
+#endif
+        }
+
+        struct file_server_impl
+        {
+            std::string root;
+            size_t max_files, max_bytes, bytes = 0;
+            std::mutex mutex;
+            std::list<file_ptr> lru;    // most recently used first
+            std::unordered_map<std::string, std::list<file_ptr>::iterator> index;
+            std::map<int, std::string> watches;
+            int notify_fd = -1;
+
+            void drop( std::list<file_ptr>::iterator it )
+            {
+                file_entry &f = **it;
+#if defined(__linux__)
+                if( f.wd >= 0 )
+                    inotify_rm_watch( notify_fd, f.wd ), watches.erase( f.wd );
+#endif
+                bytes -= f.size;
+                index.erase( f.path );
+                lru.erase( it );
+            }
+
+            // drops entries whose files changed. inotify where available, stat() otherwise
+            bool changed( const file_entry &f )
+            {
+#if defined(__linux__)
+                if( notify_fd >= 0 )
+                    return false;
+#endif
+                struct stat st;
+                return ::stat( f.path.c_str(), &st ) != 0 || size_t( st.st_size ) != f.size || st.st_mtime != f.mtime;
+            }
+
+            void invalidate()
+            {
+#if defined(__linux__)
+                if( notify_fd < 0 )
+                    return;
+
+                alignas( inotify_event ) char events[ 4096 ];
+                ssize_t len;
+                while( ( len = ::read( notify_fd, events, sizeof( events ) ) ) > 0 )
+                {
+                    for( char *p = events; p < events + len; p += sizeof( inotify_event ) + ((inotify_event *)p)->len )
+                    {
+                        auto watch = watches.find( ((inotify_event *)p)->wd );
+                        if( watch == watches.end() )
+                            continue;
+                        auto found = index.find( watch->second );
+                        if( found != index.end() )
+                            drop( found->second );
+                    }
+                }
+#endif
+            }
+
+            file_ptr lookup( const std::string &path )
+            {
+                {
+                    std::lock_guard<std::mutex> lock( mutex );
+                    invalidate();
+
+                    auto found = index.find( path );
+                    if( found != index.end() )
+                    {
+                        if( !changed( **found->second ) )
+                        {
+                            lru.splice( lru.begin(), lru, found->second );
+                            return *found->second;
+                        }
+                        drop( found->second );
+                    }
+                }
+
+                // open and map without holding the lock
+                file_ptr f = open_file( path );
+                if( !f )
+                    return f;
+
+                std::lock_guard<std::mutex> lock( mutex );
+
+                auto found = index.find( path );
+                if( found != index.end() )
+                    return *found->second;  // opened by another thread meanwhile
+
+#if defined(__linux__)
+                if( notify_fd >= 0 )
+                {
+                    f->wd = inotify_add_watch( notify_fd, path.c_str(), IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF );
+                    if( f->wd >= 0 )
+                        watches[ f->wd ] = path;
+                }
+#endif
+
+                lru.push_front( f );
+                index[ path ] = lru.begin();
+                bytes += f->size;
+
+                while( lru.size() > max_files || bytes > max_bytes )
+                    drop( --lru.end() );
+
+                return f;
+            }
+        };
+    }
+
+    file_server::file_server( const std::string &root, size_t max_files, size_t max_bytes )
+    {
+        file_server_impl *impl = new file_server_impl;
+        impl->root = root.size() && ( root.back() == '/' || root.back() == '\\' ) ? root.substr( 0, root.size() - 1 ) : root;
+        impl->max_files = max_files;
+        impl->max_bytes = max_bytes;
+#if defined(__linux__)
+        impl->notify_fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+#endif
+        self = impl;
+    }
+
+    file_server::~file_server()
+    {
+        file_server_impl *impl = (file_server_impl *)self;
+        $welse(
+            if( impl->notify_fd >= 0 )
+                ::close( impl->notify_fd );
+        )
+        delete impl;
+    }
+
+    int file_server::serve( int &sockfd, const request &req, double timeout_secs )
+    {
+        file_server_impl &impl = *(file_server_impl *)self;
+
+        method_mask method = method_from( req.method );
+        if( method != RM_GET && method != RM_HEAD )
+            return send_text( sockfd, "HTTP/1.1 405 Method Not Allowed" CRLF "Allow: GET, HEAD" CRLF "Content-Length: 0" CRLF CRLF ) ? 405 : 0;
+
+        std::string path = resolve_path( impl.root, req.location );
+        file_ptr f = path.empty() ? file_ptr() : impl.lookup( path );
+        if( !f )
+            return send_text( sockfd, "HTTP/1.1 404 Not Found" CRLF "Content-Length: 0" CRLF CRLF ) ? 404 : 0;
+
+        const span *if_none_match = req.headers.find( H_IF_NONE_MATCH ), *if_modified_since = req.headers.find( H_IF_MODIFIED_SINCE );
+        if( if_none_match ? etag_matches( if_none_match, f->etag ) : if_modified_since && trimmed( *if_modified_since ) == f->last_modified.c_str() )
+            return send_text( sockfd, "HTTP/1.1 304 Not Modified" CRLF "ETag: " + f->etag + CRLF CRLF ) ? 304 : 0;
+
+        size_t offset = 0, length = f->size;
+        int status = 200;
+
+        const span *range = req.headers.find( H_RANGE ), *if_range = req.headers.find( "If-Range", 8 );
+        if( range && ( !if_range || trimmed( *if_range ) == f->etag.c_str() || trimmed( *if_range ) == f->last_modified.c_str() ) )
+        {
+            int ranged = parse_range( *range, f->size, offset, length );
+            if( ranged < 0 )
+                return send_text( sockfd, "HTTP/1.1 416 Range Not Satisfiable" CRLF "Content-Range: bytes */" + std::to_string( f->size ) + CRLF "Content-Length: 0" CRLF CRLF ) ? 416 : 0;
+            if( ranged > 0 )
+                status = 206;
+        }
+
+        std::string head = ( status == 206 ? "HTTP/1.1 206 Partial Content" CRLF : "HTTP/1.1 200 OK" CRLF ) + f->headers + "Content-Length: " + std::to_string( length ) + CRLF;
+        if( status == 206 )
+            head += "Content-Range: bytes " + std::to_string( offset ) + "-" + std::to_string( offset + length - 1 ) + "/" + std::to_string( f->size ) + CRLF;
+        head += CRLF;
+
+        bool ok = method == RM_HEAD ? send_text( sockfd, head ) : send_file( sockfd, head, *f, offset, length, timeout_secs );
+        return ok ? status : 0;
+    }
+
+    // reverse proxy
+
+    namespace
+    {
+        bool wait_fd( int fd, short events, double timeout_sec )
+        {
+            pollfd p = { fd, events, 0 };
+            return POLL( &p, 1, timeout_sec > 0 ? int( timeout_sec * 1000 ) : -1 ) > 0;
+        }
+
+#if defined(__linux__)
+        // splice() has no MSG_NOSIGNAL: keep SIGPIPE blocked meanwhile and discard it before unblocking
+        struct sigpipe_guard
+        {
+            sigset_t old;
+            bool blocked;
+
+            sigpipe_guard()
+            {
+                sigset_t set;
+                sigemptyset( &set );
+                sigaddset( &set, SIGPIPE );
+                blocked = pthread_sigmask( SIG_BLOCK, &set, &old ) == 0 && !sigismember( &old, SIGPIPE );
+            }
+
+            ~sigpipe_guard()
+            {
+                if( !blocked )
+                    return;
+
+                sigset_t set;
+                sigemptyset( &set );
+                sigaddset( &set, SIGPIPE );
+                timespec zero = { 0, 0 };
+                while( sigtimedwait( &set, 0, &zero ) == SIGPIPE )
+                    ;
+                pthread_sigmask( SIG_SETMASK, &old, 0 );
+            }
+        };
+#else
+        struct sigpipe_guard {};
+#endif
+
+        // one forwarding direction. bytes in flight sit in a kernel pipe (linux) or a 64 KiB buffer, and nothing
+        // else is read from the source until they are written out
+        struct channel
+        {
+            static const size_t capacity = 64 * 1024;
+            enum { WOULD_BLOCK = -2 };
+
+            int from, to;
+            int fds[2];
+            std::vector<char> buffer;
+            size_t head, pending;
+            bool eof;
+
+            channel( int from, int to ) : from(from), to(to), head(0), pending(0), eof(false)
+            {
+                fds[0] = fds[1] = -1;
+#if defined(__linux__)
+                if( pipe2( fds, O_NONBLOCK | O_CLOEXEC ) != 0 )
+                    fds[0] = fds[1] = -1;
+#endif
+                if( fds[0] < 0 )
+                    buffer.resize( capacity );
+            }
+
+            ~channel()
+            {
+                $welse(
+                    if( fds[0] >= 0 )
+                        ::close( fds[0] ), ::close( fds[1] );
+                )
+            }
+
+            // bytes read, 0 on eof, -1 on error, WOULD_BLOCK
+            long fill( size_t max )
+            {
+                size_t want = max < capacity ? max : capacity;
+                long n;
+#if defined(__linux__)
+                if( fds[0] >= 0 )
+                    n = splice( from, 0, fds[1], 0, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+                else
+#endif
+                n = RECV( from, &buffer[0], want, 0 ), head = 0;
+
+                if( n < 0 )
+                    return would_block() ? WOULD_BLOCK : -1;
+
+                knot::bytes_recv += n;
+                pending = n;
+                eof = ( n == 0 );
+                return n;
+            }
+
+            // bytes written, -1 on error, WOULD_BLOCK
+            long flush()
+            {
+                long n;
+#if defined(__linux__)
+                if( fds[0] >= 0 )
+                    n = splice( fds[0], 0, to, 0, pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+                else
+#endif
+                n = SEND( to, &buffer[ head ], pending, $windows(0) $welse( MSG_NOSIGNAL ) ), head += ( n > 0 ? n : 0 );
+
+                if( n < 0 )
+                    return would_block() ? WOULD_BLOCK : -1;
+
+                knot::bytes_sent += n;
+                pending -= n;
+                return n;
+            }
+        };
+
+        const size_t channel::capacity;
+
+        // moves limit bytes (or everything until eof, when limit is -1) from source to destination
+        bool pump( channel &c, size_t limit, double timeout_sec )
+        {
+            bool until_eof = ( limit == size_t(-1) );
+
+            while( c.pending || ( limit && !c.eof ) )
+            {
+                if( c.pending )
+                {
+                    long n = c.flush();
+                    if( n == -1 || ( n == channel::WOULD_BLOCK && !wait_fd( c.to, POLLOUT, timeout_sec ) ) )
+                        return false;
+                    continue;
+                }
+
+                long n = c.fill( limit );
+                if( n == -1 || ( n == channel::WOULD_BLOCK && !wait_fd( c.from, POLLIN, timeout_sec ) ) )
+                    return false;
+                if( n == 0 )
+                    return until_eof;
+                if( n > 0 && !until_eof )
+                    limit -= n;
+            }
+
+            return true;
+        }
+
+        // both directions at once, until both sides have closed. each side is only read while its peer keeps up
+        bool tunnel( channel &up, channel &down, double timeout_sec )
+        {
+            channel *c[] = { &up, &down };
+            bool closed[] = { false, false };
+
+            while( !closed[0] || !closed[1] )
+            {
+                pollfd fds[2] = { { c[0]->from, 0, 0 }, { c[0]->to, 0, 0 } };
+
+                // direction i reads from fds[i] and writes to fds[1 - i]. run each until it would block
+                for( int i = 0; i < 2; ++i )
+                {
+                    while( !closed[i] )
+                    {
+                        if( c[i]->pending )
+                        {
+                            long n = c[i]->flush();
+                            if( n == -1 )
+                                return false;
+                            if( n == channel::WOULD_BLOCK )
+                            {
+                                fds[ 1 - i ].events |= POLLOUT;
+                                break;
+                            }
+                            continue;
+                        }
+
+                        if( c[i]->eof )
+                        {
+                            SHUTDOWN_W( c[i]->to );
+                            closed[i] = true;
+                            break;
+                        }
+
+                        long n = c[i]->fill( size_t(-1) );
+                        if( n == -1 )
+                            return false;
+                        if( n == channel::WOULD_BLOCK )
+                        {
+                            fds[ i ].events |= POLLIN;
+                            break;
+                        }
+                    }
+                }
+
+                if( ( fds[0].events || fds[1].events ) && POLL( fds, 2, timeout_sec > 0 ? int( timeout_sec * 1000 ) : -1 ) <= 0 )
+                    return false;
+            }
+
+            return true;
+        }
+
+        // reads up to the end of a http head. bytes past it are left in rest
+        bool read_head( int fd, std::string &head, std::string &rest, double timeout_sec )
+        {
+            std::string buffer;
+            buffer.swap( rest );
+
+            for( ;; )
+            {
+                std::string::size_type end = buffer.find( CRLF CRLF );
+                if( end != std::string::npos )
+                {
+                    head = buffer.substr( 0, end + 4 );
+                    rest = buffer.substr( end + 4 );
+                    return true;
+                }
+                if( buffer.size() > 64 * 1024 )
+                    return false;
+
+                char chunk[ 16 * 1024 ];
+                int n = RECV( fd, chunk, sizeof( chunk ), 0 );
+                if( n < 0 && would_block() && wait_fd( fd, POLLIN, timeout_sec ) )
+                    continue;
+                if( n <= 0 )
+                    return false;
+
+                knot::bytes_recv += n;
+                buffer.append( chunk, n );
+            }
+        }
+
+        // tracks chunked transfer coding to find where a body ends
+        struct chunked_scanner
+        {
+            enum { SIZE, EXTENSION, SIZE_LF, DATA, DATA_CR, DATA_LF, TRAILER, DONE } state;
+            unsigned long long left;
+            size_t line;
+            bool valid;
+
+            chunked_scanner() : state(SIZE), left(0), line(0), valid(true) {}
+
+            // bytes belonging to the body, stops at its end. chunk payloads are appended to data, if given
+            size_t feed( const char *p, size_t n, std::string *data = 0 )
+            {
+                size_t i = 0;
+                while( i < n && state != DONE && valid )
+                {
+                    char ch = p[ i ];
+                    switch( state )
+                    {
+                        case SIZE:
+                            if( isxdigit( (unsigned char)ch ) && left < ( 1ull << 56 ) )
+                                left = left * 16 + ( isdigit( (unsigned char)ch ) ? ch - '0' : lower( ch ) - 'a' + 10 );
+                            else if( ch == ';' || ch == ' ' || ch == '\t' )
+                                state = EXTENSION;
+                            else if( ch == '\r' )
+                                state = SIZE_LF;
+                            else
+                                valid = false;
+                            ++i;
+                            break;
+                        case EXTENSION:
+                            state = ( ch == '\r' ? SIZE_LF : EXTENSION ), ++i;
+                            break;
+                        case SIZE_LF:
+                            valid = ( ch == '\n' ), state = left ? DATA : TRAILER, line = 0, ++i;
+                            break;
+                        case DATA: {
+                            size_t take = size_t( left < n - i ? left : n - i );
+                            if( data )
+                                data->append( p + i, take );
+                            left -= take, i += take;
+                            if( !left )
+                                state = DATA_CR;
+                            break;
+                        }
+                        case DATA_CR:
+                            valid = ( ch == '\r' ), state = DATA_LF, ++i;
+                            break;
+                        case DATA_LF:
+                            valid = ( ch == '\n' ), state = SIZE, ++i;
+                            break;
+                        case TRAILER:
+                            if( ch == '\n' )
+                                state = line ? TRAILER : DONE, line = 0;
+                            else if( ch != '\r' )
+                                ++line;
+                            ++i;
+                            break;
+                        default:
+                            break;
+                    }
+                }
+                return i;
+            }
+        };
+
+        // dechunk sends the payload alone, for peers that cannot read chunks. the body then ends when the connection does
+        bool relay_chunked( int from, int to, std::string &rest, double timeout_sec, bool dechunk = false )
+        {
+            chunked_scanner scanner;
+            std::string buffer, data;
+            buffer.swap( rest );
+
+            for( ;; )
+            {
+                data.clear();
+                size_t n = scanner.feed( buffer.data(), buffer.size(), dechunk ? &data : 0 );
+                if( !scanner.valid || !( dechunk ? send_all( to, data.data(), data.size() ) : send_all( to, buffer.data(), n ) ) )
+                    return false;
+                if( scanner.state == chunked_scanner::DONE )
+                    return rest = buffer.substr( n ), true;
+
+                char chunk[ 16 * 1024 ];
+                int got = RECV( from, chunk, sizeof( chunk ), 0 );
+                if( got < 0 && would_block() && wait_fd( from, POLLIN, timeout_sec ) )
+                    got = 0, buffer.clear();
+                else if( got <= 0 )
+                    return false;
+                else
+                    knot::bytes_recv += got, buffer.assign( chunk, got );
+            }
+        }
+
+        // body of known framing. rest holds bytes already read from the source
+        bool relay_body( int from, int to, bool chunked, size_t length, std::string &rest, double timeout_sec, bool dechunk = false )
+        {
+            if( chunked )
+                return relay_chunked( from, to, rest, timeout_sec, dechunk );
+
+            size_t take = length == size_t(-1) || rest.size() < length ? rest.size() : length;
+            if( take && !send_all( to, rest.data(), take ) )
+                return false;
+            rest.erase( 0, take );
+
+            if( length != size_t(-1) )
+                length -= take;
+            if( !length )
+                return true;
+
+            channel c( from, to );
+            return pump( c, length, timeout_sec );
+        }
+
+        struct message_info
+        {
+            std::string::size_type first_crlf;
+            headers fields;
+            bool chunked, close, upgrade;
+            bool invalid;               // framing two parsers could disagree on
+            size_t length;              // -1 if not given
+            std::vector<span> named;    // more hop-by-hop headers, listed in Connection
+        };
+
+        bool same_name( const span &key, const char *name )
+        {
+            size_t len = strlen( name );
+            return key.len == len && equal_nocase( key.ptr, name, len );
+        }
+
+        void inspect( const std::string &head, message_info &info )
+        {
+            info.first_crlf = head.find( CRLF );
+            extract_headers( head, info.first_crlf + 2, head.size() - 4, info.fields );
+
+            const span *connection = info.fields.find( H_CONNECTION ), *encoding = info.fields.find( H_TRANSFER_ENCODING );
+            info.chunked = has_token( encoding, "chunked" );
+            info.close = has_token( connection, "close" );
+            info.upgrade = has_token( connection, "upgrade" ) && info.fields.find( H_UPGRADE );
+            info.invalid = false;
+            info.length = size_t(-1);
+            info.named.clear();
+
+            for( size_t i = 0; i < info.fields.size(); ++i )
+            {
+                const headers::field &f = info.fields[ i ];
+                if( f.id == H_CONTENT_LENGTH )
+                {
+                    // a single value of digits only, or peers may end the body at different places
+                    span value = trimmed( f.value );
+                    bool digits = value.len > 0 && value.len < 19;
+                    for( size_t j = 0; digits && j < value.len; ++j )
+                        digits = value.ptr[ j ] >= '0' && value.ptr[ j ] <= '9';
+                    info.invalid = info.invalid || !digits || info.length != size_t(-1);
+                    info.length = digits ? size_t( strtoull( value.str().c_str(), 0, 10 ) ) : 0;
+                }
+                else if( f.id == H_CONNECTION )
+                {
+                    for( size_t from = 0, to; from < f.value.len; from = to + 1 )
+                    {
+                        const char *comma = (const char *)memchr( f.value.ptr + from, ',', f.value.len - from );
+                        to = comma ? size_t( comma - f.value.ptr ) : f.value.len;
+                        span token = trimmed( span( f.value.ptr + from, to - from ) );
+                        if( token.len )
+                            info.named.push_back( token );
+                    }
+                }
+            }
+
+            // transfer-encoding overrides content-length, which is then dropped on the way
+            if( encoding )
+                info.length = size_t(-1);
+        }
+
+        // copies the start line and end-to-end headers, then appends extra header lines
+        std::string rewrite_head( const std::string &head, const message_info &info, const std::string &extra )
+        {
+            static const char *hop_by_hop[] = { "Keep-Alive", "Proxy-Connection", "TE", "Trailer" };
+
+            std::string out = head.substr( 0, info.first_crlf + 2 );
+            for( size_t i = 0; i < info.fields.size(); ++i )
+            {
+                const headers::field &f = info.fields[ i ];
+                bool skip = f.id == H_CONNECTION || f.id == H_EXPECT || f.id == H_X_FORWARDED_FOR ||
+                    ( f.id == H_CONTENT_LENGTH && info.fields.find( H_TRANSFER_ENCODING ) ) ||
+                    ( f.id == H_UPGRADE && !info.upgrade );
+                for( auto *name : hop_by_hop )
+                    skip = skip || same_name( f.key, name );
+                for( auto &name : info.named )
+                    skip = skip || ( f.key.len == name.len && equal_nocase( f.key.ptr, name.ptr, name.len ) && !( f.id == H_UPGRADE && info.upgrade ) );
+                if( skip )
+                    continue;
+                out.append( f.key.ptr, f.key.len ) += ": ";
+                out.append( f.value.ptr, f.value.len ) += CRLF;
+            }
+            return out + extra + CRLF;
+        }
+
+        // safe to send twice: a pooled connection may have been dropped after the upstream acted on the request
+        bool idempotent( method_mask method )
+        {
+            return ( method & ( RM_GET | RM_HEAD | RM_PUT | RM_DELETE | RM_OPTIONS | RM_TRACE ) ) != 0;
+        }
+
+        struct proxy_impl
+        {
+            std::string ip, port;
+            size_t pool_size;
+            double timeout;
+            std::mutex mutex;
+            std::vector<int> idle;
+
+            // pooled connection if a live one is left, fresh otherwise
+            int acquire( bool &pooled )
+            {
+                for( ;; )
+                {
+                    int fd;
+                    {
+                        std::lock_guard<std::mutex> lock( mutex );
+                        if( idle.empty() )
+                            break;
+                        fd = idle.back();
+                        idle.pop_back();
+                    }
+
+                    // idle upstreams have nothing to say: readable means closed (or garbage)
+                    pollfd p = { fd, POLLIN, 0 };
+                    if( POLL( &p, 1, 0 ) == 0 )
+                        return pooled = true, fd;
+                    disconnect( fd );
+                }
+
+                int fd;
+                pooled = false;
+                return connect( fd, ip, port, timeout ) ? fd : -1;
+            }
+
+            void release( int fd, bool reusable )
+            {
+                {
+                    std::lock_guard<std::mutex> lock( mutex );
+                    if( reusable && idle.size() < pool_size )
+                        return idle.push_back( fd );
+                }
+                disconnect( fd );
+            }
+        };
+    }
+
+    proxy::proxy( const std::string &ip, const std::string &port, size_t pool_size, double timeout_secs )
+    {
+        proxy_impl *impl = new proxy_impl;
+        impl->ip = ip;
+        impl->port = port;
+        impl->pool_size = pool_size;
+        impl->timeout = timeout_secs;
+        self = impl;
+    }
+
+    proxy::~proxy()
+    {
+        proxy_impl *impl = (proxy_impl *)self;
+        for( int fd : impl->idle )
+            disconnect( fd );
+        delete impl;
+    }
+
+    bool proxy::forward( int &sockfd )
+    {
+        proxy_impl &impl = *(proxy_impl *)self;
+
+        int upstream;
+        if( sockfd < 0 || !connect( upstream, impl.ip, impl.port, impl.timeout ) )
+            return false;
+
+        sigpipe_guard guard;
+        set_nonblocking( sockfd, true );
+        set_nonblocking( upstream, true );
+
+        channel up( sockfd, upstream ), down( upstream, sockfd );
+        bool ok = tunnel( up, down, impl.timeout );
+
+        set_nonblocking( sockfd, false );
+        disconnect( upstream );
+        return ok;
+    }
+
+    bool proxy::forward_www( int &sockfd, const std::string &client_ip )
+    {
+        proxy_impl &impl = *(proxy_impl *)self;
+        if( sockfd < 0 )
+            return false;
+
+        sigpipe_guard guard;
+        set_nonblocking( sockfd, true );
+
+        std::string pending;    // client bytes past the current request
+        bool ok = true, keep_alive = true;
+
+        while( ok && keep_alive )
+        {
+            std::string head;
+            if( !read_head( sockfd, head, pending, impl.timeout ) )
+                break;  // client is done (or sent garbage)
+
+            message_info req;
+            inspect( head, req );
+
+            // ambiguous framing could smuggle a second request past us to the upstream
+            if( req.invalid || ( req.fields.find( H_TRANSFER_ENCODING ) && !req.chunked ) )
+            {
+                send_text( sockfd, "HTTP/1.1 400 Bad Request" CRLF "Content-Length: 0" CRLF "Connection: close" CRLF CRLF );
+                break;
+            }
+
+            bool http10 = req.first_crlf >= 8 && head.compare( req.first_crlf - 8, 8, "HTTP/1.0" ) == 0;
+            keep_alive = http10 ? has_token( req.fields.find( H_CONNECTION ), "keep-alive" ) : !req.close;
+            bool has_body = req.chunked || ( req.length != size_t(-1) && req.length > 0 );
+            bool retryable = !has_body && idempotent( method_from( head.data(), head.find( ' ' ) ) );
+
+            std::string forwarded_for;
+            const span *previous = req.fields.find( H_X_FORWARDED_FOR );
+            if( previous || !client_ip.empty() )
+                forwarded_for = "X-Forwarded-For: " + ( previous ? previous->str() + ( client_ip.empty() ? "" : ", " ) : "" ) + client_ip + CRLF;
+
+            std::string out = rewrite_head( head, req, forwarded_for + ( req.upgrade ? "Connection: Upgrade" CRLF : "Connection: keep-alive" CRLF ) );
+
+            if( has_token( req.fields.find( H_EXPECT ), "100-continue" ) )
+                send_text( sockfd, "HTTP/1.1 100 Continue" CRLF CRLF );
+
+            // stale pooled connections can only be retried while nothing but the head was sent, and only if
+            // repeating the request is harmless
+            std::string rest, rhead;
+            int upstream = -1;
+            bool pooled = false, answered = false;
+            for( int attempt = 0; attempt < 2 && !answered; ++attempt )
+            {
+                if( upstream >= 0 )
+                    disconnect( upstream );
+                upstream = impl.acquire( pooled );
+                if( upstream < 0 )
+                    break;
+                set_nonblocking( upstream, true );
+
+                if( !send_all( upstream, out.data(), out.size() ) )
+                    continue;
+                if( has_body && !relay_body( sockfd, upstream, req.chunked, req.length, pending, impl.timeout ) )
+                    break;
+
+                rest.clear();
+                answered = read_head( upstream, rhead, rest, impl.timeout );
+                if( !answered && ( !retryable || !pooled ) )
+                    break;
+            }
+
+            if( !answered )
+            {
+                if( upstream >= 0 )
+                    disconnect( upstream );
+                send_text( sockfd, "HTTP/1.1 502 Bad Gateway" CRLF "Content-Length: 0" CRLF "Connection: close" CRLF CRLF );
+                break;
+            }
+
+            // informational answers come first
+            message_info res;
+            inspect( rhead, res );
+            int status = atoi( rhead.c_str() + rhead.find( ' ' ) + 1 );
+            while( status >= 100 && status < 200 && status != 101 )
+            {
+                if( !send_all( sockfd, rhead.data(), rhead.size() ) || !read_head( upstream, rhead, rest, impl.timeout ) )
+                {
+                    ok = false;
+                    break;
+                }
+                res = message_info();
+                inspect( rhead, res );
+                status = atoi( rhead.c_str() + rhead.find( ' ' ) + 1 );
+            }
+            if( !ok || res.invalid )
+            {
+                if( ok )
+                    send_text( sockfd, "HTTP/1.1 502 Bad Gateway" CRLF "Content-Length: 0" CRLF "Connection: close" CRLF CRLF );
+                disconnect( upstream );
+                break;
+            }
+
+            if( status == 101 )
+            {
+                // protocol switch (eg, websockets): from now on, plain bytes both ways
+                ok = send_all( sockfd, rhead.data(), rhead.size() ) &&
+                    ( pending.empty() || send_all( upstream, pending.data(), pending.size() ) ) &&
+                    ( rest.empty() || send_all( sockfd, rest.data(), rest.size() ) );
+                channel up( sockfd, upstream ), down( upstream, sockfd );
+                ok = ok && tunnel( up, down, impl.timeout );
+                disconnect( upstream );
+                break;
+            }
+
+            bool no_body = head.compare( 0, 5, "HEAD " ) == 0 || status == 204 || status == 304;
+            bool until_close = !no_body && !res.chunked && res.length == size_t(-1);
+            bool dechunk = http10 && !no_body && res.chunked;    // 1.0 clients get the payload, delimited by close
+            keep_alive = keep_alive && !until_close && !dechunk;
+            if( dechunk )
+                res.named.push_back( span( "Transfer-Encoding" ) );
+
+            std::string response_head = rewrite_head( rhead, res, keep_alive ? "Connection: keep-alive" CRLF : "Connection: close" CRLF );
+            ok = send_all( sockfd, response_head.data(), response_head.size() );
+            if( ok && !no_body )
+                ok = relay_body( upstream, sockfd, res.chunked, res.length, rest, impl.timeout, dechunk );
+
+            impl.release( upstream, ok && !until_close && !res.close && rest.empty() );
+        }
+
+        set_nonblocking( sockfd, false );
+        return ok;
+    }
+
+    // http client
+
+    namespace
+    {
+        struct client_impl
+        {
+            std::string host, port, host_header;
+            double timeout;
+            int fd;
+            std::string rest;               // bytes read past the last response
+            std::deque<bool> inflight;      // one per pipelined request: true for HEAD (no body)
+
+            void close()
+            {
+                if( fd >= 0 )
+                    disconnect( fd );
+                fd = -1;
+                rest.clear();
+                inflight.clear();
+            }
+        };
+
+        // appends what fd has to offer. bytes read, 0 on close, -1 on error or timeout
+        int read_more( int fd, std::string &buffer, double timeout_sec )
+        {
+            char chunk[ 16 * 1024 ];
+            for( ;; )
+            {
+                int n = RECV( fd, chunk, sizeof( chunk ), 0 );
+                if( n < 0 && would_block() && wait_fd( fd, POLLIN, timeout_sec ) )
+                    continue;
+                if( n > 0 )
+                    knot::bytes_recv += n, buffer.append( chunk, n );
+                return n < 0 ? -1 : n;
+            }
+        }
+
+        // data of a validated chunked body
+        void dechunk( const char *p, const char *end, std::string &out )
+        {
+            out.clear();
+            while( p < end )
+            {
+                unsigned long long size = strtoull( p, 0, 16 );
+                const char *lf = (const char *)memchr( p, '\n', end - p );
+                if( !size || !lf || size > size_t( end - lf - 1 ) )
+                    break;
+                out.append( lf + 1, size_t( size ) );
+                p = lf + 1 + size + 2;
+            }
+        }
+
+        // idle = false if the response was lost before its first byte (eg, a keep-alive connection the server closed)
+        bool client_receive( client_impl &c, http_response &res, bool &idle )
+        {
+            idle = false;
+            if( c.fd < 0 || c.inflight.empty() )
+                return false;
+
+            bool head_only = c.inflight.front();
+            c.inflight.pop_front();
+            res = http_response();
+
+            // head, skipping interim 1xx responses
+            for( ;; )
+            {
+                std::string::size_type end;
+                while( ( end = c.rest.find( CRLF CRLF ) ) == std::string::npos )
+                {
+                    if( c.rest.size() > 64 * 1024 || read_more( c.fd, c.rest, c.timeout ) <= 0 )
+                        return idle = c.rest.empty(), c.close(), false;
+                }
+
+                if( end < 12 || c.rest.compare( 0, 7, "HTTP/1." ) != 0 || !isdigit( (unsigned char)c.rest[9] ) )
+                    return c.close(), false;
+
+                res.status = atoi( c.rest.c_str() + 9 );
+                res.head = c.rest.substr( 0, end + 4 );
+                c.rest.erase( 0, end + 4 );
+                if( res.status >= 200 || res.status == 101 )
+                    break;
+            }
+
+            message_info info;
+            inspect( res.head, info );
+            if( info.invalid )
+                return c.close(), false;   // pipelined responses after it could not be told apart
+            res.headers = info.fields; // spans into res.head
+
+            bool http10 = res.head.compare( 0, 8, "HTTP/1.0" ) == 0;
+            res.keep_alive = !info.close && ( !http10 || has_token( res.headers.find( H_CONNECTION ), "keep-alive" ) ) && res.status != 101;
+
+            bool no_body = head_only || res.status < 200 || res.status == 204 || res.status == 304;
+            if( !no_body && info.chunked )
+            {
+                chunked_scanner scanner;
+                size_t scanned = 0;
+                for( ;; )
+                {
+                    scanned += scanner.feed( c.rest.data() + scanned, c.rest.size() - scanned );
+                    if( !scanner.valid )
+                        return c.close(), false;
+                    if( scanner.state == chunked_scanner::DONE )
+                        break;
+                    if( read_more( c.fd, c.rest, c.timeout ) <= 0 )
+                        return c.close(), false;
+                }
+                dechunk( c.rest.data(), c.rest.data() + scanned, res.body );
+                c.rest.erase( 0, scanned );
+            }
+            else if( !no_body && info.length != size_t(-1) )
+            {
+                while( c.rest.size() < info.length )
+                    if( read_more( c.fd, c.rest, c.timeout ) <= 0 )
+                        return c.close(), false;
+                res.body = c.rest.substr( 0, info.length );
+                c.rest.erase( 0, info.length );
+            }
+            else if( !no_body )
+            {
+                // delimited by close
+                int n;
+                while( ( n = read_more( c.fd, c.rest, c.timeout ) ) > 0 )
+                    ;
+                if( n < 0 )
+                    return c.close(), false;
+                res.body.swap( c.rest );
+                res.keep_alive = false;
+            }
+
+            if( !res.keep_alive )
+                c.close();
+            return true;
+        }
+    }
+
+    http_client::http_client( const std::string &host, const std::string &port, double timeout_secs )
+    {
+        client_impl *impl = new client_impl;
+        impl->host = host;
+        impl->port = port;
+        impl->host_header = "Host: " + host + ( port == "80" ? std::string() : ":" + port ) + CRLF;
+        impl->timeout = timeout_secs;
+        impl->fd = -1;
+        self = impl;
+    }
+
+    http_client::~http_client()
+    {
+        close();
+        delete (client_impl *)self;
+    }
+
+    void http_client::close()
+    {
+        ((client_impl *)self)->close();
+    }
+
+    size_t http_client::pending() const
+    {
+        return ((client_impl *)self)->inflight.size();
+    }
+
+    bool http_client::send( const std::string &method, const std::string &path, const std::string &body, const std::string &extra_headers )
+    {
+        client_impl &c = *(client_impl *)self;
+
+        // an idle keep-alive connection that turned readable was closed by the server (or is out of sync)
+        if( c.fd >= 0 && c.inflight.empty() )
+        {
+            pollfd p = { c.fd, POLLIN, 0 };
+            if( !c.rest.empty() || POLL( &p, 1, 0 ) != 0 )
+                c.close();
+        }
+
+        if( c.fd < 0 )
+        {
+            if( !connect( c.fd, c.host, c.port, c.timeout ) )
+                return c.fd = -1, false;
+            set_nonblocking( c.fd, true );
+        }
+
+        std::string head = method + ' ' + ( path.empty() ? std::string( "/" ) : path ) + " HTTP/1.1" CRLF + c.host_header + extra_headers;
+        if( !body.empty() || method == "POST" || method == "PUT" || method == "PATCH" )
+            head += "Content-Length: " + std::to_string( body.size() ) + CRLF;
+        head += CRLF;
+
+        span parts[] = { span( head ), span( body ) };
+        if( !sendv( c.fd, parts, body.empty() ? 1 : 2, c.timeout ) )
+            return c.close(), false;
+
+        c.inflight.push_back( method == "HEAD" );
+        return true;
+    }
+
+    bool http_client::receive( http_response &res )
+    {
+        bool idle;
+        return client_receive( *(client_impl *)self, res, idle );
+    }
+
+    bool http_client::request( const std::string &method, const std::string &path, http_response &res, const std::string &body, const std::string &extra_headers )
+    {
+        client_impl &c = *(client_impl *)self;
+        if( !c.inflight.empty() )
+            return "error: pipelined responses pending", false;
+
+        for( int attempt = 0; attempt < 2; ++attempt )
+        {
+            bool reused = c.fd >= 0, idle = true;
+            if( send( method, path, body, extra_headers ) && client_receive( c, res, idle ) )
+                return true;
+            if( !reused || !idle || !idempotent( method_from( method ) ) )
+                break;  // the server may have acted on it before dropping the connection
+        }
+        return false;
+    }
+
+    bool http_client::get( const std::string &path, http_response &res )
+    {
+        return request( "GET", path, res );
+    }
+
+    bool http_client::post( const std::string &path, const std::string &body, const std::string &content_type, http_response &res )
+    {
+        return request( "POST", path, res, body, "Content-Type: " + content_type + CRLF );
+    }
+
+    // access log
+
+    namespace
+    {
+        // single producer (the thread holding it), single consumer (the writer thread)
+        struct log_ring
+        {
+            std::vector<access_record> records;
+            size_t mask;
+            std::atomic<size_t> tail;
+            char pad0[ 64 - sizeof( std::atomic<size_t> ) ];
+            std::atomic<size_t> head;
+            char pad1[ 64 - sizeof( std::atomic<size_t> ) ];
+            std::atomic<size_t> dropped;
+            std::atomic<bool> claimed;
+
+            explicit log_ring( size_t n ) : records( n ), mask( n - 1 ), tail(0), head(0), dropped(0), claimed(true) {}
+        };
+
+        // a ring this thread logs to. handed back for reuse when the thread exits, so thread-per-connection
+        // servers keep about as many rings as they have threads alive
+        struct log_slot
+        {
+            unsigned log_id;
+            std::shared_ptr<log_ring> ring;
+
+            log_slot() : log_id(0) {}
+            ~log_slot() { release(); }
+
+            void release()
+            {
+                if( ring )
+                    ring->claimed.store( false, std::memory_order_release ), ring.reset();
+                log_id = 0;
+            }
+        };
+
+        // one slot per log this thread writes to, so threads alternating between a few logs keep their rings.
+        // past that, the oldest slot is handed back
+        struct log_slots
+        {
+            log_slot slot[ 4 ];
+            unsigned next;
+
+            log_slots() : next(0) {}
+        };
+
+        thread_local log_slots this_thread_logs;
+        std::atomic<unsigned> log_ids( 0 );
+        const size_t spare_rings = 4;   // unclaimed rings kept per log, for threads yet to come
+
+        long long wall_us()
+        {
+            return std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::system_clock::now().time_since_epoch() ).count();
+        }
+
+        struct access_log_impl
+        {
+            unsigned id;
+            size_t ring_records;
+            double flush_secs;
+            int fd;                         // -1 if the file could not be opened
+            bool owns_fd;
+#if defined(_WIN32)
+            FILE *file;
+#endif
+            std::mutex rings_mutex;         // rings list
+            std::mutex io_mutex;            // draining and the file
+            std::mutex wake_mutex;
+            std::condition_variable wake;
+            std::vector< std::shared_ptr<log_ring> > rings;
+            size_t retired_dropped;         // drop counts of freed rings. guarded by rings_mutex
+            std::thread thread;
+            bool stopping;
+            std::atomic<size_t> written;
+            size_t dropped_reported;
+            std::vector<std::string> batch; // one formatted block per ring, reused
+            long long stamp_secs;
+            char stamp[ 32 ];
+
+            log_ring &ring()
+            {
+                log_slots &slots = this_thread_logs;
+                for( auto &s : slots.slot )
+                    if( s.log_id == id )
+                        return *s.ring;
+
+                const unsigned count = sizeof( slots.slot ) / sizeof( slots.slot[0] );
+                log_slot *empty = 0;
+                for( auto &s : slots.slot )
+                    if( !s.log_id && !empty )
+                        empty = &s;
+                log_slot &slot = empty ? *empty : slots.slot[ slots.next++ % count ];
+
+                slot.release();
+                std::lock_guard<std::mutex> lock( rings_mutex );
+                for( auto &r : rings )
+                {
+                    bool idle = false;
+                    if( r->claimed.compare_exchange_strong( idle, true, std::memory_order_acquire ) )
+                    {
+                        slot.ring = r;
+                        break;
+                    }
+                }
+                if( !slot.ring )
+                {
+                    rings.push_back( std::make_shared<log_ring>( ring_records ) );
+                    slot.ring = rings.back();
+                }
+                slot.log_id = id;
+                return *slot.ring;
+            }
+
+            // 0 if the ring is full. commit() publishes the record
+            access_record *reserve( log_ring *&q )
+            {
+                q = &ring();
+                size_t t = q->tail.load( std::memory_order_relaxed );
+                if( t - q->head.load( std::memory_order_acquire ) > q->mask )
+                    return q->dropped.fetch_add( 1, std::memory_order_relaxed ), (access_record *)0;
+                return &q->records[ t & q->mask ];
+            }
+
+            static void commit( log_ring *q )
+            {
+                q->tail.store( q->tail.load( std::memory_order_relaxed ) + 1, std::memory_order_release );
+            }
+
+            void format( const access_record &r, std::string &out )
+            {
+                long long secs = r.time_us / 1000000;
+                if( secs != stamp_secs )
+                {
+                    time_t t = time_t( secs );
+                    tm parts;
+                    $windows( gmtime_s( &parts, &t ); )
+                    $welse( gmtime_r( &t, &parts ); )
+                    strftime( stamp, sizeof( stamp ), "%d/%b/%Y:%H:%M:%S +0000", &parts );
+                    stamp_secs = secs;
+                }
+
+                size_t len = r.location_len < sizeof( r.location ) ? r.location_len : sizeof( r.location );
+                if( !r.status )
+                {
+                    out += '[';
+                    out += stamp;
+                    out += "] ";
+                    out.append( r.location, len );
+                    out += '\n';
+                    return;
+                }
+
+                char ip[ 64 ] = "-";
+                if( r.client.family == 1 )
+                    strcpy( ip, "unix" );
+                else if( r.client.family == 4 || r.client.family == 6 )
+                    inet_ntop( r.client.family == 4 ? AF_INET : AF_INET6, (void *)r.client.addr, ip, sizeof( ip ) );
+
+                char text[ 160 ];
+                snprintf( text, sizeof( text ), "%s - - [%s] \"%.*s ", ip, stamp, int( strnlen( r.method, sizeof( r.method ) ) ), r.method );
+                out += text;
+
+                // quotes and control bytes escaped, as they come straight from the request line
+                for( size_t i = 0; i < len; ++i )
+                {
+                    unsigned char ch = r.location[i];
+                    if( ch < 0x20 || ch == '"' || ch == '\\' || ch >= 0x7f )
+                    {
+                        static const char hex[] = "0123456789abcdef";
+                        char esc[4] = { '\\', 'x', hex[ ch >> 4 ], hex[ ch & 15 ] };
+                        out.append( esc, 4 );
+                    }
+                    else
+                        out += char( ch );
+                }
+
+                snprintf( text, sizeof( text ), "\" %u %llu %llu %u\n", r.status, (unsigned long long)r.bytes_out, (unsigned long long)r.bytes_in, r.duration_us );
+                out += text;
+            }
+
+            void write_out( size_t count )
+            {
+#if defined(_WIN32)
+                for( size_t i = 0; i < count; ++i )
+                    if( file && !batch[i].empty() )
+                        fwrite( batch[i].data(), 1, batch[i].size(), file );
+                if( file )
+                    fflush( file );
+#else
+                std::vector<iovec> iov;
+                for( size_t i = 0; i < count; ++i )
+                    if( !batch[i].empty() )
+                    {
+                        iovec v = { &batch[i][0], batch[i].size() };
+                        iov.push_back( v );
+                    }
+
+                for( size_t at = 0; fd >= 0 && at < iov.size(); )
+                {
+                    size_t n = iov.size() - at < gather_max ? iov.size() - at : gather_max;
+                    ssize_t done = ::writev( fd, &iov[ at ], int( n ) );
+                    if( done < 0 && errno == EINTR )
+                        continue;
+                    if( done <= 0 )
+                        break;  // disk full or similar: records are lost, as they would be on overflow
+
+                    for( size_t left = done; left > 0; )
+                    {
+                        if( left < iov[ at ].iov_len )
+                        {
+                            iov[ at ].iov_base = (char *)iov[ at ].iov_base + left, iov[ at ].iov_len -= left;
+                            break;
+                        }
+                        left -= iov[ at++ ].iov_len;
+                    }
+                }
+#endif
+            }
+
+            // caller holds io_mutex
+            void drain()
+            {
+                std::vector< std::shared_ptr<log_ring> > snapshot;
+                {
+                    std::lock_guard<std::mutex> lock( rings_mutex );
+                    snapshot = rings;
+                }
+
+                size_t used = 0, dropped = 0;
+                for( auto &q : snapshot )
+                {
+                    size_t h = q->head.load( std::memory_order_relaxed ), t = q->tail.load( std::memory_order_acquire );
+                    if( h == t )
+                        continue;
+
+                    if( used == batch.size() )
+                        batch.push_back( std::string() );
+                    std::string &out = batch[ used++ ];
+                    out.clear();
+                    for( size_t i = h; i != t; ++i )
+                        format( q->records[ i & q->mask ], out );
+
+                    q->head.store( t, std::memory_order_release );
+                    written += t - h;
+                }
 
-            if( bytes_received < 0 )
-                return false;        // error or timeout
+                // rings left behind by exited threads are kept for new ones, up to a few spares; the rest are freed
+                {
+                    std::lock_guard<std::mutex> lock( rings_mutex );
+                    size_t spares = 0;
+                    for( auto it = rings.begin(); it != rings.end(); )
+                    {
+                        log_ring &q = **it;
+                        bool idle = !q.claimed.load( std::memory_order_acquire ) && q.head.load( std::memory_order_relaxed ) == q.tail.load( std::memory_order_acquire );
+                        if( idle && ++spares > spare_rings )
+                        {
+                            retired_dropped += q.dropped.load( std::memory_order_relaxed );
+                            it = rings.erase( it );
+                            continue;
+                        }
+                        dropped += q.dropped.load( std::memory_order_relaxed );
+                        ++it;
+                    }
+                    dropped += retired_dropped;
+                }
 
-            knot::bytes_recv += bytes_received;
+                if( dropped > dropped_reported )
+                {
+                    if( used == batch.size() )
+                        batch.push_back( std::string() );
+                    batch[ used++ ] = "# access log dropped " + std::to_string( dropped - dropped_reported ) + " records\n";
+                    dropped_reported = dropped;
+                }
+
+                write_out( used );
+            }
 
-            if( content_length > -1 )
+            void run()
             {
-                payload_received += bytes_received;
-                data += buffer.substr( 0, bytes_received );
+                std::unique_lock<std::mutex> lock( wake_mutex );
+                while( !stopping )
+                {
+                    wake.wait_for( lock, std::chrono::duration<double>( flush_secs ) );
+                    lock.unlock();
+                    {
+                        std::lock_guard<std::mutex> io( io_mutex );
+                        drain();
+                    }
+                    lock.lock();
+                }
             }
-            else
-                input += buffer.substr( 0, bytes_received );
+        };
+    }
 
-            if( bytes_received == 0 )
-                return /*sockfd = -1,*/ true;   // ok! remote side closed connection
+    access_record::access_record()
+    {
+        memset( this, 0, sizeof( *this ) );
+    }
 
-            // Get request type
-            if( request_method.empty() )
+    access_log::access_log( const std::string &path, size_t ring_records, double flush_secs )
+    {
+        access_log_impl *impl = new access_log_impl;
+        do impl->id = ++log_ids; while( !impl->id ); // 0 marks threads without a ring
+        impl->ring_records = 2;
+        while( impl->ring_records < ring_records )
+            impl->ring_records <<= 1;
+        impl->flush_secs = flush_secs > 0 ? flush_secs : 0.25;
+        impl->stopping = false;
+        impl->written = 0;
+        impl->dropped_reported = 0;
+        impl->retired_dropped = 0;
+        impl->stamp_secs = -1;
+        impl->owns_fd = !path.empty();
+
+#if defined(_WIN32)
+        impl->file = path.empty() ? stdout : fopen( path.c_str(), "ab" );
+        impl->fd = impl->file ? 0 : -1;
+#else
+        impl->fd = path.empty() ? 1 : ::open( path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644 );
+#endif
+
+        self = impl;
+        impl->thread = std::thread( &access_log_impl::run, impl );
+    }
+
+    access_log::~access_log()
+    {
+        access_log_impl *impl = (access_log_impl *)self;
+        {
+            std::lock_guard<std::mutex> lock( impl->wake_mutex );
+            impl->stopping = true;
+        }
+        impl->wake.notify_one();
+        impl->thread.join();
+        impl->drain();
+
+#if defined(_WIN32)
+        if( impl->file && impl->owns_fd )
+            fclose( impl->file );
+#else
+        if( impl->fd >= 0 && impl->owns_fd )
+            ::close( impl->fd );
+#endif
+        delete impl;
+    }
+
+    void access_log::log( const access_record &record )
+    {
+        log_ring *q;
+        access_record *r = ((access_log_impl *)self)->reserve( q );
+        if( !r )
+            return;
+
+        *r = record;
+        if( !r->time_us )
+            r->time_us = wall_us();
+        access_log_impl::commit( q );
+    }
+
+    void access_log::log( const peer &client, const request &req, unsigned status, size_t bytes_out, double duration_secs )
+    {
+        log_ring *q;
+        access_record *r = ((access_log_impl *)self)->reserve( q );
+        if( !r )
+            return;
+
+        r->time_us = wall_us();
+        r->duration_us = unsigned( duration_secs > 0 ? duration_secs * 1e6 + 0.5 : 0 );
+        r->status = (unsigned short)status;
+        r->bytes_in = req.input.size() + req.data.size();
+        r->bytes_out = bytes_out;
+        r->client = client;
+
+        size_t n = req.method.size() < sizeof( r->method ) - 1 ? req.method.size() : sizeof( r->method ) - 1;
+        memcpy( r->method, req.method.data(), n );
+        r->method[ n ] = '\0';
+
+        n = req.location.size() < sizeof( r->location ) ? req.location.size() : sizeof( r->location );
+        memcpy( r->location, req.location.data(), n );
+        r->location_len = (unsigned short)n;
+
+        access_log_impl::commit( q );
+    }
+
+    void access_log::event( const span &text )
+    {
+        log_ring *q;
+        access_record *r = ((access_log_impl *)self)->reserve( q );
+        if( !r )
+            return;
+
+        size_t n = text.len < sizeof( r->location ) ? text.len : sizeof( r->location );
+        r->time_us = wall_us();
+        r->status = 0;
+        memcpy( r->location, text.ptr, n );
+        r->location_len = (unsigned short)n;
+        access_log_impl::commit( q );
+    }
+
+    void access_log::flush()
+    {
+        access_log_impl *impl = (access_log_impl *)self;
+        std::lock_guard<std::mutex> io( impl->io_mutex );
+        impl->drain();
+    }
+
+    bool access_log::is_open() const
+    {
+        return ((access_log_impl *)self)->fd >= 0;
+    }
+
+    size_t access_log::written() const
+    {
+        return ((access_log_impl *)self)->written;
+    }
+
+    size_t access_log::dropped() const
+    {
+        access_log_impl *impl = (access_log_impl *)self;
+        std::lock_guard<std::mutex> lock( impl->rings_mutex );
+        size_t dropped = impl->retired_dropped;
+        for( auto &q : impl->rings )
+            dropped += q->dropped.load( std::memory_order_relaxed );
+        return dropped;
+    }
+
+    // reactor
+
+    namespace
+    {
+        struct reactor_op
+        {
+            enum kind_t { CONNECT, SEND, RECV, RECV_WWW, ACCEPT, FLUSH, SLEEP } kind;
+            unsigned id;
+            int fd;
+            double deadline;
+            cancel_token *token;
+            reactor::callback done;
+
+            // connect, accept
+            int *sockfd;
+            addrinfo *addrs, *next;
+            std::shared_ptr<resolve_t> resolve;   // name lookup still running, if any
+            peer *client;
+
+            // send
+            std::string output;
+            size_t offset;
+
+            // flush
+            writer *out;
+
+            // receive, receive_www
+            std::string *input;
+            request *req;
+            www_state www;
+            unsigned mask;
+
+            reactor_op() : fd(-1), token(0), sockfd(0), addrs(0), next(0), client(0), offset(0), out(0), input(0), req(0), mask(RM_ALL) {}
+        };
+
+        struct reactor_impl
+        {
+            std::mutex mutex;
+            std::vector<reactor_op *> incoming;
+            std::vector<unsigned> cancels;
+            std::map<unsigned, reactor_op *> ops;
+            std::vector< std::pair<reactor::callback, bool> > completed;
+            unsigned next_id = 0;
+            int wake_fd = -1;
+            std::atomic<bool> stopping;
+            std::atomic<size_t> bytes_sent, bytes_recv;    // this loop only, read by get_core_stats
+            std::mutex modes_mutex;
+            std::map< int, std::pair<unsigned, int> > modes;   // fd: ops in flight, file flags before the first one
+
+            // ops run non-blocking. the flags callers set are restored once the last op on the fd finishes
+            void borrow( int fd )
+            {
+                std::lock_guard<std::mutex> lock( modes_mutex );
+                std::pair<unsigned, int> &m = modes[ fd ];
+                if( !m.first++ && !( ( m.second = fcntl( fd, F_GETFL, 0 ) ) & O_NONBLOCK ) )
+                    fcntl( fd, F_SETFL, m.second | O_NONBLOCK );
+            }
+
+            void give_back( int fd )
             {
-          // Don't have enough information
-          if (input.find(CRLF) == std::string::npos)
-        continue;
+                std::lock_guard<std::mutex> lock( modes_mutex );
+                auto found = modes.find( fd );
+                if( found == modes.end() || --found->second.first )
+                    return;
+                if( !( found->second.second & O_NONBLOCK ) )
+                    fcntl( fd, F_SETFL, found->second.second );
+                modes.erase( found );
+            }
 
-                std::string::size_type space_pos;
-                request_method = input.substr( 0, ( ( space_pos = input.find( ' ' ) ) != std::string::npos )? space_pos : 0  );
-                // Test valid request type
-                if( !valid_method( request_method, valid_method_mask) )
+            // starts connecting to the next candidate address. 1 = connected, 0 = in progress, -1 = exhausted
+            int connect_next( reactor_op &op )
+            {
+                for( ; op.next; op.next = op.next->ai_next )
                 {
-                    return false;
+                    op.fd = ::socket( op.next->ai_family, op.next->ai_socktype, op.next->ai_protocol );
+                    if( op.fd < 0 )
+                        continue;
+
+                    set_nonblocking( op.fd, true );
+                    if( CONNECT( op.fd, op.next->ai_addr, op.next->ai_addrlen ) == 0 )
+                        return 1;
+                    if( in_progress() )
+                        return 0;
+
+                    CLOSE( op.fd );
+                    op.fd = -1;
                 }
-                // Test protocol
-                if( input.substr( ( first_crlf = input.find(CRLF) ) - 8, 8) != "HTTP/1.1" )
-                    return false; // Bad protocol
-
-                // get location
-                raw_location = trim( input.substr(space_pos, first_crlf-8-space_pos) );
+                return -1;
             }
 
-            // try to find the first CRLFCRLF which indicates the end of headers and
-            // find out if we have payload, only if "Content-length" header is set.
-            // it's possible to have payload without Content-length, but we won't have
-            // this case.
-            std::string::size_type crlf_2 = input.find("\r\n\r\n");
-            if( crlf_2 != std::string::npos && content_length == -1 )
+            // 1 = done, 0 = wait for readiness, -1 = failed
+            int step( reactor_op &op, bool ready )
             {
-                extract_headers(input, headers, first_crlf+2);
+                switch( op.kind )
+                {
+                    case reactor_op::CONNECT: {
+                        if( op.resolve )
+                        {
+                            std::lock_guard<std::mutex> lock( op.resolve->mutex );
+                            if( !op.resolve->done )
+                                return 0;
+                            op.addrs = op.next = op.resolve->addrs;
+                            op.resolve->addrs = 0;
+                        }
+                        op.resolve.reset();
+
+                        if( !ready )
+                            return op.fd < 0 ? connect_next( op ) : 0;
+
+                        int error = 0;
+                        socklen_t len = sizeof( error );
+                        if( GETSOCKOPT( op.fd, SOL_SOCKET, SO_ERROR, &error, &len ) == 0 && error == 0 )
+                            return 1;
+
+                        CLOSE( op.fd );
+                        op.fd = -1;
+                        op.next = op.next->ai_next;
+                        return connect_next( op );
+                    }
+
+                    case reactor_op::SEND: {
+                        while( op.offset < op.output.size() )
+                        {
+                            int sent = SEND( op.fd, op.output.data() + op.offset, op.output.size() - op.offset, $windows(0) $welse( MSG_NOSIGNAL ) );
+                            if( sent < 0 )
+                                return would_block() ? 0 : -1;
+                            knot::bytes_sent += sent;
+                            bytes_sent.fetch_add( sent, std::memory_order_relaxed );
+                            op.offset += sent;
+                        }
+                        return 1;
+                    }
 
-                if ( !headers["Content-Length"].empty() )
+                    case reactor_op::RECV:
+                    case reactor_op::RECV_WWW: {
+                        for( ;; )
+                        {
+                            char buffer[ 16 * 1024 ];
+                            int bytes_received = RECV( op.fd, buffer, sizeof( buffer ), 0 );
+                            if( bytes_received < 0 )
+                                return would_block() ? 0 : -1;
+                            if( bytes_received == 0 )
+                                return 1;   // remote side closed connection
+
+                            knot::bytes_recv += bytes_received;
+                            bytes_recv.fetch_add( bytes_received, std::memory_order_relaxed );
+
+                            if( op.kind == reactor_op::RECV )
+                            {
+                                op.input->append( buffer, bytes_received );
+                                continue;
+                            }
+
+                            request &r = *op.req;
+                            ( op.www.content_length > -1 ? r.data : r.input ).append( buffer, bytes_received );
+                            if( www_feed( op.www, r.input, r.data, bytes_received, r.method, r.location, r.headers, op.mask ) )
+                                return op.www.valid ? 1 : -1;
+                        }
+                    }
+
+                    case reactor_op::FLUSH:
+                        if( !op.out->flush() )
+                            return -1;
+                        return op.out->wants_write() ? 0 : 1;
+
+                    case reactor_op::ACCEPT: {
+                        int child_fd = accept_peer( op.fd, *op.client );
+                        if( child_fd < 0 )
+                            return would_block() ? 0 : -1;
+
+                        *op.sockfd = child_fd;
+                        return 1;
+                    }
+
+                    default:
+                        return 0;   // sleeps complete on their deadline
+                }
+            }
+
+            void finish( reactor_op *op, bool ok )
+            {
+                if( op->kind == reactor_op::CONNECT )
                 {
-                    content_length = atoi( headers["Content-Length"].c_str() );
-                    payload_received = input.length() - crlf_2;
-                    data = input.substr(crlf_2+4);
-                    input.erase(crlf_2);
+                    if( !ok && op->fd >= 0 )
+                        CLOSE( op->fd ), op->fd = -1;
+                    if( ok )
+                        set_nonblocking( op->fd, false );
+                    *op->sockfd = op->fd;
+                    if( op->addrs )
+                        freeaddrinfo( op->addrs );
+                    if( op->resolve )
+                    {
+                        std::lock_guard<std::mutex> lock( op->resolve->mutex );
+                        op->resolve->abandoned = true;
+                        if( op->resolve->addrs )
+                            freeaddrinfo( op->resolve->addrs ), op->resolve->addrs = 0;
+                    }
                 }
-                else
-                    receiving = false;
+                else if( op->fd >= 0 )
+                    give_back( op->fd );
+
+                completed.push_back( std::make_pair( op->done, ok ) );
+                ops.erase( op->id );
+                delete op;
             }
 
-            if( content_length > -1 && payload_received >= content_length )
+            unsigned add( reactor_op *op, double timeout_secs )
             {
-                receiving = false;
+                op->deadline = timeout_secs > 0 ? now() + timeout_secs : 0;
+                if( op->fd >= 0 && op->kind != reactor_op::CONNECT )
+                    borrow( op->fd );
+
+                std::lock_guard<std::mutex> lock( mutex );
+                op->id = ++next_id ? next_id : ++next_id;
+                incoming.push_back( op );
+                wakeup( wake_fd );
+                return op->id;
             }
+        };
+    }
+
+    void cancel_token::cancel()
+    {
+        flag = true;
+        if( loop )
+            wakeup( ((reactor_impl *)loop->self)->wake_fd );
+    }
+
+    void cancel_token::expires_after( double secs )
+    {
+        deadline = now() + secs;
+    }
+
+    reactor::reactor()
+    {
+        reactor_impl *impl = new reactor_impl;
+        impl->wake_fd = make_wakeup();
+        impl->stopping = false;
+        impl->bytes_sent = 0, impl->bytes_recv = 0;
+        self = impl;
+    }
+
+    reactor::~reactor()
+    {
+        reactor_impl *impl = (reactor_impl *)self;
+
+        // fail whatever is pending, and run the callbacks so coroutines and their sockets are released.
+        // callbacks may queue further operations; those fail too
+        for( ;; )
+        {
+            for( auto *op : impl->incoming )
+                impl->ops[ op->id ] = op;
+            impl->incoming.clear();
+            while( !impl->ops.empty() )
+                impl->finish( impl->ops.begin()->second, false );
+
+            if( impl->completed.empty() )
+                break;
+
+            std::vector< std::pair<reactor::callback, bool> > completed;
+            completed.swap( impl->completed );
+            for( auto &c : completed )
+                if( c.first )
+                    c.first( false );
         }
 
-        return true;
+        if( impl->wake_fd >= 0 )
+            CLOSE( impl->wake_fd );
+        delete impl;
     }
 
-    bool disconnect( int &sockfd, double timeout_sec )
+    void reactor::run()
     {
-        if( sockfd < 0 )
-            return true;
+        reactor_impl *impl = (reactor_impl *)self;
+        while( !impl->stopping )
+            run_once( 1.0 );
+        impl->stopping = false;
+    }
 
-        bool success = ( CLOSE( sockfd ) == 0 );
-        sockfd = -1;
+    void reactor::stop()
+    {
+        reactor_impl *impl = (reactor_impl *)self;
+        impl->stopping = true;
+        wakeup( impl->wake_fd );
+    }
 
-        return success;
+    void reactor::run_once( double timeout_secs )
+    {
+        reactor_impl &impl = *(reactor_impl *)self;
+
+        // adopt new operations and try them right away
+        std::vector<reactor_op *> incoming;
+        std::vector<unsigned> cancels;
+        {
+            std::lock_guard<std::mutex> lock( impl.mutex );
+            incoming.swap( impl.incoming );
+            cancels.swap( impl.cancels );
+        }
+
+        for( auto *op : incoming )
+        {
+            impl.ops[ op->id ] = op;
+            if( op->token )
+                op->token->loop = this;
+
+            int r = impl.step( *op, false );
+            if( r != 0 )
+                impl.finish( op, r > 0 );
+        }
+
+        for( auto id : cancels )
+        {
+            auto found = impl.ops.find( id );
+            if( found != impl.ops.end() )
+                impl.finish( found->second, false );
+        }
+
+        // wait for readiness, bounded by the nearest deadline
+        double t = now(), wait = impl.completed.empty() ? timeout_secs : 0;
+        std::vector<pollfd> fds( 1 );
+        std::vector<reactor_op *> waiting( 1 );
+        fds[0].fd = impl.wake_fd, fds[0].events = POLLIN, fds[0].revents = 0;
+
+        for( auto &it : impl.ops )
+        {
+            reactor_op *op = it.second;
+            double deadline = op->deadline;
+            if( op->token && op->token->deadline > 0 && ( !deadline || op->token->deadline < deadline ) )
+                deadline = op->token->deadline;
+            if( deadline > 0 && deadline - t < wait )
+                wait = deadline - t > 0 ? deadline - t : 0;
+
+            if( op->fd >= 0 && op->kind != reactor_op::SLEEP )
+            {
+                pollfd p = { op->fd, short( op->kind == reactor_op::CONNECT || op->kind == reactor_op::SEND || op->kind == reactor_op::FLUSH ? POLLOUT : POLLIN ), 0 };
+                fds.push_back( p );
+                waiting.push_back( op );
+            }
+        }
+
+        POLL( &fds[0], fds.size(), int( wait * 1000 + 0.999 ) );
+
+        if( fds[0].revents )
+        {
+            drain_wakeup( impl.wake_fd );
+
+            // name lookups that finished meanwhile
+            std::vector<reactor_op *> resolved;
+            for( auto &it : impl.ops )
+                if( it.second->resolve )
+                    resolved.push_back( it.second );
+            for( auto *op : resolved )
+            {
+                int r = impl.step( *op, false );
+                if( r != 0 )
+                    impl.finish( op, r > 0 );
+            }
+        }
+
+        for( size_t i = 1; i < fds.size(); ++i )
+        {
+            if( !fds[i].revents || !impl.ops.count( waiting[i]->id ) )
+                continue;
+            int r = impl.step( *waiting[i], true );
+            if( r != 0 )
+                impl.finish( waiting[i], r > 0 );
+        }
+
+        // expire deadlines and cancelled tokens
+        t = now();
+        std::vector<reactor_op *> expired;
+        for( auto &it : impl.ops )
+        {
+            reactor_op *op = it.second;
+            bool cancelled = op->token && ( op->token->flag || ( op->token->deadline > 0 && t >= op->token->deadline ) );
+            if( cancelled || ( op->deadline > 0 && t >= op->deadline ) )
+                expired.push_back( op );
+        }
+        for( auto *op : expired )
+            impl.finish( op, op->kind == reactor_op::SLEEP && op->deadline > 0 && t >= op->deadline && !( op->token && op->token->flag ) );
+
+        // run callbacks last, so they can queue further operations
+        std::vector< std::pair<reactor::callback, bool> > completed;
+        completed.swap( impl.completed );
+        for( auto &c : completed )
+            if( c.first )
+                c.first( c.second );
     }
 
-    bool listen( int &fd, const std::string &_bindip, const std::string &_port, void (*callback)( int master_fd, int child_fd, std::string client_addr_ip, std::string client_addr_port ), unsigned backlog_queue )
+    unsigned reactor::async_connect( int &sockfd, const std::string &ip, const std::string &port, callback done, double timeout_secs, cancel_token *token )
     {
-        unsigned port;
+        reactor_op *op = new reactor_op;
+        op->kind = reactor_op::CONNECT;
+        op->done = done;
+        op->token = token;
+        op->sockfd = &sockfd;
+
+        // numeric addresses resolve right away; names on a helper thread
+        addrinfo hints;
+        memset( &hints, 0, sizeof( hints ) );
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICHOST;
+
+        if( getaddrinfo( ip.c_str(), port.c_str(), &hints, &op->addrs ) != 0 )
         {
-            if( !(std::stringstream( _port ) >> port) )
-                return "error: invalid port number", false;
-            if( !port )
-                return "error: invalid port number", false;
+            op->addrs = 0;
+            op->resolve = std::make_shared<resolve_t>();
+            op->resolve->wake_fd = ((reactor_impl *)self)->wake_fd;
+            try {
+                std::thread( &resolve_t::run, op->resolve, ip, port ).detach();
+            }
+            catch(...) {
+                op->resolve->done = true; // fails as unresolvable
+            }
         }
+        op->next = op->addrs;
 
-        std::string bindip = ( _bindip.empty() ? std::string("0.0.0.0") : _bindip );
+        sockfd = -1;
+        return ((reactor_impl *)self)->add( op, timeout_secs );
+    }
 
-        struct sockaddr_in stSockAddr;
-        fd = ::socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    unsigned reactor::async_send( int sockfd, const std::string &output, callback done, double timeout_secs, cancel_token *token )
+    {
+        reactor_op *op = new reactor_op;
+        op->kind = reactor_op::SEND;
+        op->fd = sockfd;
+        op->done = done;
+        op->token = token;
+        op->output = output;
+        return ((reactor_impl *)self)->add( op, timeout_secs );
+    }
 
-        if( fd == -1 )
-            return "error: cannot create socket", false;
+    unsigned reactor::async_receive( int sockfd, std::string &input, callback done, double timeout_secs, cancel_token *token )
+    {
+        reactor_op *op = new reactor_op;
+        op->kind = reactor_op::RECV;
+        op->fd = sockfd;
+        op->done = done;
+        op->token = token;
+        op->input = &input;
+        input.clear();
+        return ((reactor_impl *)self)->add( op, timeout_secs );
+    }
 
-        memset(&stSockAddr, 0, sizeof(stSockAddr));
+    unsigned reactor::async_receive_www( int sockfd, knot::request &req, callback done, double timeout_secs, unsigned valid_method_mask, cancel_token *token )
+    {
+        reactor_op *op = new reactor_op;
+        op->kind = reactor_op::RECV_WWW;
+        op->fd = sockfd;
+        op->done = done;
+        op->token = token;
+        op->req = &req;
+        op->mask = valid_method_mask;
+        req.clear();
+        return ((reactor_impl *)self)->add( op, timeout_secs );
+    }
 
-        inet_pton(AF_INET, bindip.c_str(), &(stSockAddr.sin_addr));
+    unsigned reactor::async_accept( int listen_fd, int &child_fd, peer &client, callback done, double timeout_secs, cancel_token *token )
+    {
+        reactor_op *op = new reactor_op;
+        op->kind = reactor_op::ACCEPT;
+        op->fd = listen_fd;
+        op->done = done;
+        op->token = token;
+        op->sockfd = &child_fd;
+        op->client = &client;
+        child_fd = -1;
+        return ((reactor_impl *)self)->add( op, timeout_secs );
+    }
 
-        stSockAddr.sin_family = AF_INET;
-        stSockAddr.sin_port = htons( port );
-        //stSockAddr.sin_addr.s_addr = INADDR_ANY;
+    unsigned reactor::async_flush( writer &out, callback done, double timeout_secs, cancel_token *token )
+    {
+        reactor_op *op = new reactor_op;
+        op->kind = reactor_op::FLUSH;
+        op->fd = out.fd();
+        op->done = done;
+        op->token = token;
+        op->out = &out;
+        return ((reactor_impl *)self)->add( op, timeout_secs );
+    }
 
-        $welse({
-            int yes = 1;
-            if ( SETSOCKOPT( fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int) ) == -1 )
-            {}
-        })
+    unsigned reactor::async_sleep( double secs, callback done, cancel_token *token )
+    {
+        reactor_op *op = new reactor_op;
+        op->kind = reactor_op::SLEEP;
+        op->done = done;
+        op->token = token;
+        return ((reactor_impl *)self)->add( op, secs > 0 ? secs : 1e-9 );
+    }
+
+    bool reactor::cancel( unsigned id )
+    {
+        reactor_impl *impl = (reactor_impl *)self;
+        std::lock_guard<std::mutex> lock( impl->mutex );
+        impl->cancels.push_back( id );
+        wakeup( impl->wake_fd );
+        return true;
+    }
+
+    // thread-per-core listeners
+
+    namespace
+    {
+        struct core_t
+        {
+            int fd;
+            bool owns_fd;               // false when sharing core 0's listener (no SO_REUSEPORT)
+            int cpu;
+            bool numa_local;
+            core_callback callback;
+            sockopts opts;
+            reactor *loop;              // lives on the core thread, so its memory is local to the core
+            std::thread thread;
+            std::atomic<bool> ready, exiting;
+            std::atomic<bool> handed_over;  // stop accepting, keep serving
+            std::atomic<unsigned> accept_id;
+            std::atomic<size_t> accepted;
+            std::string address;
+
+            // connection being accepted
+            int child_fd;
+            peer client;
+        };
+
+        struct core_group_t
+        {
+            std::vector<core_t *> cores;
+        };
 
-        if( BIND( fd, (struct sockaddr *)&stSockAddr, sizeof(stSockAddr) ) == -1 )
+        // cpus this process may run on
+        std::vector<int> available_cpus()
         {
-            CLOSE(fd);
-            return "error: bind failed", false;
+            std::vector<int> cpus;
+#if defined(__linux__)
+            cpu_set_t set;
+            if( sched_getaffinity( 0, sizeof( set ), &set ) == 0 )
+                for( int i = 0; i < CPU_SETSIZE; ++i )
+                    if( CPU_ISSET( i, &set ) )
+                        cpus.push_back( i );
+#endif
+            if( cpus.empty() )
+                for( unsigned i = 0, n = std::thread::hardware_concurrency(); i < ( n ? n : 1 ); ++i )
+                    cpus.push_back( int( i ) );
+            return cpus;
         }
 
-        if( LISTEN( fd, backlog_queue ) == -1 )
+        bool pin_thread( int cpu )
         {
-            CLOSE( fd );
-            return "error: listen failed", false;
+#if defined(__linux__)
+            cpu_set_t set;
+            CPU_ZERO( &set );
+            CPU_SET( cpu, &set );
+            return sched_setaffinity( 0, sizeof( set ), &set ) == 0;
+#elif defined(_WIN32)
+            return cpu < 64 && SetThreadAffinityMask( GetCurrentThread(), DWORD_PTR(1) << cpu ) != 0;
+#else
+            return false;
+#endif
+        }
+
+        // later allocations of the calling thread prefer the numa node it runs on
+        bool numa_local_policy()
+        {
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+            return syscall( SYS_set_mempolicy, MPOL_LOCAL, (void *)0, 0UL ) == 0;
+#else
+            return false;
+#endif
+        }
+
+        void core_accept( core_t *c )
+        {
+            unsigned id = c->loop->async_accept( c->fd, c->child_fd, c->client, [c]( bool ok ) {
+                // first connection comes from the reactor, the rest of the backlog is drained right away
+                for( ; ok && !c->exiting; c->child_fd = accept_peer( c->fd, c->client ) )
+                {
+                    if( c->child_fd < 0 )
+                        break;
+                    tune( c->child_fd, c->opts );
+                    ++c->accepted;
+                    (*c->callback)( *c->loop, c->child_fd, c->client );
+                    if( c->handed_over )
+                        break;
+                }
+
+                if( c->exiting || c->handed_over )
+                    return;
+
+                if( ok )
+                    core_accept( c );
+                else
+                    c->loop->async_sleep( 0.01, [c]( bool ) { core_accept( c ); } ); // eg, out of fds: back off
+            }, 0 );
+
+            // handoff() cancels the accept it sees; one armed after that is cancelled here
+            c->accept_id = id;
+            if( c->handed_over )
+                c->loop->cancel( id );
+        }
+
+        void core_job( core_t *c )
+        {
+            if( c->cpu >= 0 && !pin_thread( c->cpu ) )
+                c->cpu = -1;
+            if( c->numa_local )
+                numa_local_policy();
+
+            reactor loop;
+            c->loop = &loop;
+            core_accept( c );
+            c->ready = true;
+
+            loop.run();
         }
 
-        struct worker
+        void stop_cores( core_group_t *group )
         {
-            static void job( control_t *control )
+            for( auto *c : group->cores )
             {
-                control->ready = true;
+                c->exiting = true;
+                if( c->loop )
+                    c->loop->stop();
+            }
 
-                try {
+            for( auto *c : group->cores )
+            {
+                if( c->thread.joinable() )
+                    c->thread.join();
+                if( c->owns_fd )
+                    CLOSE( c->fd );
+                delete c;
+            }
 
-                    while( !control->exiting )
-                    {
-                        struct sockaddr_in client_addr;
-                        int client_len = sizeof(client_addr);
-                        memset( &client_addr, 0, client_len );
+            delete group;
+        }
+    }
 
-                        int child_fd = ACCEPT( control->master_fd, (struct sockaddr *)&client_addr, (socklen_t *)&client_len );
+    bool listen( int &sockfd, const std::string &bindip, const std::string &_port, core_callback callback, const core_config &config, const sockopts &opts, unsigned backlog_queue )
+    {
+        unsigned port;
+        {
+            if( !(std::stringstream( _port ) >> port) )
+                return "error: invalid port number", false;
+            if( !port )
+                return "error: invalid port number", false;
+        }
+
+        std::vector<int> cpus = available_cpus();
+        size_t count = config.cores ? config.cores : cpus.size();
+
+        core_group_t *group = new core_group_t;
+
+        for( size_t i = 0; i < count; ++i )
+        {
+            core_t *c = new core_t;
+            c->cpu = config.pin ? cpus[ i % cpus.size() ] : -1;
+            c->numa_local = config.numa_local;
+            c->callback = callback;
+            c->opts = opts;
+            c->opts.fastopen = c->opts.defer_accept = -1; // listener-only options
+            c->loop = 0;
+            c->ready = false;
+            c->exiting = false;
+            c->handed_over = false;
+            c->accept_id = 0;
+            c->accepted = 0;
+            c->child_fd = -1;
+            c->address = listener_key( bindip, port );
+
+            // one listener per core lets the kernel spread connections. without SO_REUSEPORT cores share one
+#if defined(SO_REUSEPORT)
+            c->owns_fd = true;
+            c->fd = open_listener( bindip, port, opts, backlog_queue, true );
+#else
+            c->owns_fd = ( i == 0 );
+            c->fd = i ? group->cores[0]->fd : open_listener( bindip, port, opts, backlog_queue, false );
+#endif
+            if( c->fd == -1 )
+            {
+                delete c;
+                stop_cores( group );
+                return "error: cannot bind or listen", false;
+            }
 
-                        if( control->exiting )
-                            break;
+            group->cores.push_back( c );
 
-                        if( child_fd < 0 )
-                            continue; // return instead? CLOSE(control->master_fd) && die("accept() failed"); ?
+            try {
+                c->thread = std::thread( &core_job, c );
+            }
+            catch(...) {
+                stop_cores( group );
+                return "cannot launch core thread. forgot -lpthread?", false;
+            }
 
-                        const char *client_addr_ip = inet_ntoa( client_addr.sin_addr );
-                        std::string client_addr_port;
+            while( !c->ready )
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
 
-                        std::stringstream ss;
-                        ss << ntohs( client_addr.sin_port );
-                        ss >> client_addr_port;
+        sockfd = group->cores[0]->fd;
+        core_groups[ sockfd ] = group;
+        return true;
+    }
 
-                        if( settings::threaded )
-                            std::thread( std::bind( *control->callback, control->master_fd, child_fd, client_addr_ip, client_addr_port ) ).detach();
-                        else
-                            (*control->callback)( control->master_fd, child_fd, client_addr_ip, client_addr_port );
+    std::vector<core_stats> get_core_stats( int sockfd )
+    {
+        std::vector<core_stats> stats;
 
-                        /* this should be done inside callback!
+        auto found = core_groups.find( sockfd );
+        if( found == core_groups.end() )
+            return stats;
 
-                        if( SHUTDOWN( child_fd ) == -1 )
-                        {
-                            CLOSE( child_fd );
-                            "error: cannot shutdown socket";
-                            return;
-                        }
+        for( auto *c : found->second->cores )
+        {
+            reactor_impl *impl = (reactor_impl *)c->loop->self;
+            core_stats s = { c->cpu, c->accepted,
+                impl->bytes_recv.load( std::memory_order_relaxed ), impl->bytes_sent.load( std::memory_order_relaxed ) };
+            stats.push_back( s );
+        }
 
-                        CLOSE( child_fd );
+        return stats;
+    }
 
-                        */
-                    }
-                }
-                catch(...) {
+    // zero-downtime restarts
 
-                }
+    bool handoff( const std::string &address, double timeout_sec )
+    {
+#if defined(_WIN32)
+        return "error: unix sockets not supported", false;
+#else
+        if( !is_unix( address ) )
+            return "error: handoff needs a unix socket address", false;
+
+        // every socket still accepting, with the address listen() will ask for in the successor
+        std::vector<std::string> keys;
+        std::vector<int> fds;
+        for( auto &it : listeners )
+            keys.push_back( it.second->address ), fds.push_back( it.second->master_fd );
+        for( auto &it : core_groups )
+            for( auto *c : it.second->cores )
+                if( c->owns_fd && !c->handed_over )
+                    keys.push_back( c->address ), fds.push_back( c->fd );
+        if( fds.empty() )
+            return "error: no listeners to hand off", false;
+
+        int server = open_unix_listener( address, sockopts(), 1 );
+        if( server < 0 )
+            return "error: cannot listen for a successor", false;
+
+        int fd = -1;
+        pollfd p = { server, POLLIN, 0 };
+        if( POLL( &p, 1, timeout_sec > 0 ? int( timeout_sec * 1000 ) : -1 ) > 0 )
+            fd = ACCEPT( server, 0, 0 );
+        CLOSE( server );
+        if( address[5] != '@' )
+            unlink( address.c_str() + 5 );
+        if( fd < 0 )
+            return "error: no successor connected", false;
+
+        // batches of descriptors, one address line each. every batch is acknowledged, so batches never merge
+        enum { batch = 200 };
+        bool ok = true;
+        for( size_t at = 0; ok && at < fds.size(); at += batch )
+        {
+            size_t end = at + batch < fds.size() ? at + batch : fds.size();
+            std::string text;
+            for( size_t i = at; i < end; ++i )
+                text += keys[i] + '\n';
+            text += end < fds.size() ? "more\n" : "end\n";
+
+            char ack;
+            ok = send_fds( fd, text, std::vector<int>( fds.begin() + at, fds.begin() + end ), timeout_sec ) &&
+                recv_all( fd, &ack, 1, timeout_sec );
+        }
+        CLOSE( fd );
+        if( !ok )
+            return "error: successor did not take the listeners", false;
 
-                control->finished = true;
+        // the successor owns the sockets now. stop accepting; handlers already running are left alone
+        for( auto it = listeners.begin(); it != listeners.end(); )
+        {
+            control_t *c = it->second;
+            c->handed_over = true;
+            c->exiting = true;
+            while( !c->finished )
+                std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+            CLOSE( c->master_fd );  // our copy only: the socket stays open in the successor
+            delete c;
+            it = listeners.erase( it );
+        }
+        for( auto &it : core_groups )
+            for( auto *c : it.second->cores )
+            {
+                c->handed_over = true;
+                if( c->loop )
+                    c->loop->cancel( c->accept_id );
             }
-        };
-
-        // 2013.04.30.17:49 @r-lyeh says: My Ubuntu Linux setup passes this C++11
-        // block *only* when -lpthread is specified at linking stage. Go figure {
-        try {
-            control_t *c = new control_t();
-            c->ready = false;
-            c->exiting = false;
-            c->finished = false;
-            c->master_fd = fd;
-            c->callback = callback;
-            c->port = _port;
 
-            std::thread( &worker::job, c ).detach();
-
-            while( !c->ready )
-                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        return true;
+#endif
+    }
 
-            listeners[ fd ] = c;
-            return true;
-        }
-        catch(...) {
+    size_t adopt( const std::string &address, double timeout_sec )
+    {
+#if defined(_WIN32)
+        return 0;
+#else
+        // the old process may not be offering its sockets yet: keep trying until the timeout
+        double deadline = now() + timeout_sec;
+        int fd = -1;
+        while( !connect( fd, address, std::string(), 1.0 ) )
+        {
+            if( now() >= deadline )
+                return 0;
+            std::this_thread::sleep_for( std::chrono::milliseconds( 50 ) );
         }
-        // }
-        CLOSE( fd );
-        return "cannot launch listening thread. forgot -lpthread?", false;
-    }
+        set_nonblocking( fd, true );
 
-    bool shutdown( int &sockfd ) {
-        if( sockfd < 0 )
-            return "invalid socket", false;
+        size_t taken = 0;
+        for( bool more = true; more; )
+        {
+            std::string text;
+            std::vector<int> fds;
+            double left = deadline - now();
+            if( !receive_fds( fd, text, fds, left > 0.001 ? left : 0.001 ) )
+                break;
+
+            std::vector<std::string> keys;
+            for( size_t at = 0, nl; ( nl = text.find( '\n', at ) ) != std::string::npos; at = nl + 1 )
+                keys.push_back( text.substr( at, nl - at ) );
+
+            more = !keys.empty() && keys.back() == "more";
+            if( keys.empty() || keys.size() - 1 != fds.size() || ( !more && keys.back() != "end" ) )
+            {
+                for( int in : fds )
+                    CLOSE( in );
+                break;
+            }
 
-        if( listeners.find(sockfd) == listeners.end() )
-            return "invalid socket", false;
+            {
+                std::lock_guard<std::mutex> lock( inherited_mutex );
+                for( size_t i = 0; i < fds.size(); ++i )
+                    inherited.insert( std::make_pair( keys[i], fds[i] ) );
+            }
+            taken += fds.size();
 
-        auto *listener = listeners[ sockfd ];
-        listener->exiting = true;
-        while( !listener->finished ) {
-            CLOSE( sockfd );
-            int dummy_fd; // dummy request
-            knot::connect( dummy_fd, "localhost", listener->port, 0.25 );
-            knot::connect( dummy_fd, "127.0.0.1", listener->port, 0.25 );
-            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            if( !send( fd, "k", left > 0.001 ? left : 0.001 ) )
+                break;
         }
 
-        delete listener;
-        listeners.erase( listeners.find( sockfd ) );
-
-        sockfd = -1;
-        return true;
+        CLOSE( fd );
+        return taken;
+#endif
     }
 
-    bool shutdown() {
-        bool ok = true;
-        while( listeners.size() ) {
-            int master_fd = listeners.begin()->second->master_fd;
-            ok &= knot::shutdown(master_fd);
-        }
-        return ok;
+    size_t close_unadopted()
+    {
+        std::lock_guard<std::mutex> lock( inherited_mutex );
+        size_t closed = inherited.size();
+        for( auto &in : inherited )
+            CLOSE( in.second );
+        inherited.clear();
+        return closed;
     }
 
     // stats
@@ -844,202 +7391,713 @@ std::string decode( const std::string &str ) {
     return out.substr( 0, pbuf - buf );
 }
 
-uri lookup( const std::string &addr, unsigned port )
-{
-    INIT();
-
-    uri out;
-
-    for( int i = 0; i < 6; ++i )
-        out.inet.ip[i] = 0;
-    out.inet.port = 0;
-
-    auto &inet = out.inet;
-    auto &pretty = out.pretty;
-
-    // @todo: replace deprecated gethostbyname()
-    struct hostent *h = gethostbyname( addr.c_str() );
-
-    if( h == NULL)
-        return out.ok = false, out;
-
-    if( port > 65536 || port == 0 )
-        return out.ok = false, out;
-
-    char ch;
-    std::stringstream ss( inet_ntoa(*((struct in_addr *)h->h_addr)) );
-    ss >> inet.ip[0] >> ch >> inet.ip[1] >> ch >> inet.ip[2] >> ch >> inet.ip[3];
-    inet.port = port;
-
-    switch( port )
-    {
-        break; case    7: pretty.protocol = "echo://";
-        break; case   13: pretty.protocol = "daytime://";
-        break; case   17: pretty.protocol = "qotd://";
-        break; case   20: pretty.protocol = "ftp-data://";
-        break; case   21: pretty.protocol = "ftp://";
-        break; case   22: pretty.protocol = "ssh://";
-        break; case   23: pretty.protocol = "telnet://";
-        break; case   25: pretty.protocol = "smtp://";
-        break; case   37: pretty.protocol = "time://";
-        break; case   53: pretty.protocol = "dns://";
-        break; case   69: pretty.protocol = "tftp://";
-        break; case   70: pretty.protocol = "gopher://";
-        break; case   79: pretty.protocol = "finger://";
-        break; case   80: pretty.protocol = "http://";
-        break; case  110: pretty.protocol = "pop://";
-        break; case  113: pretty.protocol = "ident://";
-        break; case  119: pretty.protocol = "nntp://";
-        break; case  123: pretty.protocol = "ntp://";
-        break; case  138: pretty.protocol = "netbios://";
-        break; case  143: pretty.protocol = "imap://";
-        break; case  161: pretty.protocol = "snmp://";
-        break; case  443: pretty.protocol = "https://";
-        break; case  465: pretty.protocol = "smtps://";
-        break; case  500: pretty.protocol = "ipsec://";
-        break; case  513: pretty.protocol = "rlogin://";
-        break; case  993: pretty.protocol = "imaps://";
-        break; case  995: pretty.protocol = "pops://";
-        break; case 1080: pretty.protocol = "socks://";
-        break; case 3306: pretty.protocol = "mysql://";
-        break; case 5000: pretty.protocol = "upnp://";
-        break; case 5222: pretty.protocol = "xmpp://";
-        break; case 5223: pretty.protocol = "xmpps://";
-        break; case 5269: pretty.protocol = "xmpp-server://";
-        break; case 6667: pretty.protocol = "irc://";
-        break; case 8080: pretty.protocol = "http://";
-
-        default: pretty.protocol = "";
-    }
-
-    pretty.hostname = h->h_name;
-    pretty.ip = ss.str();
-
-    std::stringstream ssp;
-    ssp << port;
-    pretty.port = ssp.str();
-    pretty.address = addr;
-
-    pretty.url = pretty.protocol + pretty.address + ':' + pretty.port;
-
-#if 0
-    std::cout << pretty.url << std::endl;
-    std::cout << pretty.protocol << std::endl;
-    std::cout << pretty.address << std::endl;
-    std::cout << pretty.hostname << std::endl;
-    std::cout << pretty.ip << std::endl;
-    std::cout << pretty.port << std::endl;
-
-    std::cout << inet.ip[0] << std::endl;
-    std::cout << inet.ip[1] << std::endl;
-    std::cout << inet.ip[2] << std::endl;
-    std::cout << inet.ip[3] << std::endl;
-    std::cout << inet.port << std::endl;
-#endif
+std::string peer::ip() const {
+    char text[ 64 ] = {};
+    if( family == 1 )
+        return "unix";
+    if( family == 4 || family == 6 )
+        inet_ntop( family == 4 ? AF_INET : AF_INET6, (void *)addr, text, sizeof( text ) );
+    return text;
+}
 
-    return out.ok = true, out;
+std::string peer::port() const {
+    return std::to_string( port_number );
 }
 
-uri lookup( const std::string &addr, const std::string &port )
+bool span::operator==( const char *text ) const {
+    size_t n = strlen( text );
+    return n == len && ( n == 0 || memcmp( ptr, text, n ) == 0 );
+}
+
+namespace
 {
-    unsigned p;
-    if( !(std::stringstream(port) >> p) ) {
-        uri u;
-        u.ok = false;
-        return u;
+    const struct header_name_t {
+        header_id id;
+        const char *name;
+    } header_names[] = {
+        { H_ACCEPT, "Accept" },
+        { H_ACCEPT_ENCODING, "Accept-Encoding" },
+        { H_ACCEPT_LANGUAGE, "Accept-Language" },
+        { H_AUTHORIZATION, "Authorization" },
+        { H_CACHE_CONTROL, "Cache-Control" },
+        { H_CONNECTION, "Connection" },
+        { H_CONTENT_ENCODING, "Content-Encoding" },
+        { H_CONTENT_LENGTH, "Content-Length" },
+        { H_CONTENT_TYPE, "Content-Type" },
+        { H_COOKIE, "Cookie" },
+        { H_DATE, "Date" },
+        { H_ETAG, "ETag" },
+        { H_EXPECT, "Expect" },
+        { H_HOST, "Host" },
+        { H_IF_MODIFIED_SINCE, "If-Modified-Since" },
+        { H_IF_NONE_MATCH, "If-None-Match" },
+        { H_LAST_MODIFIED, "Last-Modified" },
+        { H_LOCATION, "Location" },
+        { H_ORIGIN, "Origin" },
+        { H_RANGE, "Range" },
+        { H_REFERER, "Referer" },
+        { H_SEC_WEBSOCKET_KEY, "Sec-WebSocket-Key" },
+        { H_SEC_WEBSOCKET_VERSION, "Sec-WebSocket-Version" },
+        { H_SERVER, "Server" },
+        { H_SET_COOKIE, "Set-Cookie" },
+        { H_TRANSFER_ENCODING, "Transfer-Encoding" },
+        { H_UPGRADE, "Upgrade" },
+        { H_USER_AGENT, "User-Agent" },
+        { H_X_FORWARDED_FOR, "X-Forwarded-For" }
+    };
+
+    unsigned hash_nocase( const char *key, size_t len ) {
+        unsigned h = 2166136261u;
+        for( size_t i = 0; i < len; ++i )
+            h = ( h ^ (unsigned char)lower( key[i] ) ) * 16777619u;
+        return h;
+    }
+
+    // open addressing table of well-known header names, built once
+    struct header_index {
+        enum { slots = 128 };
+        const header_name_t *table[ slots ];
+        unsigned hashes[ slots ];
+
+        header_index() {
+            memset( table, 0, sizeof( table ) );
+            for( auto &name : header_names ) {
+                unsigned h = hash_nocase( name.name, strlen( name.name ) ), i = h;
+                while( table[ i % slots ] )
+                    ++i;
+                table[ i % slots ] = &name;
+                hashes[ i % slots ] = h;
+            }
+        }
+    };
+}
+
+header_id headers::intern( const char *key, size_t len, unsigned *hash ) {
+    static const header_index index;
+
+    unsigned h = hash_nocase( key, len );
+    if( hash )
+        *hash = h;
+
+    for( unsigned i = h; index.table[ i % header_index::slots ]; ++i ) {
+        const header_name_t *name = index.table[ i % header_index::slots ];
+        if( index.hashes[ i % header_index::slots ] == h && strlen( name->name ) == len && equal_nocase( name->name, key, len ) )
+            return name->id;
+    }
+
+    return H_OTHER;
+}
+
+const char *headers::name( header_id id ) {
+    return id > H_OTHER && id < H_COUNT ? header_names[ id - 1 ].name : ""; // table follows enum order
+}
+
+headers::headers() {
+    clear();
+}
+
+void headers::clear() {
+    count = 0;
+    spill.clear();
+    memset( first, 0, sizeof( first ) );
+}
+
+void headers::add( const span &key, const span &value ) {
+    field f;
+    f.key = key;
+    f.value = value;
+    f.id = intern( key.ptr, key.len, &f.hash );
+
+    if( count < inline_fields )
+        fixed[ count ] = f;
+    else
+        spill.push_back( f );
+
+    ++count;
+
+    if( f.id != H_OTHER && !first[ f.id ] && count <= 0xffff )
+        first[ f.id ] = (unsigned short)count;
+}
+
+const span *headers::find( header_id id ) const {
+    return id != H_OTHER && first[ id ] ? &(*this)[ first[ id ] - 1 ].value : 0;
+}
+
+const span *headers::find( const char *key, size_t len ) const {
+    unsigned h;
+    header_id id = intern( key, len, &h );
+    if( id != H_OTHER )
+        return find( id );
+
+    for( size_t i = 0; i < count; ++i ) {
+        const field &f = (*this)[ i ];
+        if( f.hash == h && f.key.len == len && equal_nocase( f.key.ptr, key, len ) )
+            return &f.value;
+    }
+
+    return 0;
+}
+
+const span *headers::find( const std::string &key ) const {
+    return find( key.data(), key.size() );
+}
+
+std::string headers::get( header_id id ) const {
+    const span *value = find( id );
+    return value ? value->str() : std::string();
+}
+
+std::string headers::get( const std::string &key ) const {
+    const span *value = find( key );
+    return value ? value->str() : std::string();
+}
+
+void headers::rebase( const char *from, const char *to ) {
+    for( size_t i = 0; i < count; ++i ) {
+        field &f = i < inline_fields ? fixed[i] : spill[i - inline_fields];
+        f.key.ptr = to + ( f.key.ptr - from );
+        f.value.ptr = to + ( f.value.ptr - from );
+    }
+}
+
+http_response::http_response( const http_response &other ) {
+    *this = other;
+}
+
+http_response::http_response( http_response &&other ) {
+    *this = std::move( other );
+}
+
+http_response &http_response::operator=( const http_response &other ) {
+    if( this != &other ) {
+        status = other.status, head = other.head, body = other.body, keep_alive = other.keep_alive;
+        headers = other.headers;
+        headers.rebase( other.head.data(), head.data() );
+    }
+    return *this;
+}
+
+http_response &http_response::operator=( http_response &&other ) {
+    if( this != &other ) {
+        const char *from = other.head.data();
+        status = other.status, keep_alive = other.keep_alive;
+        head.swap( other.head ), body.swap( other.body );
+        headers = other.headers;
+        headers.rebase( from, head.data() ); // short strings may live inline and change address
     }
-    return lookup(addr,p);
+    return *this;
+}
+
+void request::clear() {
+    method.clear(), location.clear(), input.clear(), data.clear();
+    headers.clear();
+}
+
+request::request( const request &other ) {
+    *this = other;
+}
+
+request::request( request &&other ) {
+    *this = std::move( other );
+}
+
+request &request::operator=( const request &other ) {
+    if( this != &other ) {
+        method = other.method, location = other.location, input = other.input, data = other.data;
+        headers = other.headers;
+        headers.rebase( other.input.data(), input.data() );
+    }
+    return *this;
+}
+
+request &request::operator=( request &&other ) {
+    if( this != &other ) {
+        const char *from = other.input.data();
+        method.swap( other.method ), location.swap( other.location ), input.swap( other.input ), data.swap( other.data );
+        headers = other.headers;
+        headers.rebase( from, input.data() ); // short strings may live inline and change address
+    }
+    return *this;
+}
+
+method_mask method_from( const char *name, size_t len ) {
+    switch( len ) {
+        case 3: return !memcmp( name, "GET", 3 ) ? RM_GET : !memcmp( name, "PUT", 3 ) ? RM_PUT : RM_NONE;
+        case 4: return !memcmp( name, "POST", 4 ) ? RM_POST : !memcmp( name, "HEAD", 4 ) ? RM_HEAD : RM_NONE;
+        case 5: return !memcmp( name, "TRACE", 5 ) ? RM_TRACE : RM_NONE;
+        case 6: return !memcmp( name, "DELETE", 6 ) ? RM_DELETE : RM_NONE;
+        case 7: return !memcmp( name, "OPTIONS", 7 ) ? RM_OPTIONS : RM_NONE;
+        default: return RM_NONE;
+    }
+}
+
+method_mask method_from( const std::string &name ) {
+    return method_from( name.data(), name.size() );
 }
 
 namespace
 {
-    std::deque<std::string> split( const std::string &input, const std::string &delimiters ) {
-        std::string str;
-        std::deque<std::string> tokens;
-        for( auto &ch : input ) {
-            if( delimiters.find_first_of( ch ) != std::string::npos ) {
-                if( str.size() ) tokens.push_back( str ), str = "";
-                tokens.push_back( std::string() + ch );
-            } else str += ch;
+    typedef std::vector< std::pair<unsigned, int> > route_list; // method mask, route id
+
+    // radix trie node. static children are indexed by the first byte of their label
+    struct route_node {
+        std::string label;
+        std::string first;
+        std::vector<route_node *> children;
+        route_node *param;                  // :name child
+        std::string param_name;
+        std::string wildcard_name;          // *name
+        route_list routes, wildcard_routes;
+
+        route_node() : param(0) {}
+        ~route_node() {
+            for( auto *child : children )
+                delete child;
+            delete param;
         }
-        return str.empty() ? tokens : ( tokens.push_back( str ), tokens );
+    };
+
+    bool add_route( route_list &routes, unsigned methods, int route ) {
+        for( auto &r : routes )
+            if( r.first & methods )
+                return false;
+        routes.push_back( std::make_pair( methods, route ) );
+        return true;
     }
 
-    std::string left_of( const std::string &input, const std::string &substring ) {
-        std::string::size_type pos = input.find( substring );
-        return pos == std::string::npos ? input : input.substr(0, pos);
+    // parameters and wildcards only start right after a slash
+    bool is_capture( const char *p, char kind ) {
+        return *p == kind && p[-1] == '/';
     }
 
-    typedef std::map<std::string,std::string> decomposed;
+    bool insert_route( route_node *node, const char *p, const char *end, unsigned methods, int route, size_t params ) {
+        if( p == end )
+            return add_route( node->routes, methods, route );
+
+        if( is_capture( p, ':' ) ) {
+            const char *name = ++p;
+            while( p < end && *p != '/' )
+                ++p;
+            if( p == name || ++params > route_match::max_params )
+                return false;
+            if( !node->param )
+                node->param = new route_node, node->param_name.assign( name, p );
+            else if( node->param_name.compare( 0, std::string::npos, name, p - name ) != 0 )
+                return false; // same segment captured under another name
+            return insert_route( node->param, p, end, methods, route, params );
+        }
+
+        if( is_capture( p, '*' ) ) {
+            std::string name( p + 1, end );
+            if( name.empty() || name.find( '/' ) != std::string::npos || ++params > route_match::max_params )
+                return false;
+            if( !node->wildcard_routes.empty() && node->wildcard_name != name )
+                return false;
+            node->wildcard_name = name;
+            return add_route( node->wildcard_routes, methods, route );
+        }
+
+        // static run, up to the next capture
+        const char *stop = p + 1;
+        while( stop < end && !is_capture( stop, ':' ) && !is_capture( stop, '*' ) )
+            ++stop;
+
+        size_t len = stop - p, at = node->first.find( *p );
+        if( at == std::string::npos ) {
+            route_node *child = new route_node;
+            child->label.assign( p, len );
+            node->first += *p;
+            node->children.push_back( child );
+            return insert_route( child, stop, end, methods, route, params );
+        }
 
-    decomposed decompose( const std::string &full ) {
+        route_node *child = node->children[ at ];
+        size_t common = 0;
+        while( common < len && common < child->label.size() && child->label[ common ] == p[ common ] )
+            ++common;
+
+        if( common < child->label.size() ) {
+            // split the edge where both labels diverge
+            route_node *mid = new route_node;
+            mid->label = child->label.substr( 0, common );
+            child->label.erase( 0, common );
+            mid->first += child->label[0];
+            mid->children.push_back( child );
+            node->children[ at ] = child = mid;
+        }
 
-        decomposed map;
+        return insert_route( child, p + common, end, methods, route, params );
+    }
 
-        map["full"] = full;
-        map["host"] = std::string();
-        map["port"] = std::string();
-        map["user"] = std::string();
-        map["pass"] = std::string();
-        map["proto"] = std::string();
+    bool match_list( const route_list &routes, unsigned method, route_match &out ) {
+        for( auto &r : routes ) {
+            out.allowed |= r.first;
+            if( r.first & method )
+                return out.route = r.second, true;
+        }
+        return false;
+    }
 
-        std::deque<std::string> tokens = split(full, "/"); // http:, /, /, ..., /
+    // depth first: static, then parameter, then wildcard. backtracks on dead ends
+    bool match_route( const route_node *node, const char *p, const char *end, unsigned method, route_match &out ) {
+        if( p == end ) {
+            if( match_list( node->routes, method, out ) )
+                return true;
+        }
+        else {
+            size_t at = node->first.find( *p );
+            if( at != std::string::npos ) {
+                const route_node *child = node->children[ at ];
+                size_t len = child->label.size();
+                if( size_t( end - p ) >= len && !memcmp( child->label.data(), p, len ) && match_route( child, p + len, end, method, out ) )
+                    return true;
+            }
 
-        if( tokens.size() >= 4 && left_of(tokens[0], ":").size() > 0 ) {
-            map["proto"] = tokens[0] + "//";
+            if( node->param ) {
+                const char *stop = p;
+                while( stop < end && *stop != '/' )
+                    ++stop;
+                if( stop > p ) {
+                    size_t n = out.count++;
+                    out.names[ n ] = span( node->param_name );
+                    out.values[ n ] = span( p, stop - p );
+                    if( match_route( node->param, stop, end, method, out ) )
+                        return true;
+                    out.count = n;
+                }
+            }
+        }
 
-            tokens.pop_front(); // http:
-            tokens.pop_front(); // /
-            tokens.pop_front(); // /
+        if( match_list( node->wildcard_routes, method, out ) ) {
+            out.names[ out.count ] = span( node->wildcard_name );
+            out.values[ out.count++ ] = span( p, end - p );
+            return true;
         }
 
-        if( tokens.size() > 0 && tokens[0] != "/" ) {
-            std::deque<std::string> localhost = split( tokens[0], "@" );
-            if( localhost.size() > 1 ) {
-                std::deque<std::string> userpass = split( localhost[0], ":" );
-                map["user"] = userpass[0];
-                map["pass"] = userpass.size() > 1 ? userpass[2] : std::string();
+        return false;
+    }
+}
+
+const span *route_match::param( const char *name ) const {
+    size_t len = strlen( name );
+    for( size_t i = 0; i < count; ++i )
+        if( names[i].len == len && !memcmp( names[i].ptr, name, len ) )
+            return &values[i];
+    return 0;
+}
+
+std::string route_match::get( const char *name ) const {
+    const span *value = param( name );
+    return value ? value->str() : std::string();
+}
+
+router::router() {
+    self = new route_node;
+}
+
+router::~router() {
+    delete (route_node *)self;
+}
+
+bool router::add( unsigned methods, const std::string &pattern, int route ) {
+    if( !methods || pattern.empty() || pattern[0] != '/' || route < 0 )
+        return false;
+    return insert_route( (route_node *)self, pattern.data(), pattern.data() + pattern.size(), methods, route, 0 );
+}
+
+bool router::match( method_mask method, const char *path, size_t len, route_match &out ) const {
+    out.route = -1;
+    out.allowed = 0;
+    out.count = 0;
+    return match_route( (const route_node *)self, path, path + len, method, out );
+}
+
+bool router::match( const request &req, route_match &out ) const {
+    size_t len = req.location.find_first_of( "?#" );
+    return match( method_from( req.method ), req.location.data(), len == std::string::npos ? req.location.size() : len, out );
+}
+
+namespace
+{
+    // well-known services. used to name protocols and to guess default ports
+    const struct service_t {
+        unsigned port;
+        const char *name;
+    } services[] = {
+        {    7, "echo" },
+        {   13, "daytime" },
+        {   17, "qotd" },
+        {   20, "ftp-data" },
+        {   21, "ftp" },
+        {   22, "ssh" },
+        {   23, "telnet" },
+        {   25, "smtp" },
+        {   37, "time" },
+        {   53, "dns" },
+        {   69, "tftp" },
+        {   70, "gopher" },
+        {   79, "finger" },
+        {   80, "http" },
+        {  110, "pop" },
+        {  113, "ident" },
+        {  119, "nntp" },
+        {  123, "ntp" },
+        {  138, "netbios" },
+        {  143, "imap" },
+        {  161, "snmp" },
+        {  443, "https" },
+        {  465, "smtps" },
+        {  500, "ipsec" },
+        {  513, "rlogin" },
+        {  993, "imaps" },
+        {  995, "pops" },
+        { 1080, "socks" },
+        { 3306, "mysql" },
+        { 5000, "upnp" },
+        { 5222, "xmpp" },
+        { 5223, "xmpps" },
+        { 5269, "xmpp-server" },
+        { 6667, "irc" },
+        { 8080, "http" }
+    };
+
+    const char *service_name( unsigned port ) {
+        for( auto &s : services )
+            if( s.port == port )
+                return s.name;
+        return 0;
+    }
+
+    unsigned service_port( const span &scheme ) {
+        for( auto &s : services )
+            if( strlen( s.name ) == scheme.len && equal_nocase( s.name, scheme.ptr, scheme.len ) )
+                return s.port;
+        return 80;
+    }
+
+    // returns 4 or 6 if host is an ip literal, 0 otherwise
+    int parse_ip( const span &host, unsigned char ip[16] ) {
+        char buf[ 64 ];
+        if( host.empty() || host.len >= sizeof( buf ) )
+            return 0;
+        memcpy( buf, host.ptr, host.len );
+        buf[ host.len ] = '\0';
+        if( memchr( buf, ':', host.len ) )
+            return inet_pton( AF_INET6, buf, ip ) == 1 ? 6 : 0;
+        return inet_pton( AF_INET, buf, ip ) == 1 ? 4 : 0;
+    }
+
+    uri resolve( const char *addr, unsigned port )
+    {
+        INIT();
+
+        uri out;
+        out.ok = false;
+
+        for( int i = 0; i < 6; ++i )
+            out.inet.ip[i] = 0;
+        out.inet.port = 0;
+
+        if( port > 65535 || port == 0 )
+            return out;
+
+        addrinfo hints, *res;
+        memset( &hints, 0, sizeof( hints ) );
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_CANONNAME;
+
+        if( getaddrinfo( addr, NULL, &hints, &res ) != 0 )
+            return out;
 
-                std::deque<std::string> hostport = split( localhost[2], ":" );
-                map["host"] = hostport[0];
-                map["port"] = hostport.size() > 1 ? hostport[2] : std::string();
-            } else {
-                std::deque<std::string> hostport = split( localhost[0], ":" );
-                map["host"] = hostport[0];
-                map["port"] = hostport.size() > 1 ? hostport[2] : std::string();
+        // prefer ipv4, which is the only family uri::inet can hold
+        const addrinfo *ai = res;
+        for( const addrinfo *it = res; it; it = it->ai_next )
+            if( it->ai_family == AF_INET ) {
+                ai = it;
+                break;
             }
 
-            tokens.pop_front(); // user:pass@host:port
+        char ip[ INET6_ADDRSTRLEN ] = { 0 };
+        if( ai->ai_family == AF_INET ) {
+            sockaddr_in *sa = (sockaddr_in *)ai->ai_addr;
+            const unsigned char *b = (const unsigned char *)&sa->sin_addr;
+            for( int i = 0; i < 4; ++i )
+                out.inet.ip[i] = b[i];
+            inet_ntop( AF_INET, &sa->sin_addr, ip, sizeof( ip ) );
+        } else {
+            sockaddr_in6 *sa = (sockaddr_in6 *)ai->ai_addr;
+            inet_ntop( AF_INET6, &sa->sin6_addr, ip, sizeof( ip ) );
         }
+        out.inet.port = port;
+
+        auto &pretty = out.pretty;
+        const char *name = service_name( port );
+
+        pretty.protocol = name ? std::string( name ) + "://" : std::string();
+        pretty.hostname = res->ai_canonname ? res->ai_canonname : addr;
+        pretty.ip = ip;
+        pretty.port = std::to_string( port );
+        pretty.address = addr;
+        pretty.url = pretty.protocol + pretty.address + ':' + pretty.port;
+
+        freeaddrinfo( res );
+
+        return out.ok = true, out;
+    }
+}
 
-        // path = sum of remaining tokens: /, ..., /, ..., [ /, ... ]
-        for( auto &token : tokens )
-            ( map["path"] = map["path"] ) += token;
+bool parse_url( const char *p, size_t n, url &out )
+{
+    const char *cur = p, *end = p + n;
+
+    out = url();
+
+    // scheme:// (optional)
+    const char *s = cur;
+    while( s < end && ( isalnum( (unsigned char)*s ) || *s == '+' || *s == '-' || *s == '.' ) )
+        ++s;
+    if( s > cur && end - s >= 3 && s[0] == ':' && s[1] == '/' && s[2] == '/' ) {
+        out.scheme = span( cur, s - cur );
+        cur = s + 3;
+    }
+
+    // authority: [user[:pass]@]host[:port]
+    const char *auth = cur;
+    while( cur < end && *cur != '/' && *cur != '?' && *cur != '#' )
+        ++cur;
+    const char *auth_end = cur;
+
+    const char *host = auth, *at = 0;
+    for( const char *c = auth; c < auth_end; ++c )
+        if( *c == '@' )
+            at = c;
+    if( at ) {
+        const char *colon = (const char *)memchr( auth, ':', at - auth );
+        out.user = span( auth, ( colon ? colon : at ) - auth );
+        if( colon )
+            out.pass = span( colon + 1, at - colon - 1 );
+        host = at + 1;
+    }
+
+    if( host < auth_end && *host == '[' ) {
+        const char *close = (const char *)memchr( host, ']', auth_end - host );
+        if( !close )
+            return out.ok = false;
+        out.host = span( host + 1, close - host - 1 );
+        if( close + 1 < auth_end ) {
+            if( close[1] != ':' )
+                return out.ok = false;
+            out.port = span( close + 2, auth_end - close - 2 );
+        }
+    } else {
+        const char *colon = 0;
+        int colons = 0;
+        for( const char *c = host; c < auth_end; ++c )
+            if( *c == ':' )
+                colon = c, ++colons;
+        if( colons == 1 ) {
+            out.host = span( host, colon - host );
+            out.port = span( colon + 1, auth_end - colon - 1 );
+        } else {
+            out.host = span( host, auth_end - host ); // bare ipv6 literals have many colons
+        }
+    }
 
-        if( map["port"].empty() )
-            map["port"] = "80";
+    // path?query#fragment
+    const char *path = cur;
+    while( cur < end && *cur != '?' && *cur != '#' )
+        ++cur;
+    out.path = span( path, cur - path );
+
+    if( cur < end && *cur == '?' ) {
+        const char *query = ++cur;
+        while( cur < end && *cur != '#' )
+            ++cur;
+        out.query = span( query, cur - query );
+    }
 
-        if( map["path"].empty() )
-            map["path"] = "/";
+    if( cur < end && *cur == '#' ) {
+        ++cur;
+        out.fragment = span( cur, end - cur );
+    }
 
-        return map;
+    // port
+    if( !out.port.empty() ) {
+        unsigned number = 0;
+        for( const char *c = out.port.begin(); c != out.port.end(); ++c )
+            if( *c < '0' || *c > '9' || ( number = number * 10 + ( *c - '0' ) ) > 65535 )
+                return out.ok = false;
+        if( !number )
+            return out.ok = false;
+        out.port_number = number;
+    } else {
+        out.port_number = service_port( out.scheme );
     }
+
+    out.ip_version = parse_ip( out.host, out.ip );
+
+    return out.ok = true;
+}
+
+bool parse_url( const char *text, url &out )
+{
+    return parse_url( text, strlen( text ), out );
+}
+
+bool parse_url( const std::string &text, url &out )
+{
+    return parse_url( text.data(), text.size(), out );
 }
 
-uri lookup( const std::string &url )
+uri lookup( const std::string &addr, unsigned port )
 {
-    auto map = decompose(url);
-    auto   u = lookup( map["host"], map["port"] );
+    return resolve( addr.c_str(), port );
+}
 
-    u.pretty.user = map["user"];
-    u.pretty.pass = map["pass"];
-    u.pretty.host = map["host"];
-    u.pretty.port = map["port"];
-    u.pretty.path = map["path"];
-    u.pretty.full = map["full"];
+uri lookup( const std::string &addr, const std::string &port )
+{
+    char *end;
+    unsigned long p = strtoul( port.c_str(), &end, 10 );
+    if( port.empty() || *end || p > 65535 ) {
+        uri u;
+        u.ok = false;
+        return u;
+    }
+    return resolve( addr.c_str(), (unsigned)p );
+}
 
-    if( map["proto"].size() )
-        u.pretty.protocol = map["proto"];
+uri lookup( const std::string &text )
+{
+    url parts;
+    char host[ 256 ] = { 0 };
+
+    bool ok = parse_url( text, parts ) && parts.host.len < sizeof( host );
+    if( ok )
+        memcpy( host, parts.host.ptr, parts.host.len );
+
+    uri u = resolve( host, ok ? parts.port_number : 0 );
+
+    auto &pretty = u.pretty;
+    pretty.user.assign( parts.user.ptr, parts.user.len );
+    pretty.pass.assign( parts.pass.ptr, parts.pass.len );
+    pretty.host.assign( parts.host.ptr, parts.host.len );
+    pretty.port = std::to_string( parts.port_number );
+    pretty.query.assign( parts.query.ptr, parts.query.len );
+    pretty.fragment.assign( parts.fragment.ptr, parts.fragment.len );
+    pretty.full = text;
+
+    // path keeps everything after the authority, as requested to servers
+    if( parts.path.ptr )
+        pretty.path.assign( parts.path.ptr, text.data() + text.size() - parts.path.ptr );
+    if( pretty.path.empty() || pretty.path[0] != '/' )
+        pretty.path.insert( 0, 1, '/' );
+
+    if( !parts.scheme.empty() ) {
+        pretty.protocol.assign( parts.scheme.ptr, parts.scheme.len );
+        pretty.protocol += "://";
+        pretty.url = pretty.protocol + pretty.address + ':' + pretty.port;
+    }
 
     return u;
 }
@@ -1053,6 +8111,8 @@ std::string uri::print() const {
 
     $p(pretty.full);
     $p(pretty.path);
+    $p(pretty.query);
+    $p(pretty.fragment);
     $p(pretty.url);
     $p(pretty.protocol);
     $p(pretty.hostname);
@@ -1084,6 +8144,7 @@ std::string uri::print() const {
 #undef $welse
 #undef $windows
 
+#undef POLL
 #undef SHUTDOWN_W
 #undef SHUTDOWN_R
 #undef SHUTDOWN
@@ -0,0 +1,53 @@
+// build with -std=c++20
+#include <cstdlib>
+#include <iostream>
+#include "knot.hpp"
+
+#if defined(__cpp_impl_coroutine)
+
+knot::reactor loop;
+
+knot::task serve( int child_fd )
+{
+    knot::request req;
+
+    // every await suspends this handler; the reactor thread keeps serving other sockets meanwhile
+    if( co_await knot::async_receive_www( loop, child_fd, req, 30 ) )
+    {
+        std::string body = "hello from " + req.location;
+        co_await knot::async_send( loop, child_fd, "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string( body.size() ) + "\r\n\r\n" + body, 30 );
+    }
+
+    knot::disconnect( child_fd );
+}
+
+void on_accept( int master_fd, int child_fd, std::string client_addr_ip, std::string client_addr_port )
+{
+    serve( child_fd );
+}
+
+int main( int argc, const char **argv )
+{
+    int server_socket;
+
+    if( !knot::listen( server_socket, "0.0.0.0", "8080", on_accept, 1024 ) )
+        return std::cerr << "server error: cant listen at port 8080" << std::endl, 1;
+
+    std::cout << "server says: ready at port 8080" << std::endl;
+
+    loop.run();
+
+    knot::shutdown();
+
+    return 0;
+}
+
+#else
+
+int main()
+{
+    std::cerr << "this sample requires c++20 coroutines" << std::endl;
+    return 1;
+}
+
+#endif
@@ -15,7 +15,8 @@ void echo_www( int master_fd, int child_fd, std::string client_addr_ip, std::str
     if( !knot::receive_www( child_fd, input ) )
         die( "server error: cant recv" );
 
-    if( !knot::send( child_fd, "HTTP 200 OK\r\n\r\n" + input ) )
+    knot::response res;
+    if( !res.start( 200 ).header( knot::H_CONTENT_TYPE, "text/plain" ).body( input ).send( child_fd ) )
         die( "server error: cant send" );
 
     if( !knot::disconnect( child_fd ) )
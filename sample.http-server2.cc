@@ -2,7 +2,6 @@
 #include <iostream>
 #include "knot.hpp"
 #include <climits>
-#include <map>
 
 void die( const std::string &message )
 {
@@ -10,33 +9,52 @@ void die( const std::string &message )
     std::exit( 1 );
 }
 
+enum { ECHO, USER, FILES };
+knot::router routes;
+
 void echo_www( int master_fd, int child_fd, std::string client_addr_ip, std::string client_addr_port )
 {
-    std::string input;
-    std::string method;
-    std::string data;
-    std::string location;
-    std::map<std::string, std::string> headers;
+    knot::request req;
 
-    if( !knot::receive_www( child_fd, method, location, input, data, headers, 600, knot::RM_GET | knot::RM_POST | knot::RM_PUT  ) )
+    if( !knot::receive_www( child_fd, req, 600, knot::RM_GET | knot::RM_POST | knot::RM_PUT  ) )
         die( "server error: cant recv" );
 
-    if( !knot::send( child_fd, "HTTP 200 OK\r\n\r\n" + input ) )
+    knot::route_match match;
+    routes.match( req, match );
+
+    knot::response res;
+    std::string output;
+    switch( match.route )
+    {
+        case ECHO:  output = req.input; break;
+        case USER:  output = "user " + match.get( "id" ); break;
+        case FILES: output = "file " + match.get( "path" ); break;
+    }
+
+    if( match.route >= 0 )
+        res.start( 200 ).header( knot::H_CONTENT_TYPE, "text/plain" ).body( output );
+    else
+        res.start( match.allowed ? 405 : 404 ).body( "" );
+
+    if( !res.send( child_fd ) )
         die( "server error: cant send" );
 
     if( !knot::disconnect( child_fd ) )
         die( "server error: cant close" );
     
-    std::cout << "hit ("<<method<<") to " << location << " from " << client_addr_ip << ':' << client_addr_port << ". Data-length: " << data.length() << std::endl;
+    std::cout << "hit ("<<req.method<<") to " << req.location << " from " << client_addr_ip << ':' << client_addr_port << ". Data-length: " << req.data.length() << std::endl;
     std::cout << "Headers: " << std::endl;
-    for (auto i = headers.begin(); i != headers.end(); ++i)
-    {
-	std::cout << i->first << ": " << i->second << std::endl;
-    }
+    for( size_t i = 0; i < req.headers.size(); ++i )
+        std::cout << req.headers[i].key.str() << ": " << req.headers[i].value.str() << std::endl;
+    std::cout << "User-Agent: " << req.headers.get( knot::H_USER_AGENT ) << std::endl;
 }
 
 int main( int argc, const char **argv )
 {
+    routes.add( knot::RM_ALL, "/", ECHO );
+    routes.add( knot::RM_GET | knot::RM_PUT, "/users/:id", USER );
+    routes.add( knot::RM_GET, "/files/*path", FILES );
+
     int server_socket;
     if( !knot::listen( server_socket, "0.0.0.0", "8080", echo_www, 1024 ) )
         die( "server error: cant listen at port 8080" );
@@ -0,0 +1,53 @@
+// thread-per-core http server. every connection lives on the pinned core thread that accepted it
+#include <iostream>
+#include <string>
+#include "knot.hpp"
+
+struct connection
+{
+    int fd;
+    knot::request req;
+    std::string output;
+};
+
+void done( knot::reactor &loop, connection *c )
+{
+    knot::disconnect( c->fd );
+    delete c;
+}
+
+void on_accept( knot::reactor &loop, int child_fd, const knot::peer &client )
+{
+    connection *c = new connection;
+    c->fd = child_fd;
+
+    loop.async_receive_www( c->fd, c->req, [&loop, c]( bool ok ) {
+        if( !ok )
+            return done( loop, c );
+
+        std::string body = "hello from " + c->req.location;
+        c->output = "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string( body.size() ) + "\r\nConnection: close\r\n\r\n" + body;
+        loop.async_send( c->fd, c->output, [&loop, c]( bool ) { done( loop, c ); }, 30 );
+    }, 30 );
+}
+
+int main( int argc, const char **argv )
+{
+    int server_socket;
+
+    knot::core_config config;
+    config.numa_local = true;
+
+    if( !knot::listen( server_socket, "0.0.0.0", "8080", on_accept, config, knot::sockopts::latency() ) )
+        return std::cerr << "server error: cant listen at port 8080" << std::endl, 1;
+
+    std::cout << "server says: ready at port 8080, press enter to quit" << std::endl;
+    std::cin.get();
+
+    for( auto &s : knot::get_core_stats( server_socket ) )
+        std::cout << "cpu " << s.cpu << ": " << s.accepted << " connections, " << s.bytes_received << " bytes in, " << s.bytes_sent << " bytes out" << std::endl;
+
+    knot::shutdown();
+
+    return 0;
+}
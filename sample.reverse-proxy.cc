@@ -0,0 +1,30 @@
+// usage: sample.reverse-proxy [upstream-host upstream-port]
+// forwards http traffic from port 8080 to upstream (127.0.0.1:8081 by default)
+#include <iostream>
+#include "knot.hpp"
+
+knot::proxy *backend;
+
+void forward( int master_fd, int child_fd, std::string client_addr_ip, std::string client_addr_port )
+{
+    backend->forward_www( child_fd, client_addr_ip );
+    knot::disconnect( child_fd );
+}
+
+int main( int argc, const char **argv )
+{
+    backend = new knot::proxy( argc > 2 ? argv[1] : "127.0.0.1", argc > 2 ? argv[2] : "8081" );
+
+    int server_socket;
+    if( !knot::listen( server_socket, "0.0.0.0", "8080", forward, 1024 ) )
+        return std::cerr << "server error: cant listen at port 8080" << std::endl, 1;
+
+    std::cout << "server says: ready at port 8080" << std::endl;
+
+    for(;;)
+        knot::sleep( 1.0 );
+
+    knot::shutdown();
+
+    return 0;
+}
@@ -0,0 +1,42 @@
+// usage: sample.static-server [root]
+// serves files from root (current directory by default) at port 8080
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include "knot.hpp"
+
+knot::file_server *files;
+knot::access_log *hits;
+
+void serve_file( int master_fd, int child_fd, const knot::peer &client )
+{
+    knot::request req;
+
+    if( knot::receive_www( child_fd, req, 30, knot::RM_GET | knot::RM_HEAD ) )
+    {
+        auto start = std::chrono::steady_clock::now();
+        int status = files->serve( child_fd, req );
+        hits->log( client, req, status, 0, std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count() );
+    }
+
+    knot::disconnect( child_fd );
+}
+
+int main( int argc, const char **argv )
+{
+    files = new knot::file_server( argc > 1 ? argv[1] : "." );
+    hits = new knot::access_log();  // to stdout
+
+    int server_socket;
+    if( !knot::listen( server_socket, "0.0.0.0", "8080", serve_file ) )
+        return std::cerr << "server error: cant listen at port 8080" << std::endl, 1;
+
+    std::cout << "server says: ready at port 8080" << std::endl;
+
+    for(;;)
+        knot::sleep( 1.0 );
+
+    knot::shutdown();
+
+    return 0;
+}
@@ -0,0 +1,52 @@
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include "knot.hpp"
+
+void die( const std::string &message )
+{
+    std::cerr << message.c_str() << std::endl;
+    std::exit( 1 );
+}
+
+int main( int argc, const char **argv )
+{
+    int server, client;
+
+    if( !knot::bind_udp( server, "127.0.0.1", "8125" ) )
+        die( "server error: cant bind udp port 8125" );
+
+    if( !knot::bind_udp( client, "127.0.0.1", "0" ) )
+        die( "client error: cant bind udp socket" );
+
+    // client: queue a few datagrams and send them in one go
+    knot::datagram_batch out( 8 );
+    for( const char *msg : { "hello", "udp", "world" } )
+        out.push( msg, strlen( msg ), "127.0.0.1", "8125" );
+
+    if( knot::send_batch( client, out ) != 3 )
+        die( "client error: cant send" );
+
+    // server: drain all queued datagrams per call and echo them back
+    knot::datagram_batch in( 64 ), echo( 64 );
+    int received = knot::recv_batch( server, in, 1.0 );
+    if( received <= 0 )
+        die( "server error: cant recv" );
+
+    for( int i = 0; i < received; ++i )
+        echo.push( in[i].data, in[i].size, in[i] );
+
+    if( knot::send_batch( server, echo ) != received )
+        die( "server error: cant send" );
+
+    // client: read answers one by one
+    std::string answer, ip, port;
+    for( int i = 0; i < received; ++i )
+        if( knot::recv_from( client, answer, ip, port, 1.0 ) )
+            std::cout << "client says: answer='" << answer << "' from " << ip << ':' << port << std::endl;
+
+    knot::disconnect( client );
+    knot::disconnect( server );
+
+    return 0;
+}
@@ -0,0 +1,54 @@
+#include <cstdlib>
+#include <iostream>
+#include "knot.hpp"
+
+void die( const std::string &message )
+{
+    std::cerr << message.c_str() << std::endl;
+    std::exit( 1 );
+}
+
+void on_message( int fd, const std::string &message, int opcode )
+{
+    if( opcode == knot::WS_CLOSE )
+        std::cout << "server says: websocket " << fd << " closed" << std::endl;
+    else
+        knot::ws_send( fd, message, opcode );
+}
+
+void upgrade( int master_fd, int child_fd, std::string client_addr_ip, std::string client_addr_port )
+{
+    std::string method, location, input, data;
+    knot::headers headers;
+
+    if( !knot::receive_www( child_fd, method, location, input, data, headers, 600, knot::RM_GET ) )
+        return (void)knot::disconnect( child_fd );
+
+    if( !knot::ws_upgrade( child_fd, headers ) )
+    {
+        knot::send( child_fd, "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n" );
+        return (void)knot::disconnect( child_fd );
+    }
+
+    // a single shared thread serves every upgraded socket from now on
+    knot::ws_attach( child_fd, on_message );
+
+    std::cout << "server says: websocket from " << client_addr_ip << ':' << client_addr_port << std::endl;
+}
+
+int main( int argc, const char **argv )
+{
+    int server_socket;
+
+    if( !knot::listen( server_socket, "0.0.0.0", "8080", upgrade, 1024 ) )
+        die( "server error: cant listen at port 8080" );
+
+    std::cout << "server says: ready at ws://localhost:8080" << std::endl;
+
+    for(;;)
+        knot::sleep( 1.0 );
+
+    knot::shutdown();
+
+    return 0;
+}
@@ -0,0 +1,71 @@
+// usage: sample.zerocopy-bench [host port]
+// sends 1 GiB in 8 MiB buffers with copying and zero-copy sends, then compares sender cpu time.
+// without arguments it sends to a local sink, where the kernel copies anyway (no gain expected).
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include "knot.hpp"
+
+void die( const std::string &message )
+{
+    std::cerr << message.c_str() << std::endl;
+    std::exit( 1 );
+}
+
+void sink( int master_fd, int child_fd, std::string client_addr_ip, std::string client_addr_port )
+{
+    std::string discard;
+    knot::receive( child_fd, discard, 0 );
+    knot::disconnect( child_fd );
+}
+
+double thread_cpu_ms()
+{
+    timespec ts;
+    clock_gettime( CLOCK_THREAD_CPUTIME_ID, &ts );
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+void bench( const char *name, const std::string &host, const std::string &port, bool zerocopy )
+{
+    const size_t chunk = 8 << 20, total = 1 << 30;
+
+    int fd;
+    if( !knot::connect( fd, host, port ) )
+        die( "client error: cant connect" );
+
+    auto wall = std::chrono::steady_clock::now();
+    double cpu = thread_cpu_ms();
+
+    for( size_t sent = 0; sent < total; sent += chunk )
+    {
+        std::string buffer( chunk, 'x' );
+        bool ok = zerocopy ? knot::send_zerocopy( fd, std::move( buffer ) ) : knot::send( fd, buffer );
+        if( !ok )
+            die( "client error: cant send" );
+    }
+
+    knot::disconnect( fd ); // waits for outstanding zero-copy completions
+
+    double ms = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - wall ).count();
+    std::cout << name << ": " << ( total >> 20 ) / ( ms / 1000 ) << " MiB/s, sender cpu " << thread_cpu_ms() - cpu << " ms" << std::endl;
+}
+
+int main( int argc, const char **argv )
+{
+    std::string host = argc > 2 ? argv[1] : "127.0.0.1";
+    std::string port = argc > 2 ? argv[2] : "8081";
+
+    int server_socket = -1;
+    if( argc <= 2 && !knot::listen( server_socket, host, port, sink ) )
+        die( "server error: cant listen at port 8081" );
+
+    bench( "send()         ", host, port, false );
+    bench( "send_zerocopy()", host, port, true );
+
+    knot::shutdown();
+
+    return 0;
+}